@@ -98,10 +98,10 @@ bool EchoApp::PrintReceivedData() {
   struct sockaddr_in request_src;
   socklen_t request_src_size = sizeof(request_src);
 
-  char buffer[4096];
-  memset(buffer, 0, sizeof(buffer));
+  // RS updates go to the mobile node's control socket, so this is all ours
+  char buffer[MAX_DATAGRAM_SIZE];
 #ifdef UDP_APPLICATION
-  int bytes_read = recvfrom(app_socket_, buffer, sizeof(buffer), MSG_PEEK,
+  int bytes_read = recvfrom(app_socket_, buffer, sizeof(buffer), 0,
                             reinterpret_cast<struct sockaddr*>(&request_src),
                             &request_src_size);
 #elif TCP_APPLICATION
@@ -110,22 +110,18 @@ bool EchoApp::PrintReceivedData() {
 #endif
 
   // Received a communication
-  if (bytes_read > 0 && request_src.sin_addr.s_addr !=
-      static_cast<unsigned int>(IPStringToInt(rendezvous_server_))) {
-    // Clear the peek buffer
-    recvfrom(app_socket_, buffer, sizeof(buffer), 0,
-             reinterpret_cast<struct sockaddr*>(&request_src),
-             &request_src_size);
-    mobile_node_->MessageReceived(app_socket_, NetworkMsg(buffer));
+  if (bytes_read > 0) {
+    NetworkMsg message = MsgFromDatagram(buffer, bytes_read);
+    mobile_node_->MessageReceived(app_socket_, message);
 
     // Echo back the peer's communication
-    if (string(buffer) != keyword_) {
-      Log(stderr, SUCCESS, "Received message '%s' from %d:%d", &buffer[0],
+    if (message != keyword_) {
+      Log(stderr, SUCCESS, "Received message '%s' from %d:%d", message.c_str(),
           request_src.sin_addr.s_addr, ntohs(request_src.sin_port));
-      SendMessage(buffer, reinterpret_cast<struct sockaddr*>(&request_src));
+      SendMessage(message, reinterpret_cast<struct sockaddr*>(&request_src));
 
-      // HACK: Claim we received the message because we don't expect this back
-      mobile_node_->MessageReceived(app_socket_, NetworkMsg(buffer));
+      // The echo is never coming back, so release it (and only it) right away
+      mobile_node_->MessageReceived(app_socket_, message);
 
     // Received back our own, bury it...
     } else {
@@ -145,6 +141,10 @@ bool EchoApp::SendMessage(NetworkMsg message, struct sockaddr* peer_info) {
   // Avoid sending dups and set the sentinel if this is our heartbeat going out
   if (message == keyword_ && !received_)
     return false;
+
+  // Hold off while the peer has too much left to acknowledge
+  if (!mobile_node_->MessageSent(app_socket_, message))
+    return false;
   if (message == keyword_)
     received_ = false;
 
@@ -160,7 +160,6 @@ bool EchoApp::SendMessage(NetworkMsg message, struct sockaddr* peer_info) {
 
   // Report out to the user that we're sending
   Log(stderr, DEBUG, "Sending %s to our friend...", message.c_str());
-  mobile_node_->MessageSent(app_socket_, message);
   return true;
 }
 
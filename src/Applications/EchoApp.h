@@ -28,6 +28,7 @@
 
 using Utils::Die;
 using Utils::Log;
+using Utils::MsgFromDatagram;
 
 class EchoApp : public Application {
  public:
@@ -0,0 +1,262 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a cuckoo filter: a compact set of (hashed) names that answers "is
+ * it there?" with no false negatives and rare false positives, and that
+ * (unlike a Bloom filter) names can be removed from
+ **/
+
+#ifndef _PERMANENTIP_COMMON_CUCKOOFILTER_H_
+#define _PERMANENTIP_COMMON_CUCKOOFILTER_H_
+
+#include <stdint.h>
+#include <vector>
+
+using std::vector;
+
+/**
+ * Each bucket holds @ref CUCKOO_BUCKET_SIZE 16-bit fingerprints (a bucket is
+ * a single 8-byte word), and a name that finds both of its buckets full may
+ * move up to @ref CUCKOO_MAX_KICKS others out of the way before the filter
+ * is declared full
+ **/
+#define CUCKOO_BUCKET_SIZE 4
+#define CUCKOO_MAX_KICKS 500
+
+/**
+ * A CuckooFilter keeps only a fingerprint of each name, in one of two buckets
+ * that both follow from the name's hash, so that a lookup reads at most two
+ * words and a miss never touches the names themselves.  It knows nothing of
+ * the names, so callers pass in the (64-bit) hash of each, may only remove
+ * names they have added, and must rebuild the filter (bigger) from their own
+ * names whenever Add() fails.  The filter is not thread-safe.
+ **/
+class CuckooFilter {
+ public:
+  /**
+   * The constructor makes an empty filter
+   *
+   * @param     buckets   How many buckets to start with (a power of two)
+   **/
+  explicit CuckooFilter(uint32_t buckets = 16)
+    : fingerprints_(buckets * CUCKOO_BUCKET_SIZE, 0), mask_(buckets - 1),
+      size_(0), random_(0x2545f4914f6cdd1dULL) {}
+
+  virtual ~CuckooFilter() {}
+
+  /**
+   * MayContain() tells whether a name may have been added
+   *
+   * @param     hash      The hash of the name
+   * @returns   False only if the name is certainly not in the filter
+   **/
+  bool MayContain(uint64_t hash) const {
+    hash = Mix(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    uint32_t first = Bucket(hash);
+    return Holds(first, fingerprint) ||
+           Holds(Alternate(first, fingerprint), fingerprint);
+  }
+
+  /**
+   * Add() puts a name into the filter
+   *
+   * @param     hash      The hash of the name
+   * @returns   False if the filter is full, in which case it must be rebuilt
+   *            (some other name may have been pushed out to make room)
+   **/
+  bool Add(uint64_t hash) {
+    hash = Mix(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    uint32_t bucket = Bucket(hash);
+    if (Put(bucket, fingerprint) ||
+        Put(Alternate(bucket, fingerprint), fingerprint)) {
+      size_++;
+      return true;
+    }
+
+    // Evict someone at random, and send them off to their other bucket
+    for (int kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+      random_ ^= random_ << 13;
+      random_ ^= random_ >> 7;
+      random_ ^= random_ << 17;
+      if (random_ & 1)
+        bucket = Alternate(bucket, fingerprint);
+
+      uint16_t& victim =
+        fingerprints_[bucket * CUCKOO_BUCKET_SIZE +
+                      (random_ >> 1) % CUCKOO_BUCKET_SIZE];
+      uint16_t evicted = victim;
+      victim = fingerprint;
+      fingerprint = evicted;
+      bucket = Alternate(bucket, fingerprint);
+      if (Put(bucket, fingerprint)) {
+        size_++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Remove() takes a name that was added back out of the filter
+   *
+   * @param     hash      The hash of the name
+   **/
+  void Remove(uint64_t hash) {
+    hash = Mix(hash);
+    uint16_t fingerprint = Fingerprint(hash);
+    uint32_t bucket = Bucket(hash);
+    if (Take(bucket, fingerprint) ||
+        Take(Alternate(bucket, fingerprint), fingerprint))
+      size_--;
+  }
+
+  /**
+   * Clear() empties the filter, resizing it
+   *
+   * @param     buckets   How many buckets it should have (a power of two)
+   **/
+  void Clear(uint32_t buckets) {
+    fingerprints_.assign(buckets * CUCKOO_BUCKET_SIZE, 0);
+    mask_ = buckets - 1;
+    size_ = 0;
+  }
+
+  /**
+   * Fill() empties the filter and adds every name of a set that will not
+   * change, at most 7/8 of the way full (doubling it until they all fit)
+   *
+   * @param     hashes    The hash of every name
+   **/
+  void Fill(const vector<uint64_t>& hashes) {
+    uint32_t buckets = 1;
+    while (buckets * CUCKOO_BUCKET_SIZE * 7 / 8 < hashes.size())
+      buckets *= 2;
+    for (bool filled = false; !filled; buckets *= 2) {
+      Clear(buckets);
+      filled = true;
+      for (unsigned int i = 0; filled && i < hashes.size(); i++)
+        filled = Add(hashes[i]);
+    }
+  }
+
+  /**
+   * @returns   The number of names in the filter...
+   **/
+  uint32_t Size() const {
+    return size_;
+  }
+
+  /**
+   * ...and the number it has room for (though it may fill up sooner)
+   **/
+  uint32_t Capacity() const {
+    return fingerprints_.size();
+  }
+
+ private:
+  /**
+   * Every bucket's fingerprints, one after another (0 marks an empty slot)
+   **/
+  vector<uint16_t> fingerprints_;
+
+  /**
+   * The number of buckets, less one
+   **/
+  uint32_t mask_;
+
+  /**
+   * The number of names in the filter
+   **/
+  uint32_t size_;
+
+  /**
+   * The state of the (xorshift) generator that picks whom to evict
+   **/
+  uint64_t random_;
+
+  /**
+   * Mix() spreads every bit of a hash over all of its bits (callers such as
+   * the registry shards have already used some bits of it up, so that every
+   * name in one shard shares them)
+   *
+   * @returns   The mixed hash (by the MurmurHash3 finalizer)
+   **/
+  static uint64_t Mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+  }
+
+  /**
+   * @returns   The first bucket of a name, from the high bits of its mixed
+   *            hash...
+   **/
+  uint32_t Bucket(uint64_t mixed) const {
+    return static_cast<uint32_t>(mixed >> 32) & mask_;
+  }
+
+  /**
+   * ...and its fingerprint (never 0), from the low bits
+   **/
+  static uint16_t Fingerprint(uint64_t mixed) {
+    uint16_t fingerprint = static_cast<uint16_t>(mixed);
+    return (fingerprint == 0 ? 1 : fingerprint);
+  }
+
+  /**
+   * @returns   The other bucket a fingerprint may be in (which works both
+   *            ways, so an evicted fingerprint always knows where to go)
+   **/
+  uint32_t Alternate(uint32_t bucket, uint16_t fingerprint) const {
+    return (bucket ^ (fingerprint * 0x5bd1e995u)) & mask_;
+  }
+
+  /**
+   * @returns   True if a bucket holds a fingerprint
+   **/
+  bool Holds(uint32_t bucket, uint16_t fingerprint) const {
+    const uint16_t* slots = &fingerprints_[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++)
+      if (slots[i] == fingerprint)
+        return true;
+    return false;
+  }
+
+  /**
+   * @returns   True if the fingerprint was put into a free slot of a bucket
+   **/
+  bool Put(uint32_t bucket, uint16_t fingerprint) {
+    uint16_t* slots = &fingerprints_[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++) {
+      if (slots[i] == 0) {
+        slots[i] = fingerprint;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @returns   True if (one copy of) the fingerprint was taken out of a bucket
+   **/
+  bool Take(uint32_t bucket, uint16_t fingerprint) {
+    uint16_t* slots = &fingerprints_[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++) {
+      if (slots[i] == fingerprint) {
+        slots[i] = 0;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif  // _PERMANENTIP_COMMON_CUCKOOFILTER_H_
@@ -0,0 +1,225 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a batched datagram layer that reads many requests with a single
+ * recvmmsg and flushes all of their replies with a single sendmmsg
+ **/
+
+#ifndef _PERMANENTIP_COMMON_DATAGRAMBATCH_H_
+#define _PERMANENTIP_COMMON_DATAGRAMBATCH_H_
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <cstring>
+
+#include "Common/Types.h"
+
+/**
+ * A DatagramBatch owns a fixed set of receive buffers.  Replies are written
+ * in place over the request they answer (exactly as the servers did with
+ * their single stack buffer) and are sent back to the request's source.
+ **/
+class DatagramBatch {
+ public:
+  /**
+   * The constructor preallocates every buffer and message header we will need
+   * so that the hot path never allocates
+   *
+   * @param     batch_size    The most datagrams to read per system call
+   **/
+  explicit DatagramBatch(int batch_size = GLOB_BATCH_SIZE)
+      : batch_size_(batch_size < 1 ? 1 : batch_size), received_(0),
+        replies_(0) {
+    buffers_ = new char[batch_size_ * (MAX_DATAGRAM_SIZE + 1)];
+    sources_ = new struct sockaddr_in[batch_size_];
+    iovecs_ = new struct iovec[batch_size_];
+    messages_ = new struct mmsghdr[batch_size_];
+    reply_iovecs_ = new struct iovec[batch_size_];
+    reply_messages_ = new struct mmsghdr[batch_size_];
+  }
+
+  /**
+   * The destructor frees all of the preallocated buffers
+   **/
+  virtual ~DatagramBatch() {
+    delete[] buffers_;
+    delete[] sources_;
+    delete[] iovecs_;
+    delete[] messages_;
+    delete[] reply_iovecs_;
+    delete[] reply_messages_;
+  }
+
+  /**
+   * Receive() reads as many pending datagrams as fit in the batch without
+   * blocking.  Each datagram is NUL-terminated so that it can be treated as a
+   * C-string, and any replies queued from the previous batch are discarded.
+   *
+   * @param     fd        The non-blocking socket to read from
+   *
+   * @returns   The number of datagrams read, or -1 (with errno set, EAGAIN
+   *            meaning that the socket is drained)
+   **/
+  int Receive(int fd) {
+    for (int i = 0; i < batch_size_; i++) {
+      iovecs_[i].iov_base = Data(i);
+      iovecs_[i].iov_len = MAX_DATAGRAM_SIZE;
+
+      memset(&messages_[i], 0, sizeof(messages_[i]));
+      messages_[i].msg_hdr.msg_name = &sources_[i];
+      messages_[i].msg_hdr.msg_namelen = sizeof(sources_[i]);
+      messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+      messages_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    replies_ = 0;
+    received_ = recvmmsg(fd, messages_, batch_size_, MSG_DONTWAIT, NULL);
+    if (received_ < 0) {
+      received_ = 0;
+      return -1;
+    }
+
+    for (int i = 0; i < received_; i++)
+      Data(i)[messages_[i].msg_len] = '\0';
+    return received_;
+  }
+
+  /**
+   * @param     i         The index of a datagram in the current batch
+   * @returns   The (NUL-terminated) contents of the i-th datagram, which may
+   *            be overwritten in place with its reply
+   **/
+  char* Data(int i) {
+    return &buffers_[i * (MAX_DATAGRAM_SIZE + 1)];
+  }
+
+  /**
+   * @param     i         The index of a datagram in the current batch
+   * @returns   The number of bytes read into the i-th datagram
+   **/
+  int Length(int i) const {
+    return messages_[i].msg_len;
+  }
+
+  /**
+   * @param     i         The index of a datagram in the current batch
+   * @returns   The address the i-th datagram was sent from
+   **/
+  struct sockaddr_in* Source(int i) {
+    return &sources_[i];
+  }
+
+  /**
+   * QueueReply() marks the first length bytes of Data(i) to be sent back to
+   * Source(i) on the next Flush()
+   *
+   * @param     i         The index of the datagram being replied to
+   * @param     length    The number of bytes of the reply
+   **/
+  void QueueReply(int i, int length) {
+    reply_iovecs_[replies_].iov_base = Data(i);
+    reply_iovecs_[replies_].iov_len = length;
+
+    memset(&reply_messages_[replies_], 0, sizeof(reply_messages_[replies_]));
+    reply_messages_[replies_].msg_hdr.msg_name = &sources_[i];
+    reply_messages_[replies_].msg_hdr.msg_namelen = sizeof(sources_[i]);
+    reply_messages_[replies_].msg_hdr.msg_iov = &reply_iovecs_[replies_];
+    reply_messages_[replies_].msg_hdr.msg_iovlen = 1;
+    replies_++;
+  }
+
+  /**
+   * QueueReply() can also copy a reply message over Data(i) itself, sending
+   * exactly its payload and terminator (see Utils::MsgFromDatagram())
+   *
+   * @param     i         The index of the datagram being replied to
+   * @param     reply     The payload of the reply
+   **/
+  void QueueReply(int i, const NetworkMsg& reply) {
+    int length = (reply.length() < MAX_DATAGRAM_SIZE ?
+                  reply.length() : MAX_DATAGRAM_SIZE - 1);
+    memcpy(Data(i), reply.data(), length);
+    Data(i)[length] = '\0';
+    QueueReply(i, length + 1);
+  }
+
+  /**
+   * Flush() sends every queued reply, looping on partial sends.  Replies that
+   * the kernel will not take right now are dropped, as with any UDP reply.
+   *
+   * @param     fd        The socket to send the replies on
+   *
+   * @returns   The number of replies actually sent
+   **/
+  int Flush(int fd) {
+    int sent = 0;
+    while (sent < replies_) {
+      int result = sendmmsg(fd, &reply_messages_[sent], replies_ - sent, 0);
+      if (result < 0 && errno == EINTR)
+        continue;
+      else if (result <= 0)
+        break;
+      sent += result;
+    }
+
+    replies_ = 0;
+    return sent;
+  }
+
+  /**
+   * @returns   The most datagrams this batch reads per call to Receive()
+   **/
+  int Size() const {
+    return batch_size_;
+  }
+
+ private:
+  /**
+   * The most datagrams we read per system call...
+   **/
+  int batch_size_;
+
+  /**
+   * ...how many we actually read on the last Receive()...
+   **/
+  int received_;
+
+  /**
+   * ...and how many replies are waiting to be flushed
+   **/
+  int replies_;
+
+  /**
+   * Contiguous storage for every datagram in the batch (each slot holds
+   * @ref MAX_DATAGRAM_SIZE bytes plus a NUL terminator)
+   **/
+  char* buffers_;
+
+  /**
+   * The source address of every datagram in the batch
+   **/
+  struct sockaddr_in* sources_;
+
+  /**
+   * The scatter/gather and message headers handed to recvmmsg...
+   **/
+  struct iovec* iovecs_;
+  struct mmsghdr* messages_;
+
+  /**
+   * ...and to sendmmsg
+   **/
+  struct iovec* reply_iovecs_;
+  struct mmsghdr* reply_messages_;
+
+  // Batches own raw buffers so they may not be copied
+  DatagramBatch(const DatagramBatch&);
+  DatagramBatch& operator=(const DatagramBatch&);
+};
+
+#endif  // _PERMANENTIP_COMMON_DATAGRAMBATCH_H_
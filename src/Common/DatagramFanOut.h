@@ -0,0 +1,135 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a helper for sending one payload to many destinations with as few
+ * calls to sendmmsg as possible
+ **/
+
+#ifndef _PERMANENTIP_COMMON_DATAGRAMFANOUT_H_
+#define _PERMANENTIP_COMMON_DATAGRAMFANOUT_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <cstring>
+#include <vector>
+
+#include "Common/Types.h"
+
+using std::vector;
+
+/**
+ * The kernel will not take more than this many messages per sendmmsg
+ **/
+#define MAX_FANOUT_PER_CALL UIO_MAXIOV
+
+/**
+ * A DatagramFanOut collects destinations and then sends the same payload to
+ * all of them.  The vectors are reused between fan-outs so that, once warmed
+ * up, sending never allocates.
+ **/
+class DatagramFanOut {
+ public:
+  DatagramFanOut() {}
+  virtual ~DatagramFanOut() {}
+
+  /**
+   * Clear() forgets every destination added since the last fan-out
+   **/
+  void Clear() {
+    targets_.clear();
+  }
+
+  /**
+   * AddTarget() adds one more destination to the next fan-out
+   *
+   * @param     target    The address (and port) to send the payload to
+   **/
+  void AddTarget(const struct sockaddr_in& target) {
+    targets_.push_back(target);
+  }
+
+  /**
+   * AddTargets() adds a contiguous array of destinations at once
+   *
+   * @param     targets   The addresses (and ports) to send the payload to
+   * @param     count     The number of addresses in targets
+   **/
+  void AddTargets(const struct sockaddr_in* targets, int count) {
+    targets_.insert(targets_.end(), targets, targets + count);
+  }
+
+  /**
+   * @returns   The number of destinations waiting for the next Send()
+   **/
+  int Size() const {
+    return targets_.size();
+  }
+
+  /**
+   * Send() delivers the payload to every destination, @ref
+   * MAX_FANOUT_PER_CALL at a time.  The socket should be blocking so that a
+   * full send buffer delays, rather than drops, the fan-out.
+   *
+   * @param     fd        The socket to send on
+   * @param     payload   The bytes to send to every destination
+   * @param     length    The number of bytes in the payload
+   *
+   * @returns   The number of destinations the payload was sent to
+   **/
+  int Send(int fd, const char* payload, int length) {
+    payload_.iov_base = const_cast<char*>(payload);
+    payload_.iov_len = length;
+
+    messages_.resize(targets_.size());
+    for (unsigned int i = 0; i < targets_.size(); i++) {
+      memset(&messages_[i], 0, sizeof(messages_[i]));
+      messages_[i].msg_hdr.msg_name = &targets_[i];
+      messages_[i].msg_hdr.msg_namelen = sizeof(targets_[i]);
+      messages_[i].msg_hdr.msg_iov = &payload_;
+      messages_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = 0, refused = 0;
+    while (sent < Size()) {
+      int chunk = (Size() - sent < MAX_FANOUT_PER_CALL ?
+                   Size() - sent : MAX_FANOUT_PER_CALL);
+      int result = sendmmsg(fd, &messages_[sent], chunk, 0);
+      if (result < 0 && errno == EINTR)
+        continue;
+
+      // Skip past any destination the kernel refused outright
+      if (result <= 0) {
+        sent++;
+        refused++;
+      } else {
+        sent += result;
+      }
+    }
+
+    return sent - refused;
+  }
+
+ private:
+  /**
+   * Every destination of the next fan-out...
+   **/
+  vector<struct sockaddr_in> targets_;
+
+  /**
+   * ...the message headers that point at them...
+   **/
+  vector<struct mmsghdr> messages_;
+
+  /**
+   * ...and the single payload they all share
+   **/
+  struct iovec payload_;
+};
+
+#endif  // _PERMANENTIP_COMMON_DATAGRAMFANOUT_H_
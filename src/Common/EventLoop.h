@@ -0,0 +1,265 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a small readiness-based reactor (built on epoll) used by the
+ * server-like applications to sleep until one of their sockets, timers or
+ * the shutdown descriptor has something for them to do
+ **/
+
+#ifndef _PERMANENTIP_COMMON_EVENTLOOP_H_
+#define _PERMANENTIP_COMMON_EVENTLOOP_H_
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <tr1/unordered_map>
+
+using std::tr1::unordered_map;
+
+/**
+ * We can only wake up for so many descriptors in a single call to epoll_wait,
+ * anything beyond this is picked up on the next cycle
+ **/
+#define MAX_EVENTS_PER_WAKEUP 64
+
+/**
+ * Any class that wants to be woken up by the @ref EventLoop implements the
+ * EventHandler interface.  Because descriptors are registered edge-triggered
+ * the handler is responsible for draining the descriptor entirely (i.e. until
+ * it reports EAGAIN) every time it is called.
+ **/
+class EventHandler {
+ public:
+  virtual ~EventHandler() {}
+
+  /**
+   * HandleEvent() is called whenever the descriptor becomes readable (or,
+   * for timers, whenever the timer has fired at least once)
+   *
+   * @param     fd        The descriptor that is ready to be read from
+   *
+   * @returns   False if there was an unrecoverable error and the loop should
+   *            stop, true otherwise
+   **/
+  virtual bool HandleEvent(int fd) = 0;
+};
+
+/**
+ * The EventLoop wraps an epoll set along with an eventfd that can be written
+ * to from any thread (or a signal handler) to wake the loop up and stop it.
+ * Descriptors may be watched and unwatched from any thread, even while the
+ * loop is running.
+ **/
+class EventLoop {
+ public:
+  /**
+   * The constructor creates the epoll set and registers the shutdown eventfd
+   **/
+  EventLoop() : running_(true) {
+    pthread_mutex_init(&lock_, NULL);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    shutdown_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = shutdown_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, shutdown_fd_, &event);
+  }
+
+  /**
+   * The destructor closes the epoll set along with any timers we created (the
+   * watched sockets belong to their owners and are not closed here)
+   **/
+  virtual ~EventLoop() {
+    unordered_map<int, EventHandler*>::iterator it;
+    for (it = timers_.begin(); it != timers_.end(); it++)
+      close(it->first);
+
+    close(shutdown_fd_);
+    close(epoll_fd_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  /**
+   * Watch() registers a descriptor (edge-triggered) with the loop
+   *
+   * @param     fd        The non-blocking descriptor to watch for input
+   * @param     handler   The handler to call when fd becomes readable
+   *
+   * @returns   True unless epoll refused the descriptor
+   **/
+  bool Watch(int fd, EventHandler* handler) {
+    // The handler must be in place before the first (edge-triggered) event
+    pthread_mutex_lock(&lock_);
+    handlers_[fd] = handler;
+    pthread_mutex_unlock(&lock_);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+      // The descriptor may already be watched (by this same handler)
+      if (errno == EEXIST)
+        return true;
+
+      pthread_mutex_lock(&lock_);
+      handlers_.erase(fd);
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Unwatch() removes a descriptor (socket or timer) from the loop
+   *
+   * @param     fd        The descriptor to stop watching
+   **/
+  void Unwatch(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+
+    pthread_mutex_lock(&lock_);
+    handlers_.erase(fd);
+    bool timer = (timers_.erase(fd) > 0);
+    pthread_mutex_unlock(&lock_);
+
+    if (timer)
+      close(fd);
+  }
+
+  /**
+   * AddTimer() creates a periodic timer that calls back the handler every
+   * interval_ms milliseconds
+   *
+   * @param     interval_ms The period of the timer in milliseconds
+   * @param     handler     The handler to call when the timer fires
+   *
+   * @returns   The timer's descriptor (to be passed to Unwatch()), or -1
+   **/
+  int AddTimer(int interval_ms, EventHandler* handler) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0)
+      return -1;
+
+    struct itimerspec period;
+    period.it_interval.tv_sec = interval_ms / 1000;
+    period.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    period.it_value = period.it_interval;
+    pthread_mutex_lock(&lock_);
+    timers_[timer] = handler;
+    pthread_mutex_unlock(&lock_);
+
+    if (timerfd_settime(timer, 0, &period, NULL) < 0 || !Watch(timer, handler)) {
+      pthread_mutex_lock(&lock_);
+      timers_.erase(timer);
+      pthread_mutex_unlock(&lock_);
+      close(timer);
+      return -1;
+    }
+
+    return timer;
+  }
+
+  /**
+   * RunOnce() sleeps until at least one descriptor is ready (or timeout_ms
+   * passes, -1 meaning indefinitely) and dispatches every ready handler.
+   * Returning on signal interrupts lets the caller check its exit condition.
+   *
+   * @param     timeout_ms  How long to sleep when idle (Default: forever)
+   *
+   * @returns   False once the loop has been stopped or a handler failed
+   **/
+  bool RunOnce(int timeout_ms = -1) {
+    struct epoll_event events[MAX_EVENTS_PER_WAKEUP];
+    int ready = epoll_wait(epoll_fd_, events, MAX_EVENTS_PER_WAKEUP,
+                           timeout_ms);
+    if (ready < 0 && errno != EINTR)
+      running_ = false;
+
+    for (int i = 0; i < ready && running_; i++) {
+      int fd = events[i].data.fd;
+      if (fd == shutdown_fd_) {
+        running_ = false;
+        break;
+      }
+
+      pthread_mutex_lock(&lock_);
+      bool timer = (timers_.count(fd) > 0);
+      unordered_map<int, EventHandler*>::iterator it = handlers_.find(fd);
+      EventHandler* handler = (it == handlers_.end() ? NULL : it->second);
+      pthread_mutex_unlock(&lock_);
+
+      // Timers must be acknowledged or they will never fire again
+      if (timer) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0)
+          continue;
+      }
+
+      if (handler != NULL && !handler->HandleEvent(fd))
+        running_ = false;
+    }
+
+    return running_;
+  }
+
+  /**
+   * Stop() is safe to call from any thread and wakes up a sleeping loop
+   **/
+  void Stop() {
+    uint64_t wakeup = 1;
+    if (write(shutdown_fd_, &wakeup, sizeof(wakeup)) < 0)
+      running_ = false;
+  }
+
+  /**
+   * IsRunning() tells the owner whether Stop() has taken effect yet
+   *
+   * @returns   True until the loop has observed a Stop() or a handler failure
+   **/
+  bool IsRunning() const {
+    return running_;
+  }
+
+ private:
+  /**
+   * The epoll set that all of our descriptors live in...
+   **/
+  int epoll_fd_;
+
+  /**
+   * ...and the eventfd any thread can write to in order to stop the loop
+   **/
+  int shutdown_fd_;
+
+  /**
+   * We only flip this to false when the loop is told to stop
+   **/
+  volatile bool running_;
+
+  /**
+   * The lock that guards the two maps below
+   **/
+  pthread_mutex_t lock_;
+
+  /**
+   * A mapping of watched descriptors to the handlers that service them...
+   **/
+  unordered_map<int, EventHandler*> handlers_;
+
+  /**
+   * ...and the subset of those descriptors that are timers owned by the loop
+   **/
+  unordered_map<int, EventHandler*> timers_;
+};
+
+#endif  // _PERMANENTIP_COMMON_EVENTLOOP_H_
@@ -0,0 +1,382 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is an immutable, position-independent table of names and (binary)
+ * addresses on disk, which is mapped into memory and looked up in place so
+ * that a server can answer from it the moment it starts
+ **/
+
+#ifndef _PERMANENTIP_COMMON_MAPPEDTABLE_H_
+#define _PERMANENTIP_COMMON_MAPPEDTABLE_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Common/CuckooFilter.h"
+#include "Common/Types.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+/**
+ * A table file starts with a header (whose first @ref MAPPED_TABLE_MAGIC_SIZE
+ * bytes are @ref MAPPED_TABLE_MAGIC), followed by an open-addressing index
+ * of entry numbers, the entries themselves (sorted by name) and finally every
+ * name back to back.  Everything refers to everything else by offset, so the
+ * file can be mapped anywhere.
+ **/
+#define MAPPED_TABLE_MAGIC "PIPTABLE"
+#define MAPPED_TABLE_MAGIC_SIZE 8
+
+/**
+ * A MappedTable is written once, from every name it should hold, and is only
+ * ever read after that.  Lookups hash the name once and probe the index in
+ * the mapping, so nothing is read from disk until it is needed.  The only
+ * thing built in memory is a cuckoo filter of the names (read through once,
+ * in order, when the table is opened), which turns away nearly every unknown
+ * name before the index is touched.  Reading is thread-safe.
+ **/
+class MappedTable {
+ public:
+  MappedTable() : base_(NULL), size_(0), header_(NULL), index_(NULL),
+                  entries_(NULL), names_(NULL) {}
+
+  /**
+   * The destructor unmaps the table
+   **/
+  virtual ~MappedTable() {
+    Close();
+  }
+
+  /**
+   * Write() builds a table and moves it into place in one step, so that a
+   * reader finds either the old table or the whole new one
+   *
+   * @param     path      Where to write the table
+   * @param     entries   Every name and its address (sorted and stripped of
+   *                      repeated names, the first of which is kept)
+   * @param     tag       Whatever the caller wants to tell readers
+   *
+   * @returns   False if the table could not be written
+   **/
+  static bool Write(const string& path,
+                    vector< pair<LogicalAddress, int> >* entries,
+                    uint64_t tag) {
+    std::stable_sort(entries->begin(), entries->end(), NameOrder());
+    entries->erase(std::unique(entries->begin(), entries->end(),
+                               SameName()), entries->end());
+
+    // The index is kept at most half full so that probes stay short
+    Header header;
+    memcpy(header.magic, MAPPED_TABLE_MAGIC, MAPPED_TABLE_MAGIC_SIZE);
+    header.count = entries->size();
+    header.slots = 1;
+    while (header.slots < 2 * header.count)
+      header.slots <<= 1;
+    header.tag = tag;
+    header.names = 0;
+
+    vector<Entry> table(header.count);
+    vector<uint32_t> index(header.slots, 0);
+    for (uint32_t i = 0; i < header.count; i++) {
+      const LogicalAddress& name = (*entries)[i].first;
+      table[i].offset = header.names;
+      table[i].length = name.length();
+      table[i].address = (*entries)[i].second;
+      header.names += name.length();
+
+      uint32_t slot = Hash(name.data(), name.length()) & (header.slots - 1);
+      while (index[slot] != 0)
+        slot = (slot + 1) & (header.slots - 1);
+      index[slot] = i + 1;
+    }
+
+    string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == NULL)
+      return false;
+
+    bool written =
+      (fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(&index[0], sizeof(uint32_t), index.size(), file) ==
+         index.size() &&
+       (table.empty() ||
+        fwrite(&table[0], sizeof(Entry), table.size(), file) ==
+          table.size()));
+    for (uint32_t i = 0; written && i < header.count; i++) {
+      const LogicalAddress& name = (*entries)[i].first;
+      written = (fwrite(name.data(), 1, name.length(), file) == name.length());
+    }
+    written = (fflush(file) == 0 && written && fdatasync(fileno(file)) == 0);
+    if (fclose(file) != 0 || !written ||
+        rename(temporary.c_str(), path.c_str()) != 0) {
+      unlink(temporary.c_str());
+      return false;
+    }
+
+    // The rename itself only lasts once the directory is synced
+    size_t slash = path.rfind('/');
+    string directory = (slash == string::npos ? "." :
+                        path.substr(0, (slash == 0 ? 1 : slash)));
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+    return true;
+  }
+
+  /**
+   * Open() maps a table into memory
+   *
+   * @param     path      The table to map
+   * @returns   False if there is no table there (or it is not a whole one)
+   **/
+  bool Open(const string& path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 ||
+        static_cast<size_t>(status.st_size) < sizeof(Header)) {
+      close(fd);
+      return false;
+    }
+
+    // The mapping outlives the descriptor (and even the file, if replaced)
+    void* base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+      return false;
+    base_ = static_cast<char*>(base);
+    size_ = status.st_size;
+
+    // Lookups land all over the table, so reading ahead would be wasted
+    madvise(base_, size_, MADV_RANDOM);
+
+    header_ = reinterpret_cast<const Header*>(base_);
+    uint64_t index_end = sizeof(Header) +
+                         static_cast<uint64_t>(header_->slots) * 4;
+    uint64_t entries_end = index_end +
+                           static_cast<uint64_t>(header_->count) *
+                           sizeof(Entry);
+    if (memcmp(header_->magic, MAPPED_TABLE_MAGIC, MAPPED_TABLE_MAGIC_SIZE) ||
+        header_->slots == 0 || (header_->slots & (header_->slots - 1)) ||
+        header_->count > header_->slots ||
+        entries_end + header_->names != size_) {
+      Close();
+      return false;
+    }
+
+    index_ = reinterpret_cast<const uint32_t*>(base_ + sizeof(Header));
+    entries_ = reinterpret_cast<const Entry*>(base_ + index_end);
+    names_ = base_ + entries_end;
+
+    // The entries and names are read through in order just this once
+    madvise(base_ + index_end, size_ - index_end, MADV_SEQUENTIAL);
+    vector<uint64_t> hashes(header_->count);
+    for (uint32_t i = 0; i < header_->count; i++)
+      hashes[i] = (Fits(entries_[i]) ?
+                   Hash(names_ + entries_[i].offset, entries_[i].length) : 0);
+    filter_.Fill(hashes);
+    madvise(base_, size_, MADV_RANDOM);
+    return true;
+  }
+
+  /**
+   * Close() unmaps the table (every entry number it handed out is void)
+   **/
+  void Close() {
+    if (base_ != NULL)
+      munmap(base_, size_);
+    base_ = NULL;
+    size_ = 0;
+    header_ = NULL;
+    index_ = NULL;
+    entries_ = NULL;
+    names_ = NULL;
+    filter_.Clear(1);
+  }
+
+  /**
+   * @returns   True if a table is mapped
+   **/
+  bool IsOpen() const {
+    return base_ != NULL;
+  }
+
+  /**
+   * Find() looks a name up in the table
+   *
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   *
+   * @returns   The entry number of the name, or -1 if it is not in the table
+   **/
+  int Find(const char* name, int name_length) const {
+    uint32_t hash = Hash(name, name_length);
+    if (base_ == NULL || !filter_.MayContain(hash))
+      return -1;
+
+    uint32_t mask = header_->slots - 1;
+    uint32_t slot = hash & mask;
+    for (uint32_t probes = 0; probes < header_->slots && index_[slot] != 0;
+         probes++, slot = (slot + 1) & mask) {
+      uint32_t i = index_[slot] - 1;
+      if (i >= header_->count)
+        return -1;
+
+      const Entry& entry = entries_[i];
+      if (entry.length == static_cast<uint32_t>(name_length) &&
+          Fits(entry) && !memcmp(names_ + entry.offset, name, name_length))
+        return i;
+    }
+    return -1;
+  }
+
+  int Find(const LogicalAddress& name) const {
+    return Find(name.data(), name.length());
+  }
+
+  /**
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   *
+   * @returns   False if the filter turns the name away without the index
+   *            being probed
+   **/
+  bool MayContain(const char* name, int name_length) const {
+    return base_ != NULL && filter_.MayContain(Hash(name, name_length));
+  }
+
+  /**
+   * @param     i             An entry number (from 0 up to Size())
+   * @returns   The name of that entry...
+   **/
+  LogicalAddress Name(int i) const {
+    return (Fits(entries_[i]) ?
+            LogicalAddress(names_ + entries_[i].offset, entries_[i].length) :
+            LogicalAddress());
+  }
+
+  /**
+   * ...and its address
+   **/
+  int Address(int i) const {
+    return entries_[i].address;
+  }
+
+  /**
+   * @returns   The number of entries in the table
+   **/
+  int Size() const {
+    return (base_ == NULL ? 0 : header_->count);
+  }
+
+  /**
+   * @returns   Whatever the writer tagged the table with
+   **/
+  uint64_t Tag() const {
+    return (base_ == NULL ? 0 : header_->tag);
+  }
+
+ private:
+  /**
+   * What the table starts with
+   **/
+  struct Header {
+    char magic[MAPPED_TABLE_MAGIC_SIZE];
+    uint32_t count;
+    uint32_t slots;
+    uint64_t tag;
+    uint64_t names;
+  };
+
+  /**
+   * Each name and its address (the name is at offset from the start of the
+   * names)
+   **/
+  struct Entry {
+    uint32_t offset;
+    uint32_t length;
+    int32_t address;
+  };
+
+  /**
+   * How entries are sorted, and told apart, when written
+   **/
+  struct NameOrder {
+    bool operator()(const pair<LogicalAddress, int>& a,
+                    const pair<LogicalAddress, int>& b) const {
+      return a.first < b.first;
+    }
+  };
+
+  struct SameName {
+    bool operator()(const pair<LogicalAddress, int>& a,
+                    const pair<LogicalAddress, int>& b) const {
+      return a.first == b.first;
+    }
+  };
+
+  /**
+   * The whole mapping...
+   **/
+  char* base_;
+  size_t size_;
+
+  /**
+   * ...and where each part of the table starts within it
+   **/
+  const Header* header_;
+  const uint32_t* index_;
+  const Entry* entries_;
+  const char* names_;
+
+  /**
+   * The filter in front of the index
+   **/
+  CuckooFilter filter_;
+
+  /**
+   * @returns   True if an entry's name lies within the mapping (a damaged
+   *            table must not take the server down with it)
+   **/
+  bool Fits(const Entry& entry) const {
+    return static_cast<uint64_t>(entry.offset) + entry.length <=
+           header_->names;
+  }
+
+  /**
+   * @returns   The (FNV-1a) hash of a name, which the index is built on
+   **/
+  static uint32_t Hash(const char* name, int name_length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name_length; i++)
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return hash;
+  }
+
+  // The table owns its mapping so may not be copied
+  MappedTable(const MappedTable&);
+  MappedTable& operator=(const MappedTable&);
+};
+
+#endif  // _PERMANENTIP_COMMON_MAPPEDTABLE_H_
@@ -0,0 +1,315 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a bounded ring of sent-but-unacknowledged messages, each identified
+ * by a sequence number, kept so that they can be resent (in batches through
+ * sendmmsg) after a handover
+ **/
+
+#ifndef _PERMANENTIP_COMMON_MESSAGERING_H_
+#define _PERMANENTIP_COMMON_MESSAGERING_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstring>
+#include <vector>
+
+#include "Common/Types.h"
+
+using std::vector;
+
+/**
+ * No peer may have more than @ref MAX_UNACKED_MESSAGES messages (or
+ * @ref MAX_UNACKED_BYTES bytes of payload) outstanding at once; beyond that
+ * the application is told to hold off until some are acknowledged
+ **/
+#define MAX_UNACKED_MESSAGES 256
+#define MAX_UNACKED_BYTES (64 * 1024)
+
+/**
+ * A replay never hands the kernel more than @ref MAX_REPLAY_PER_CALL messages
+ * per sendmmsg
+ **/
+#define MAX_REPLAY_PER_CALL 64
+
+/**
+ * A MessageRing hands out sequence numbers 1, 2, 3, ... in the order messages
+ * are pushed.  Pushing is O(1), and acknowledging a sequence number releases
+ * it along with every older message (acknowledgements are cumulative), while
+ * releasing one frees that message alone.  The ring is not thread-safe;
+ * callers must hold their own lock.
+ *
+ * After a handover the ring replays whatever was in flight at the time,
+ * a burst at a time, skipping anything acknowledged while the replay is
+ * under way.
+ **/
+class MessageRing {
+ public:
+  /**
+   * @param     capacity    The most messages that may be outstanding
+   * @param     max_bytes   The most payload bytes that may be outstanding
+   **/
+  explicit MessageRing(int capacity = MAX_UNACKED_MESSAGES,
+                       int max_bytes = MAX_UNACKED_BYTES)
+      : capacity_(capacity), max_bytes_(max_bytes), head_(0), size_(0),
+        bytes_(0), first_sequence_(1), replay_next_(1), replay_end_(1) {}
+
+  /**
+   * Push() remembers a message that has just been sent
+   *
+   * @param     message     The message sent
+   * @param     sequence    Set to the sequence number of the message (may be
+   *                        NULL)
+   *
+   * @returns   False (remembering nothing) if the ring is full, in which case
+   *            the message should not be sent yet
+   **/
+  bool Push(const NetworkMsg& message, uint32_t* sequence) {
+    if (size_ >= capacity_ ||
+        bytes_ + static_cast<int>(message.length()) > max_bytes_)
+      return false;
+
+    // The slots are only allocated once the ring is first used
+    if (slots_.empty()) {
+      slots_.resize(capacity_);
+      released_.resize(capacity_, false);
+    }
+
+    slots_[(head_ + size_) % capacity_] = message;
+    released_[(head_ + size_) % capacity_] = false;
+    bytes_ += message.length();
+    if (sequence != NULL)
+      *sequence = first_sequence_ + size_;
+    size_++;
+    return true;
+  }
+
+  /**
+   * Acknowledge() releases a message and every message sent before it
+   *
+   * @param     sequence    The newest sequence number the peer has received
+   **/
+  void Acknowledge(uint32_t sequence) {
+    // Compare in serial number arithmetic so that wrapping around is fine
+    while (size_ > 0 && static_cast<int32_t>(sequence - first_sequence_) >= 0)
+      PopOldest();
+
+    // Anything released out of order right behind it goes too
+    while (size_ > 0 && released_[head_])
+      PopOldest();
+  }
+
+  /**
+   * Release() frees a single message, leaving the ones sent before it
+   * outstanding (for payloads the peer will never send back).  Its bytes
+   * are freed right away, its slot once everything before it is.
+   *
+   * @param     sequence    The sequence number of the message
+   **/
+  void Release(uint32_t sequence) {
+    int i = static_cast<int32_t>(sequence - first_sequence_);
+    if (i < 0 || i >= size_)
+      return;
+    if (i == 0) {
+      Acknowledge(sequence);
+      return;
+    }
+
+    int slot = (head_ + i) % capacity_;
+    if (!released_[slot]) {
+      bytes_ -= slots_[slot].length();
+      slots_[slot].clear();
+      released_[slot] = true;
+    }
+  }
+
+  /**
+   * Find() looks for the oldest outstanding message with the given payload
+   *
+   * @param     message     The payload to look for
+   * @param     sequence    Set to the sequence number of the message found
+   *
+   * @returns   True if the message is outstanding
+   **/
+  bool Find(const NetworkMsg& message, uint32_t* sequence) const {
+    for (int i = 0; i < size_; i++) {
+      int slot = (head_ + i) % capacity_;
+      if (!released_[slot] && slots_[slot] == message) {
+        *sequence = first_sequence_ + i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Rewind() starts replaying every message outstanding right now (messages
+   * pushed from here on went to the new location and are not replayed)
+   **/
+  void Rewind() {
+    replay_next_ = first_sequence_;
+    replay_end_ = first_sequence_ + size_;
+  }
+
+  /**
+   * @returns   True if the replay started by Rewind() is not over yet
+   **/
+  bool Replaying() const {
+    return static_cast<int32_t>(replay_end_ - ReplayStart()) > 0;
+  }
+
+  /**
+   * Replay() resends the next burst of the replay started by Rewind()
+   *
+   * @param     fd          The (app) socket to resend on
+   * @param     peer        Where to resend to
+   * @param     peer_size   The size of peer
+   * @param     max_bytes   The most payload bytes to resend (though at least
+   *                        one message is always resent)
+   *
+   * @returns   The number of messages resent
+   **/
+  int Replay(int fd, struct sockaddr* peer, socklen_t peer_size,
+             int max_bytes) {
+    uint32_t next = ReplayStart();
+    int count = 0, bytes = 0;
+    messages_.clear();
+    payloads_.clear();
+    ends_.clear();
+    while (static_cast<int32_t>(replay_end_ - next) > 0 &&
+           count < MAX_REPLAY_PER_CALL && (count == 0 || bytes < max_bytes)) {
+      int slot = (head_ + static_cast<int32_t>(next - first_sequence_)) %
+                 capacity_;
+      next++;
+
+      // Messages released on their own were never going to be acknowledged
+      if (released_[slot])
+        continue;
+
+      struct iovec payload;
+      payload.iov_base = const_cast<char*>(slots_[slot].data());
+      payload.iov_len = slots_[slot].length();
+      payloads_.push_back(payload);
+      ends_.push_back(next);
+      bytes += slots_[slot].length();
+      count++;
+    }
+
+    // The payloads must all be in place before anything points at them
+    messages_.resize(count);
+    for (int i = 0; i < count; i++) {
+      memset(&messages_[i], 0, sizeof(messages_[i]));
+      messages_[i].msg_hdr.msg_name = peer;
+      messages_[i].msg_hdr.msg_namelen = peer_size;
+      messages_[i].msg_hdr.msg_iov = &payloads_[i];
+      messages_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = 0;
+    while (sent < count) {
+      int result = sendmmsg(fd, &messages_[sent], count - sent, MSG_DONTWAIT);
+      if (result < 0 && errno == EINTR)
+        continue;
+
+      // A full send buffer ends the burst early; anything else is skipped
+      if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      sent += (result <= 0 ? 1 : result);
+    }
+
+    replay_next_ = (sent < count ? ends_[sent] - 1 : next);
+    return sent;
+  }
+
+  /**
+   * @param     i           Which outstanding message (0 being the oldest)
+   * @returns   The i-th oldest outstanding message
+   **/
+  const NetworkMsg& At(int i) const {
+    return slots_[(head_ + i) % capacity_];
+  }
+
+  /**
+   * @returns   The number of messages outstanding...
+   **/
+  int Size() const {
+    return size_;
+  }
+
+  /**
+   * ...and the number of payload bytes they hold
+   **/
+  int Bytes() const {
+    return bytes_;
+  }
+
+ private:
+  /**
+   * How much the ring may hold...
+   **/
+  int capacity_;
+  int max_bytes_;
+
+  /**
+   * ...the slots the messages are kept in (and which of them were released
+   * on their own)...
+   **/
+  vector<NetworkMsg> slots_;
+  vector<bool> released_;
+
+  /**
+   * ...where the oldest message is and how many follow it...
+   **/
+  int head_;
+  int size_;
+  int bytes_;
+
+  /**
+   * ...and the sequence number of the oldest message
+   **/
+  uint32_t first_sequence_;
+
+  /**
+   * The next message to replay and the first one not to...
+   **/
+  uint32_t replay_next_;
+  uint32_t replay_end_;
+
+  /**
+   * ...along with the scatter/gather arrays handed to sendmmsg and where the
+   * replay stands after each message in them (reused so that, once warmed
+   * up, replaying never allocates)
+   **/
+  vector<struct mmsghdr> messages_;
+  vector<struct iovec> payloads_;
+  vector<uint32_t> ends_;
+
+  /**
+   * PopOldest() frees the oldest outstanding message
+   **/
+  void PopOldest() {
+    bytes_ -= slots_[head_].length();
+    slots_[head_].clear();
+    released_[head_] = false;
+    head_ = (head_ + 1) % capacity_;
+    first_sequence_++;
+    size_--;
+  }
+
+  /**
+   * @returns   Where the replay picks up again (acknowledgements may have
+   *            released messages it had not gotten to yet)
+   **/
+  uint32_t ReplayStart() const {
+    return (static_cast<int32_t>(replay_next_ - first_sequence_) < 0 ?
+            first_sequence_ : replay_next_);
+  }
+};
+
+#endif  // _PERMANENTIP_COMMON_MESSAGERING_H_
@@ -0,0 +1,192 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a name-interning table that maps every logical address it has seen
+ * to a dense 32-bit identifier (and back)
+ **/
+
+#ifndef _PERMANENTIP_COMMON_NAMETABLE_H_
+#define _PERMANENTIP_COMMON_NAMETABLE_H_
+
+#include <stdint.h>
+#include <tr1/unordered_map>
+#include <tr1/functional>
+#include <deque>
+#include <vector>
+
+#include "Common/CuckooFilter.h"
+#include "Common/Types.h"
+
+using std::tr1::unordered_map;
+using std::tr1::hash;
+using std::deque;
+using std::vector;
+
+/**
+ * Interned logical addresses are referred to by a dense integer identifier,
+ * with @ref INVALID_NAME_ID reserved for names that are not in the table
+ **/
+typedef uint32_t NameId;
+#define INVALID_NAME_ID 0xFFFFFFFF
+
+/** @cond PRIVATE_NAMESPACE_MEMBERS **/
+  /**
+   * The table is keyed by pointers into its own storage (so that each name is
+   * only ever stored once), so we hash and compare what they point to
+   **/
+  class NamePointerHash {
+   public:
+    size_t operator()(const LogicalAddress* name) const {
+      return hash<LogicalAddress>()(*name);
+    }
+  };
+
+  class NamePointerEqual {
+   public:
+    bool operator()(const LogicalAddress* a, const LogicalAddress* b) const {
+      return *a == *b;
+    }
+  };
+/** @endcond **/
+
+/**
+ * A NameTable hands out identifiers 0, 1, 2, ... in the order names are first
+ * interned, so callers can keep per-name state in plain arrays indexed by
+ * identifier.  Identifiers of forgotten names are handed out again before any
+ * new ones.  A cuckoo filter of every name turns away nearly all unknown names
+ * before the map is touched.  The table is not thread-safe; callers must hold
+ * their own lock.
+ **/
+class NameTable {
+ public:
+  NameTable() {}
+  virtual ~NameTable() {}
+
+  /**
+   * Find() looks up the identifier of a name without adding it
+   *
+   * @param     name      The logical address to look up
+   * @returns   The identifier of name, or @ref INVALID_NAME_ID if unknown
+   **/
+  NameId Find(const LogicalAddress& name) const {
+    if (!filter_.MayContain(hash<LogicalAddress>()(name)))
+      return INVALID_NAME_ID;
+
+    unordered_map<const LogicalAddress*, NameId, NamePointerHash,
+                  NamePointerEqual>::const_iterator it = ids_.find(&name);
+    return (it == ids_.end() ? INVALID_NAME_ID : it->second);
+  }
+
+  /**
+   * Intern() looks up the identifier of a name, adding it if it is new
+   *
+   * @param     name      The logical address to intern
+   * @returns   The (possibly brand new) identifier of name
+   **/
+  NameId Intern(const LogicalAddress& name) {
+    NameId id = Find(name);
+    if (id != INVALID_NAME_ID)
+      return id;
+
+    if (!free_ids_.empty()) {
+      id = free_ids_.back();
+      free_ids_.pop_back();
+      names_[id] = name;
+    } else {
+      id = names_.size();
+      names_.push_back(name);
+    }
+    ids_[&names_[id]] = id;
+
+    // A full filter is rebuilt twice the size (and with this name in it)
+    if (filter_.Size() >= filter_.Capacity() - filter_.Capacity() / 8 ||
+        !filter_.Add(hash<LogicalAddress>()(name)))
+      Refilter();
+    return id;
+  }
+
+  /**
+   * Forget() removes a name so that its identifier can be reused (the caller
+   * must be sure nothing still refers to it)
+   *
+   * @param     id        An identifier previously returned by Intern()
+   **/
+  void Forget(NameId id) {
+    filter_.Remove(hash<LogicalAddress>()(names_[id]));
+    ids_.erase(&names_[id]);
+    names_[id].clear();
+    free_ids_.push_back(id);
+  }
+
+  /**
+   * @param     id        An identifier previously returned by Intern()
+   * @returns   The logical address with that identifier
+   **/
+  const LogicalAddress& Name(NameId id) const {
+    return names_[id];
+  }
+
+  /**
+   * @returns   The number of identifiers handed out so far (and thus the next
+   *            new one)
+   **/
+  NameId Size() const {
+    return names_.size();
+  }
+
+  /**
+   * @returns   The filter in front of the names
+   **/
+  const CuckooFilter& Filter() const {
+    return filter_;
+  }
+
+ private:
+  /**
+   * Every interned name, indexed by identifier (a deque never moves its
+   * elements, so the map below can point straight into it)...
+   **/
+  deque<LogicalAddress> names_;
+
+  /**
+   * ...the reverse index from name to identifier...
+   **/
+  unordered_map<const LogicalAddress*, NameId, NamePointerHash,
+                NamePointerEqual> ids_;
+
+  /**
+   * ...the identifiers of forgotten names, waiting to be reused...
+   **/
+  vector<NameId> free_ids_;
+
+  /**
+   * ...and the filter every lookup goes through first
+   **/
+  CuckooFilter filter_;
+
+  /**
+   * Refilter() rebuilds the filter from every name, doubling it until they
+   * all fit
+   **/
+  void Refilter() {
+    uint32_t buckets = 2 * filter_.Capacity() / CUCKOO_BUCKET_SIZE;
+    for (bool built = false; !built; buckets *= 2) {
+      filter_.Clear(buckets);
+      built = true;
+      for (unordered_map<const LogicalAddress*, NameId, NamePointerHash,
+                         NamePointerEqual>::const_iterator it = ids_.begin();
+           built && it != ids_.end(); ++it)
+        built = filter_.Add(hash<LogicalAddress>()(*it->first));
+    }
+  }
+
+  // The map points into names_ so tables may not be copied
+  NameTable(const NameTable&);
+  NameTable& operator=(const NameTable&);
+};
+
+#endif  // _PERMANENTIP_COMMON_NAMETABLE_H_
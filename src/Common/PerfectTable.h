@@ -0,0 +1,508 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is an immutable table of names and (binary) addresses on disk, indexed
+ * by a minimal perfect hash so that every lookup lands on exactly one entry
+ **/
+
+#ifndef _PERMANENTIP_COMMON_PERFECTTABLE_H_
+#define _PERMANENTIP_COMMON_PERFECTTABLE_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Common/CuckooFilter.h"
+#include "Common/SipHash.h"
+#include "Common/Types.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+/**
+ * A table file starts with a header (whose first @ref PERFECT_TABLE_MAGIC_SIZE
+ * bytes are @ref PERFECT_TABLE_MAGIC), followed by one displacement for every
+ * bucket, one entry for every name (in the order the hash puts them) and
+ * finally every name back to back.
+ **/
+#define PERFECT_TABLE_MAGIC "PIPPHASH"
+#define PERFECT_TABLE_MAGIC_SIZE 8
+
+/**
+ * Names are hashed into buckets of @ref PERFECT_TABLE_BUCKET_SIZE names on
+ * average.  Each bucket is given a displacement that moves all of its names
+ * onto free entries, trying @ref PERFECT_TABLE_MAX_STRIDES strides before
+ * giving up on the hash and trying another, up to @ref PERFECT_TABLE_ATTEMPTS
+ * times.
+ **/
+#define PERFECT_TABLE_BUCKET_SIZE 4
+#define PERFECT_TABLE_MAX_STRIDES 64
+#define PERFECT_TABLE_ATTEMPTS 16
+
+/**
+ * A PerfectTable is compiled once, ahead of time, from names that will never
+ * change, and is mapped and read in place after that.  A lookup hashes the
+ * name once, reads its bucket's displacement (the displacements take about a
+ * byte per name, so stay in cache) and goes straight to the only entry the
+ * name can be in, whose check bits turn nearly every unknown name away
+ * before its name is even read.  So that an unknown name does not cost even
+ * that entry (and the page it is on), a cuckoo filter of every entry's check
+ * bits, built in memory when the table is opened, is asked first.  Reading
+ * is thread-safe.
+ **/
+class PerfectTable {
+ public:
+  PerfectTable() : base_(NULL), size_(0), header_(NULL), displacements_(NULL),
+                   entries_(NULL), names_(NULL) {}
+
+  /**
+   * The destructor unmaps the table
+   **/
+  virtual ~PerfectTable() {
+    Close();
+  }
+
+  /**
+   * Write() compiles a table and moves it into place in one step, so that a
+   * reader finds either the old table or the whole new one
+   *
+   * @param     path      Where to write the table
+   * @param     entries   Every name and its address (sorted and stripped of
+   *                      repeated names, the first of which is kept)
+   * @param     tag       Whatever the caller wants to tell readers
+   *
+   * @returns   False if no perfect hash was found or the table could not be
+   *            written
+   **/
+  static bool Write(const string& path,
+                    vector< pair<LogicalAddress, int> >* entries,
+                    uint64_t tag) {
+    std::stable_sort(entries->begin(), entries->end(), NameOrder());
+    entries->erase(std::unique(entries->begin(), entries->end(),
+                               SameName()), entries->end());
+
+    Header header;
+    memcpy(header.magic, PERFECT_TABLE_MAGIC, PERFECT_TABLE_MAGIC_SIZE);
+    header.count = entries->size();
+    header.buckets = (header.count + PERFECT_TABLE_BUCKET_SIZE - 1) /
+                     PERFECT_TABLE_BUCKET_SIZE;
+    if (header.buckets == 0)
+      header.buckets = 1;
+    header.tag = tag;
+    header.names = 0;
+
+    vector<uint32_t> displacements(header.buckets, 0);
+    vector<uint32_t> order;
+    bool placed = (header.count == 0);
+    for (int attempt = 0; !placed && attempt < PERFECT_TABLE_ATTEMPTS;
+         attempt++) {
+      header.key[0] = 0x9e3779b97f4a7c15ULL * (attempt + 1);
+      header.key[1] = 0xc2b2ae3d27d4eb4fULL * (attempt + 1);
+      placed = Place(header, *entries, &displacements, &order);
+    }
+    if (!placed)
+      return false;
+
+    vector<Entry> table(header.count);
+    for (uint32_t slot = 0; slot < header.count; slot++) {
+      const LogicalAddress& name = (*entries)[order[slot]].first;
+      table[slot].check = static_cast<uint32_t>(
+        SipHash::Hash(header.key, name.data(), name.length()));
+      table[slot].address = (*entries)[order[slot]].second;
+      table[slot].offset = header.names;
+      table[slot].length = name.length();
+      header.names += name.length();
+    }
+
+    string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == NULL)
+      return false;
+
+    bool written =
+      (fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(&displacements[0], sizeof(uint32_t), displacements.size(),
+              file) == displacements.size() &&
+       (table.empty() ||
+        fwrite(&table[0], sizeof(Entry), table.size(), file) ==
+          table.size()));
+    for (uint32_t slot = 0; written && slot < header.count; slot++) {
+      const LogicalAddress& name = (*entries)[order[slot]].first;
+      written = (fwrite(name.data(), 1, name.length(), file) == name.length());
+    }
+    written = (fflush(file) == 0 && written && fdatasync(fileno(file)) == 0);
+    if (fclose(file) != 0 || !written ||
+        rename(temporary.c_str(), path.c_str()) != 0) {
+      unlink(temporary.c_str());
+      return false;
+    }
+
+    // The rename itself only lasts once the directory is synced
+    size_t slash = path.rfind('/');
+    string directory = (slash == string::npos ? "." :
+                        path.substr(0, (slash == 0 ? 1 : slash)));
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+    return true;
+  }
+
+  /**
+   * Open() maps a table into memory
+   *
+   * @param     path      The table to map
+   * @returns   False if there is no table there (or it is not a whole one)
+   **/
+  bool Open(const string& path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 ||
+        static_cast<size_t>(status.st_size) < sizeof(Header)) {
+      close(fd);
+      return false;
+    }
+
+    // The mapping outlives the descriptor (and even the file, if replaced)
+    void* base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+      return false;
+    base_ = static_cast<char*>(base);
+    size_ = status.st_size;
+
+    // Lookups land all over the table, so reading ahead would be wasted
+    madvise(base_, size_, MADV_RANDOM);
+
+    header_ = reinterpret_cast<const Header*>(base_);
+    uint64_t displacements_end = sizeof(Header) +
+                                 static_cast<uint64_t>(header_->buckets) * 4;
+    uint64_t entries_end = displacements_end +
+                           static_cast<uint64_t>(header_->count) *
+                           sizeof(Entry);
+    if (memcmp(header_->magic, PERFECT_TABLE_MAGIC,
+               PERFECT_TABLE_MAGIC_SIZE) ||
+        header_->buckets == 0 ||
+        entries_end + header_->names != size_) {
+      Close();
+      return false;
+    }
+
+    displacements_ = reinterpret_cast<const uint32_t*>(base_ +
+                                                        sizeof(Header));
+    entries_ = reinterpret_cast<const Entry*>(base_ + displacements_end);
+    names_ = base_ + entries_end;
+
+    // The entries are read through in order just this once
+    madvise(base_ + displacements_end, entries_end - displacements_end,
+            MADV_SEQUENTIAL);
+    vector<uint64_t> checks(header_->count);
+    for (uint32_t i = 0; i < header_->count; i++)
+      checks[i] = entries_[i].check;
+    filter_.Fill(checks);
+    madvise(base_, size_, MADV_RANDOM);
+    return true;
+  }
+
+  /**
+   * Close() unmaps the table (every entry number it handed out is void)
+   **/
+  void Close() {
+    if (base_ != NULL)
+      munmap(base_, size_);
+    base_ = NULL;
+    size_ = 0;
+    header_ = NULL;
+    displacements_ = NULL;
+    entries_ = NULL;
+    names_ = NULL;
+    filter_.Clear(1);
+  }
+
+  /**
+   * @returns   True if a table is mapped
+   **/
+  bool IsOpen() const {
+    return base_ != NULL;
+  }
+
+  /**
+   * Find() looks a name up in the table
+   *
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   *
+   * @returns   The entry number of the name, or -1 if it is not in the table
+   **/
+  int Find(const char* name, int name_length) const {
+    if (base_ == NULL || header_->count == 0)
+      return -1;
+
+    uint64_t hash = SipHash::Hash(header_->key, name, name_length);
+    if (!filter_.MayContain(static_cast<uint32_t>(hash)))
+      return -1;
+
+    uint32_t slot = Slot(hash, header_->count, header_->buckets,
+                         displacements_[Bucket(hash, header_->buckets)]);
+    const Entry& entry = entries_[slot];
+    if (entry.check != static_cast<uint32_t>(hash) ||
+        entry.length != static_cast<uint32_t>(name_length) || !Fits(entry) ||
+        memcmp(names_ + entry.offset, name, name_length))
+      return -1;
+    return slot;
+  }
+
+  int Find(const LogicalAddress& name) const {
+    return Find(name.data(), name.length());
+  }
+
+  /**
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   *
+   * @returns   False if the filter turns the name away without any entry
+   *            being read
+   **/
+  bool MayContain(const char* name, int name_length) const {
+    return base_ != NULL && header_->count > 0 &&
+           filter_.MayContain(static_cast<uint32_t>(
+             SipHash::Hash(header_->key, name, name_length)));
+  }
+
+  /**
+   * @param     i             An entry number (from 0 up to Size())
+   * @returns   The name of that entry...
+   **/
+  LogicalAddress Name(int i) const {
+    return (Fits(entries_[i]) ?
+            LogicalAddress(names_ + entries_[i].offset, entries_[i].length) :
+            LogicalAddress());
+  }
+
+  /**
+   * ...and its address
+   **/
+  int Address(int i) const {
+    return entries_[i].address;
+  }
+
+  /**
+   * @returns   The number of entries in the table
+   **/
+  int Size() const {
+    return (base_ == NULL ? 0 : header_->count);
+  }
+
+  /**
+   * @returns   Whatever the writer tagged the table with
+   **/
+  uint64_t Tag() const {
+    return (base_ == NULL ? 0 : header_->tag);
+  }
+
+ private:
+  /**
+   * What the table starts with (including the key the names are hashed with)
+   **/
+  struct Header {
+    char magic[PERFECT_TABLE_MAGIC_SIZE];
+    uint32_t count;
+    uint32_t buckets;
+    uint64_t key[2];
+    uint64_t tag;
+    uint64_t names;
+  };
+
+  /**
+   * Each name's check bits (the low half of its hash) and address, and where
+   * the name is (at offset from the start of the names)
+   **/
+  struct Entry {
+    uint32_t check;
+    int32_t address;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  /**
+   * How entries are sorted, and told apart, when written
+   **/
+  struct NameOrder {
+    bool operator()(const pair<LogicalAddress, int>& a,
+                    const pair<LogicalAddress, int>& b) const {
+      return a.first < b.first;
+    }
+  };
+
+  struct SameName {
+    bool operator()(const pair<LogicalAddress, int>& a,
+                    const pair<LogicalAddress, int>& b) const {
+      return a.first == b.first;
+    }
+  };
+
+  /**
+   * How buckets are ordered when placed (the biggest, which are the hardest
+   * to place, first)
+   **/
+  struct BiggerBucket {
+    explicit BiggerBucket(const vector< vector<uint32_t> >* members) :
+      members_(members) {}
+    bool operator()(uint32_t a, uint32_t b) const {
+      return (*members_)[a].size() > (*members_)[b].size();
+    }
+    const vector< vector<uint32_t> >* members_;
+  };
+
+  /**
+   * The whole mapping...
+   **/
+  char* base_;
+  size_t size_;
+
+  /**
+   * ...and where each part of the table starts within it
+   **/
+  const Header* header_;
+  const uint32_t* displacements_;
+  const Entry* entries_;
+  const char* names_;
+
+  /**
+   * The filter in front of the entries (of their check bits)
+   **/
+  CuckooFilter filter_;
+
+  /**
+   * Place() tries to give every bucket a displacement that moves its names
+   * onto entries no other name is on (hash, displace and compress)
+   *
+   * @param     header        The table, whose key the names are hashed with
+   * @param     entries       Every name
+   * @param     displacements Set to the displacement of every bucket
+   * @param     order         Set to the name on every entry
+   *
+   * @returns   False if some bucket could not be placed under this key
+   **/
+  static bool Place(const Header& header,
+                    const vector< pair<LogicalAddress, int> >& entries,
+                    vector<uint32_t>* displacements, vector<uint32_t>* order) {
+    uint32_t count = header.count;
+    vector<uint64_t> hashes(count);
+    vector< vector<uint32_t> > members(header.buckets);
+    for (uint32_t i = 0; i < count; i++) {
+      const LogicalAddress& name = entries[i].first;
+      hashes[i] = SipHash::Hash(header.key, name.data(), name.length());
+      members[Bucket(hashes[i], header.buckets)].push_back(i);
+    }
+
+    vector<uint32_t> buckets(header.buckets);
+    for (uint32_t b = 0; b < header.buckets; b++)
+      buckets[b] = b;
+    std::stable_sort(buckets.begin(), buckets.end(), BiggerBucket(&members));
+
+    const uint32_t UNPLACED = 0xFFFFFFFF;
+    order->assign(count, UNPLACED);
+    vector<uint32_t> slots, free_slots;
+    for (uint32_t b = 0; b < header.buckets; b++) {
+      const vector<uint32_t>& bucket = members[buckets[b]];
+      if (bucket.empty())
+        break;
+
+      // Lone names (which come last) are simply offset onto a free entry
+      if (bucket.size() == 1) {
+        if (free_slots.empty())
+          for (uint32_t slot = 0; slot < count; slot++)
+            if ((*order)[slot] == UNPLACED)
+              free_slots.push_back(slot);
+
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        uint32_t start = Slot(hashes[bucket[0]], count, header.buckets, 0);
+        (*displacements)[buckets[b]] = (slot + count - start) % count;
+        (*order)[slot] = bucket[0];
+        continue;
+      }
+
+      // Every stride is tried at every offset
+      uint64_t limit = static_cast<uint64_t>(PERFECT_TABLE_MAX_STRIDES) *
+                       count;
+      if (limit > UNPLACED)
+        limit = UNPLACED;
+      bool fits = false;
+      uint32_t displacement = 0;
+      for (; !fits && displacement < limit; displacement++) {
+        slots.clear();
+        fits = true;
+        for (unsigned int i = 0; fits && i < bucket.size(); i++) {
+          uint32_t slot = Slot(hashes[bucket[i]], count, header.buckets,
+                               displacement);
+          fits = ((*order)[slot] == UNPLACED &&
+                  std::find(slots.begin(), slots.end(), slot) == slots.end());
+          slots.push_back(slot);
+        }
+      }
+      if (!fits)
+        return false;
+
+      (*displacements)[buckets[b]] = displacement - 1;
+      for (unsigned int i = 0; i < bucket.size(); i++)
+        (*order)[slots[i]] = bucket[i];
+    }
+    return true;
+  }
+
+  /**
+   * @returns   The bucket a name's hash falls in
+   **/
+  static uint32_t Bucket(uint64_t hash, uint32_t buckets) {
+    return static_cast<uint32_t>(hash >> 32) % buckets;
+  }
+
+  /**
+   * @returns   The entry a name's hash lands on, given its bucket's
+   *            displacement (a stride and an offset, each less than count)
+   **/
+  static uint32_t Slot(uint64_t hash, uint32_t count, uint32_t buckets,
+                       uint32_t displacement) {
+    uint64_t start = static_cast<uint32_t>(hash) % count;
+    uint64_t step = (static_cast<uint32_t>(hash >> 32) / buckets) % count;
+    uint64_t stride = displacement / count;
+    uint64_t offset = displacement % count;
+    return (start + stride * step + offset) % count;
+  }
+
+  /**
+   * @returns   True if an entry's name lies within the mapping (a damaged
+   *            table must not take the server down with it)
+   **/
+  bool Fits(const Entry& entry) const {
+    return static_cast<uint64_t>(entry.offset) + entry.length <=
+           header_->names;
+  }
+
+  // The table owns its mapping so may not be copied
+  PerfectTable(const PerfectTable&);
+  PerfectTable& operator=(const PerfectTable&);
+};
+
+#endif  // _PERMANENTIP_COMMON_PERFECTTABLE_H_
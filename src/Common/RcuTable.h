@@ -0,0 +1,468 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a read-mostly table of names and (binary) addresses that any number
+ * of threads can look up without locks while a writer changes it
+ **/
+
+#ifndef _PERMANENTIP_COMMON_RCUTABLE_H_
+#define _PERMANENTIP_COMMON_RCUTABLE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Common/Types.h"
+#include "Common/Utils.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+/**
+ * Up to @ref RCU_MAX_READERS threads at a time read a table without locks
+ * (any more take the writers' lock to read, with a warning), and the index
+ * is kept at most half full, doubling from @ref RCU_INITIAL_SLOTS slots
+ * whenever it would not be
+ **/
+#define RCU_MAX_READERS 64
+#define RCU_INITIAL_SLOTS 1024
+
+/**
+ * An RcuTable maps each name to an address, 0 standing for a name that has
+ * been removed (which is still "in" the table, so that callers with another
+ * tier of names behind this one know not to look there).
+ *
+ * Lookups never lock, never write shared memory other than the reader's own
+ * slot, and never wait: the index is an open-addressing array of pointers to
+ * immutable names, each entry published with a single atomic store once it
+ * is whole, and addresses are changed in place with atomic stores.  Writers
+ * are serialized by a lock.  When the index fills up a writer builds a larger
+ * one beside it and publishes that with a single atomic store; the old index
+ * is freed only once every reader that might still be probing it has left
+ * (each reader announces the epoch it entered in, as in epoch-based RCU).
+ *
+ * Each index carries a Bloom filter of its names (a byte per slot, and so at
+ * least two per name) that a lookup checks first, so that an unknown name
+ * costs one word rather than a probe through entries.  Names are never taken
+ * out of the table (only set to 0), so the filter never has to forget one.
+ *
+ * Each thread is given its reader slot the first time it reads a table, and
+ * gives it back when it exits.
+ **/
+class RcuTable {
+ public:
+  RcuTable() : epoch_(1), size_(0) {
+    pthread_mutex_init(&writer_lock_, NULL);
+    pthread_key_create(&reader_key_, &ReleaseReader);
+    memset(readers_, 0, sizeof(readers_));
+    memset(&overflow_, 0, sizeof(overflow_));
+    current_ = NewIndex(RCU_INITIAL_SLOTS);
+  }
+
+  /**
+   * The destructor frees every name and index (no reader may be left, though
+   * threads that have read the table may live on without it)
+   **/
+  virtual ~RcuTable() {
+    pthread_key_delete(reader_key_);
+    for (uint32_t i = 0; i < current_->capacity; i++)
+      free(current_->slots[i]);
+    free(current_);
+    for (unsigned int i = 0; i < retired_.size(); i++)
+      free(retired_[i].second);
+    pthread_mutex_destroy(&writer_lock_);
+  }
+
+  /**
+   * Find() looks a name up, from any thread, without ever blocking
+   *
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   * @param     value         Set to its address (0 if it was removed)
+   *
+   * @returns   True if the name is in the table
+   **/
+  bool Find(const char* name, int name_length, int* value) {
+    int slot = ReaderSlot();
+    if (slot < 0) {
+      pthread_mutex_lock(&writer_lock_);
+      bool found = Probe(current_, name, name_length, value);
+      pthread_mutex_unlock(&writer_lock_);
+      return found;
+    }
+
+    // Announcing our epoch must be seen before we pick up the index, so that
+    // no writer frees it from under us
+    __atomic_store_n(&readers_[slot].epoch,
+                     __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    Index* index = __atomic_load_n(&current_, __ATOMIC_SEQ_CST);
+    bool found = Probe(index, name, name_length, value);
+    __atomic_store_n(&readers_[slot].epoch, 0, __ATOMIC_RELEASE);
+    return found;
+  }
+
+  /**
+   * MayContain() asks the filter of the current index alone, from any
+   * thread, without ever blocking
+   *
+   * @param     name          The (unterminated) name to look up
+   * @param     name_length   The number of bytes in name
+   *
+   * @returns   False if a lookup would turn the name away without probing
+   **/
+  bool MayContain(const char* name, int name_length) {
+    uint32_t hash = Hash(name, name_length);
+    int slot = ReaderSlot();
+    if (slot < 0) {
+      pthread_mutex_lock(&writer_lock_);
+      bool found = MayContain(current_, hash);
+      pthread_mutex_unlock(&writer_lock_);
+      return found;
+    }
+
+    __atomic_store_n(&readers_[slot].epoch,
+                     __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    Index* index = __atomic_load_n(&current_, __ATOMIC_SEQ_CST);
+    bool found = MayContain(index, hash);
+    __atomic_store_n(&readers_[slot].epoch, 0, __ATOMIC_RELEASE);
+    return found;
+  }
+
+  /**
+   * Set() adds a name or changes its address, without blocking any reader
+   *
+   * @param     name          The (unterminated) name to set
+   * @param     name_length   The number of bytes in name
+   * @param     value         Its new address (0 to remove it)
+   **/
+  void Set(const char* name, int name_length, int value) {
+    uint32_t hash = Hash(name, name_length);
+
+    pthread_mutex_lock(&writer_lock_);
+    uint32_t slot;
+    Entry* entry = Locate(current_, hash, name, name_length, &slot);
+    if (entry != NULL) {
+      __atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&writer_lock_);
+      return;
+    }
+
+    if (2 * (size_ + 1) > current_->capacity) {
+      Grow();
+      Locate(current_, hash, name, name_length, &slot);
+    }
+
+    // The entry is whole (and in the filter) before any reader can reach it
+    entry = static_cast<Entry*>(malloc(sizeof(Entry) + name_length));
+    entry->hash = hash;
+    entry->length = name_length;
+    entry->value = value;
+    memcpy(entry->name, name, name_length);
+    Filter(current_, hash);
+    __atomic_store_n(&current_->slots[slot], entry, __ATOMIC_RELEASE);
+    size_++;
+    pthread_mutex_unlock(&writer_lock_);
+  }
+
+  /**
+   * Entries() copies out every name in the table, along with its address
+   * (0 for a name that was removed)
+   *
+   * @param     entries       Where to append them
+   **/
+  void Entries(vector< pair<LogicalAddress, int> >* entries) {
+    pthread_mutex_lock(&writer_lock_);
+    for (uint32_t i = 0; i < current_->capacity; i++) {
+      const Entry* entry = current_->slots[i];
+      if (entry != NULL)
+        entries->push_back(pair<LogicalAddress, int>(
+          LogicalAddress(entry->name, entry->length),
+          __atomic_load_n(&entry->value, __ATOMIC_RELAXED)));
+    }
+    pthread_mutex_unlock(&writer_lock_);
+  }
+
+  /**
+   * @returns   The number of names in the table (removed ones included)
+   **/
+  uint32_t Size() {
+    pthread_mutex_lock(&writer_lock_);
+    uint32_t size = size_;
+    pthread_mutex_unlock(&writer_lock_);
+    return size;
+  }
+
+  /**
+   * @returns   The number of slots in the current index
+   **/
+  uint32_t Capacity() {
+    pthread_mutex_lock(&writer_lock_);
+    uint32_t capacity = current_->capacity;
+    pthread_mutex_unlock(&writer_lock_);
+    return capacity;
+  }
+
+  /**
+   * @returns   The number of threads holding a lock-free reader slot
+   **/
+  int Readers() const {
+    int readers = 0;
+    for (int i = 0; i < RCU_MAX_READERS; i++)
+      readers += __atomic_load_n(&readers_[i].owned, __ATOMIC_ACQUIRE);
+    return readers;
+  }
+
+ private:
+  /**
+   * A name (stored right after the entry) and its address, which is the
+   * only part of an entry that ever changes once it is published
+   **/
+  struct Entry {
+    uint32_t hash;
+    uint32_t length;
+    int value;
+    char name[1];
+  };
+
+  /**
+   * An index of entries (whose slots, and then the words of its filter,
+   * follow it in the same allocation)
+   **/
+  struct Index {
+    uint32_t capacity;
+    Entry* slots[1];
+  };
+
+  /**
+   * Each reader's slot holds the epoch it entered in, or 0 while it is not
+   * reading (padded out to a cache line so that readers never share one)
+   **/
+  struct ReaderSlot {
+    uint64_t epoch;
+    int owned;
+    char padding[64 - sizeof(uint64_t) - sizeof(int)];
+  };
+
+  /**
+   * The current epoch, every reader's slot, the stand-in slot of threads
+   * that found them all taken, and each thread's own slot (which is given
+   * back when the thread exits)...
+   **/
+  uint64_t epoch_;
+  ReaderSlot readers_[RCU_MAX_READERS];
+  ReaderSlot overflow_;
+  pthread_key_t reader_key_;
+
+  /**
+   * ...the index readers probe (swapped with a single atomic store)...
+   **/
+  Index* current_;
+
+  /**
+   * ...and everything else, which only writers touch (under the lock): the
+   * number of names and the indexes waiting for their readers to leave,
+   * along with the epoch each was replaced in
+   **/
+  pthread_mutex_t writer_lock_;
+  uint32_t size_;
+  vector< pair<uint64_t, Index*> > retired_;
+
+  /**
+   * Probe() looks a name up in an index
+   *
+   * @returns   True if the name is there (setting value to its address)
+   **/
+  static bool Probe(Index* index, const char* name, int name_length,
+                    int* value) {
+    uint32_t hash = Hash(name, name_length);
+    if (!MayContain(index, hash))
+      return false;
+
+    uint32_t slot;
+    Entry* entry = Locate(index, hash, name, name_length, &slot);
+    if (entry == NULL)
+      return false;
+    *value = __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE);
+    return true;
+  }
+
+  /**
+   * Locate() finds the entry of a name in an index or, failing that, the
+   * empty slot it would go in
+   *
+   * @returns   The entry of the name, or NULL if it is not in the index
+   **/
+  static Entry* Locate(Index* index, uint32_t hash, const char* name,
+                       int name_length, uint32_t* slot) {
+    uint32_t mask = index->capacity - 1;
+    for (*slot = hash & mask; ; *slot = (*slot + 1) & mask) {
+      Entry* entry = __atomic_load_n(&index->slots[*slot], __ATOMIC_ACQUIRE);
+      if (entry == NULL)
+        return NULL;
+      if (entry->hash == hash &&
+          entry->length == static_cast<uint32_t>(name_length) &&
+          !memcmp(entry->name, name, name_length))
+        return entry;
+    }
+  }
+
+  /**
+   * Grow() publishes an index twice the size of the current one, holding the
+   * same entries, and retires the current one (the lock must be held)
+   **/
+  void Grow() {
+    Index* bigger = NewIndex(2 * current_->capacity);
+    uint32_t mask = bigger->capacity - 1;
+    for (uint32_t i = 0; i < current_->capacity; i++) {
+      Entry* entry = current_->slots[i];
+      if (entry == NULL)
+        continue;
+
+      uint32_t slot = entry->hash & mask;
+      while (bigger->slots[slot] != NULL)
+        slot = (slot + 1) & mask;
+      bigger->slots[slot] = entry;
+      Filter(bigger, entry->hash);
+    }
+
+    // Readers from the new epoch on can only ever see the bigger index
+    Index* previous = current_;
+    __atomic_store_n(&current_, bigger, __ATOMIC_SEQ_CST);
+    retired_.push_back(pair<uint64_t, Index*>(
+      __atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST), previous));
+    Reclaim();
+  }
+
+  /**
+   * Reclaim() frees every retired index that no reader can still be in
+   * (the lock must be held)
+   **/
+  void Reclaim() {
+    uint64_t oldest = 0;
+    for (int i = 0; i < RCU_MAX_READERS; i++) {
+      uint64_t epoch = __atomic_load_n(&readers_[i].epoch, __ATOMIC_SEQ_CST);
+      if (epoch != 0 && (oldest == 0 || epoch < oldest))
+        oldest = epoch;
+    }
+
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < retired_.size(); i++) {
+      if (oldest == 0 || retired_[i].first < oldest)
+        free(retired_[i].second);
+      else
+        retired_[kept++] = retired_[i];
+    }
+    retired_.resize(kept);
+  }
+
+  /**
+   * ReaderSlot() finds (or claims) the calling thread's reader slot
+   *
+   * @returns   The slot, or -1 if every slot is taken
+   **/
+  int ReaderSlot() {
+    struct ReaderSlot* reader =
+      static_cast<struct ReaderSlot*>(pthread_getspecific(reader_key_));
+    if (reader != NULL)
+      return (reader == &overflow_ ? -1 : reader - readers_);
+
+    for (int i = 0; i < RCU_MAX_READERS; i++) {
+      if (__sync_bool_compare_and_swap(&readers_[i].owned, 0, 1)) {
+        pthread_setspecific(reader_key_, &readers_[i]);
+        return i;
+      }
+    }
+
+    // This thread will read under the writers' lock for as long as it lives
+    Utils::Log(stderr, WARNING, "All %d lock-free reader slots are taken, so "
+               "a reader falls back on the writers' lock", RCU_MAX_READERS);
+    pthread_setspecific(reader_key_, &overflow_);
+    return -1;
+  }
+
+  /**
+   * ReleaseReader() gives a reader slot back when the thread holding it exits
+   *
+   * @param     reader        The slot
+   **/
+  static void ReleaseReader(void* reader) {
+    __atomic_store_n(&static_cast<struct ReaderSlot*>(reader)->owned, 0,
+                     __ATOMIC_RELEASE);
+  }
+
+  /**
+   * @returns   A new, empty index with the given (power of two) capacity
+   **/
+  static Index* NewIndex(uint32_t capacity) {
+    Index* index = static_cast<Index*>(
+      calloc(1, sizeof(Index) + (capacity - 1) * sizeof(Entry*) +
+                capacity / 8 * sizeof(uint64_t)));
+    index->capacity = capacity;
+    return index;
+  }
+
+  /**
+   * @returns   The words of an index's filter
+   **/
+  static uint64_t* FilterWords(Index* index) {
+    return reinterpret_cast<uint64_t*>(&index->slots[index->capacity]);
+  }
+
+  /**
+   * @returns   The four bits a name's hash sets in its word of the filter
+   *            (setting word to which word that is)
+   **/
+  static uint64_t FilterBits(const Index* index, uint32_t hash,
+                             uint32_t* word) {
+    uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+    *word = static_cast<uint32_t>(mixed >> 32) & (index->capacity / 8 - 1);
+    return (1ULL << ((mixed >> 8) & 63)) | (1ULL << ((mixed >> 14) & 63)) |
+           (1ULL << ((mixed >> 20) & 63)) | (1ULL << ((mixed >> 26) & 63));
+  }
+
+  /**
+   * Filter() adds a name's hash to an index's filter
+   **/
+  static void Filter(Index* index, uint32_t hash) {
+    uint32_t word;
+    uint64_t bits = FilterBits(index, hash, &word);
+    __atomic_fetch_or(&FilterWords(index)[word], bits, __ATOMIC_RELEASE);
+  }
+
+  /**
+   * @returns   False only if a name is certainly not in an index
+   **/
+  static bool MayContain(Index* index, uint32_t hash) {
+    uint32_t word;
+    uint64_t bits = FilterBits(index, hash, &word);
+    return (__atomic_load_n(&FilterWords(index)[word], __ATOMIC_ACQUIRE) &
+            bits) == bits;
+  }
+
+  /**
+   * @returns   The (FNV-1a) hash of a name
+   **/
+  static uint32_t Hash(const char* name, int name_length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name_length; i++)
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return hash;
+  }
+
+  // The table owns its entries so may not be copied
+  RcuTable(const RcuTable&);
+  RcuTable& operator=(const RcuTable&);
+};
+
+#endif  // _PERMANENTIP_COMMON_RCUTABLE_H_
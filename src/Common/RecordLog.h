@@ -0,0 +1,341 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is an append-only file of checksummed records, written in batches
+ * (group commit) and read back in order, used as a write-ahead log and for
+ * snapshots
+ **/
+
+#ifndef _PERMANENTIP_COMMON_RECORDLOG_H_
+#define _PERMANENTIP_COMMON_RECORDLOG_H_
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/**
+ * Every record is framed by its length, a checksum of its type and payload,
+ * and its type (@ref RECORD_HEADER_SIZE bytes in all)
+ **/
+#define RECORD_HEADER_SIZE 9
+
+/**
+ * Any class that wants to read a RecordLog back implements the RecordHandler
+ * interface
+ **/
+class RecordHandler {
+ public:
+  virtual ~RecordHandler() {}
+
+  /**
+   * HandleRecord() is called once for every intact record, in order
+   *
+   * @param     type      The type the record was appended with
+   * @param     data      The payload of the record
+   * @param     length    The number of bytes in the payload
+   **/
+  virtual void HandleRecord(uint8_t type, const char* data, int length) = 0;
+};
+
+/**
+ * A RecordLog buffers appended records in memory and only writes (and syncs)
+ * them when committed, so that many changes become durable for the cost of a
+ * single fdatasync.  Records may be appended from any thread, even while a
+ * commit is under way.
+ **/
+class RecordLog {
+ public:
+  RecordLog() : fd_(-1), bytes_(0) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_mutex_init(&commit_lock_, NULL);
+  }
+
+  /**
+   * The destructor commits anything outstanding and closes the file
+   **/
+  virtual ~RecordLog() {
+    Close();
+    pthread_mutex_destroy(&commit_lock_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  /**
+   * Open() starts appending to a file
+   *
+   * @param     path      The file to append to (created if need be)
+   * @param     truncate  Whether to throw away what the file holds
+   *
+   * @returns   True unless the file could not be opened
+   **/
+  bool Open(const string& path, bool truncate = false) {
+    Close();
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+               (truncate ? O_TRUNC : 0), 0644);
+    bytes_ = 0;
+    return fd_ >= 0;
+  }
+
+  /**
+   * Close() commits anything outstanding and closes the file (dropping
+   * whatever could not be committed, which belongs to no other file)
+   **/
+  void Close() {
+    if (fd_ < 0)
+      return;
+
+    Commit();
+    close(fd_);
+    fd_ = -1;
+    pthread_mutex_lock(&lock_);
+    pending_.clear();
+    pthread_mutex_unlock(&lock_);
+  }
+
+  /**
+   * @returns   True if the log has a file to append to
+   **/
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  /**
+   * Append() adds a record to the next commit
+   *
+   * @param     type      What kind of record this is
+   * @param     data      The payload of the record
+   * @param     length    The number of bytes in the payload
+   **/
+  void Append(uint8_t type, const char* data, uint32_t length) {
+    char header[RECORD_HEADER_SIZE];
+    uint32_t checksum = Checksum(type, data, length);
+    memcpy(header, &length, 4);
+    memcpy(header + 4, &checksum, 4);
+    header[8] = type;
+
+    pthread_mutex_lock(&lock_);
+    pending_.append(header, RECORD_HEADER_SIZE);
+    pending_.append(data, length);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  /**
+   * Commit() writes and syncs every record appended so far (appends made
+   * while it writes go to the next commit)
+   *
+   * @returns   False if the records could not be written (in which case they
+   *            are kept for the next commit)
+   **/
+  bool Commit() {
+    pthread_mutex_lock(&commit_lock_);
+    pthread_mutex_lock(&lock_);
+    writing_.swap(pending_);
+    pthread_mutex_unlock(&lock_);
+
+    bool written = Write(fd_);
+    if (!written)
+      Requeue();
+    pthread_mutex_unlock(&commit_lock_);
+    return written;
+  }
+
+  /**
+   * Rotate() commits everything appended so far to the current file and
+   * switches to a new one for every record appended from here on
+   *
+   * @param     path      The file to append to from now on
+   *
+   * @returns   False if the new file could not be opened or the current one
+   *            could not be finished (in which case the current one is kept,
+   *            along with every record not yet written to it)
+   **/
+  bool Rotate(const string& path) {
+    int next = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (next < 0)
+      return false;
+
+    // Whatever is appended while the current file is finished goes to the
+    // next one
+    pthread_mutex_lock(&commit_lock_);
+    pthread_mutex_lock(&lock_);
+    writing_.swap(pending_);
+    pthread_mutex_unlock(&lock_);
+
+    if (!Write(fd_)) {
+      Requeue();
+      pthread_mutex_unlock(&commit_lock_);
+      close(next);
+      return false;
+    }
+
+    int previous = fd_;
+    pthread_mutex_lock(&lock_);
+    fd_ = next;
+    pthread_mutex_unlock(&lock_);
+    if (previous >= 0)
+      close(previous);
+    bytes_ = 0;
+    pthread_mutex_unlock(&commit_lock_);
+    return true;
+  }
+
+  /**
+   * @returns   The number of bytes committed to the current file
+   **/
+  uint64_t Bytes() const {
+    return bytes_;
+  }
+
+  /**
+   * Replay() reads a file back, stopping at the first record that was torn
+   * (or otherwise damaged) on its way to disk
+   *
+   * @param     path      The file to read back
+   * @param     handler   The handler to pass every intact record to
+   *
+   * @returns   The number of records read back, or -1 if there is no file
+   **/
+  static int Replay(const string& path, RecordHandler* handler) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return -1;
+
+    // The whole file is read in one go (a record is never split up)
+    struct stat status;
+    vector<char> contents;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+      contents.resize(status.st_size);
+    size_t size = 0;
+    while (size < contents.size()) {
+      ssize_t bytes_read = read(fd, &contents[size], contents.size() - size);
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      if (bytes_read <= 0)
+        break;
+      size += bytes_read;
+    }
+    close(fd);
+
+    int records = 0;
+    size_t offset = 0;
+    while (size - offset >= RECORD_HEADER_SIZE) {
+      uint32_t length, checksum;
+      memcpy(&length, &contents[offset], 4);
+      memcpy(&checksum, &contents[offset + 4], 4);
+      uint8_t type = contents[offset + 8];
+      const char* data = &contents[offset + RECORD_HEADER_SIZE];
+      if (size - offset - RECORD_HEADER_SIZE < length ||
+          Checksum(type, data, length) != checksum)
+        break;
+
+      handler->HandleRecord(type, data, length);
+      offset += RECORD_HEADER_SIZE + length;
+      records++;
+    }
+
+    return records;
+  }
+
+ private:
+  /**
+   * The file being appended to...
+   **/
+  int fd_;
+
+  /**
+   * ...how much has been committed to it...
+   **/
+  uint64_t bytes_;
+
+  /**
+   * ...the records appended since the last commit (guarded by lock_)...
+   **/
+  pthread_mutex_t lock_;
+  string pending_;
+
+  /**
+   * ...and the records being committed (guarded by commit_lock_, which is
+   * never taken while holding lock_)
+   **/
+  pthread_mutex_t commit_lock_;
+  string writing_;
+
+  /**
+   * Write() writes out and syncs the records being committed, which are
+   * only let go of once they are durable (commit_lock_ must be held)
+   *
+   * @param     fd        The file to write them to
+   * @returns   False if the records could not all be written (in which case
+   *            whatever part of them was is cut off the file again)
+   **/
+  bool Write(int fd) {
+    if (writing_.empty())
+      return true;
+
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0)
+      return false;
+
+    size_t written = 0;
+    while (written < writing_.size()) {
+      ssize_t result = write(fd, writing_.data() + written,
+                             writing_.size() - written);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result < 0)
+        break;
+      written += result;
+    }
+
+    if (written == writing_.size() && fdatasync(fd) == 0) {
+      bytes_ += written;
+      writing_.clear();
+      return true;
+    }
+
+    // Cut off whatever part of them made it, so that a retry does not follow
+    // a torn record (past which nothing would be read back)
+    while (ftruncate(fd, status.st_size) < 0 && errno == EINTR) {}
+    return false;
+  }
+
+  /**
+   * Requeue() puts the records that could not be written back ahead of
+   * everything appended since (commit_lock_ must be held)
+   **/
+  void Requeue() {
+    pthread_mutex_lock(&lock_);
+    pending_.insert(0, writing_);
+    pthread_mutex_unlock(&lock_);
+    writing_.clear();
+  }
+
+  /**
+   * @returns   The (FNV-1a) checksum of a record's type and payload
+   **/
+  static uint32_t Checksum(uint8_t type, const char* data, uint32_t length) {
+    uint32_t checksum = (2166136261u ^ type) * 16777619u;
+    for (uint32_t i = 0; i < length; i++)
+      checksum = (checksum ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    return checksum;
+  }
+
+  // The log owns its file descriptor so may not be copied
+  RecordLog(const RecordLog&);
+  RecordLog& operator=(const RecordLog&);
+};
+
+#endif  // _PERMANENTIP_COMMON_RECORDLOG_H_
@@ -0,0 +1,160 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is SipHash-2-4, a keyed hash of short messages that, without the key,
+ * can be neither forged nor predicted, used to authenticate requests
+ **/
+
+#ifndef _PERMANENTIP_COMMON_SIPHASH_H_
+#define _PERMANENTIP_COMMON_SIPHASH_H_
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using std::string;
+
+/**
+ * Keys are @ref SIPHASH_KEY_SIZE bytes, written as twice as many hex digits
+ **/
+#define SIPHASH_KEY_SIZE 16
+
+/** @cond PRIVATE_NAMESPACE_MEMBERS **/
+  #define SIPHASH_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+  #define SIPHASH_ROUND(v0, v1, v2, v3)                                    \
+    do {                                                                   \
+      v0 += v1; v1 = SIPHASH_ROTATE(v1, 13); v1 ^= v0;                     \
+      v0 = SIPHASH_ROTATE(v0, 32);                                         \
+      v2 += v3; v3 = SIPHASH_ROTATE(v3, 16); v3 ^= v2;                     \
+      v0 += v3; v3 = SIPHASH_ROTATE(v3, 21); v3 ^= v0;                     \
+      v2 += v1; v1 = SIPHASH_ROTATE(v1, 17); v1 ^= v2;                     \
+      v2 = SIPHASH_ROTATE(v2, 32);                                         \
+    } while (0)
+/** @endcond **/
+
+class SipHash {
+ public:
+  /**
+   * ParseKey() reads a key written in hex
+   *
+   * @param     text      The @ref SIPHASH_KEY_SIZE * 2 hex digits of the key
+   * @param     key       Set to the two halves of the key
+   *
+   * @returns   False if text is not a key
+   **/
+  static bool ParseKey(const string& text, uint64_t key[2]) {
+    if (text.length() != 2 * SIPHASH_KEY_SIZE)
+      return false;
+
+    key[0] = key[1] = 0;
+    for (int i = 0; i < 2 * SIPHASH_KEY_SIZE; i++) {
+      int digit = HexDigit(text[i]);
+      if (digit < 0)
+        return false;
+
+      // Each half is read as the little-endian number its bytes spell
+      int byte = i / 2;
+      int shift = 8 * (byte % 8) + (i % 2 == 0 ? 4 : 0);
+      key[byte / 8] |= static_cast<uint64_t>(digit) << shift;
+    }
+    return true;
+  }
+
+  /**
+   * Hash() computes the SipHash-2-4 of a message
+   *
+   * @param     key       The two halves of the key
+   * @param     data      The message
+   * @param     length    The number of bytes in the message
+   *
+   * @returns   The 64-bit hash
+   **/
+  static uint64_t Hash(const uint64_t key[2], const char* data, int length) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    int end = length - (length % 8);
+    for (int i = 0; i < end; i += 8) {
+      uint64_t word = 0;
+      for (int j = 0; j < 8; j++)
+        word |= static_cast<uint64_t>(bytes[i + j]) << (8 * j);
+
+      v3 ^= word;
+      SIPHASH_ROUND(v0, v1, v2, v3);
+      SIPHASH_ROUND(v0, v1, v2, v3);
+      v0 ^= word;
+    }
+
+    // The last word holds what is left, topped with the length
+    uint64_t word = static_cast<uint64_t>(length & 0xFF) << 56;
+    for (int j = 0; j < length % 8; j++)
+      word |= static_cast<uint64_t>(bytes[end + j]) << (8 * j);
+
+    v3 ^= word;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= word;
+
+    v2 ^= 0xFF;
+    for (int i = 0; i < 4; i++)
+      SIPHASH_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+  }
+
+  /**
+   * @param     hash      A hash
+   * @returns   The hash written as 16 hex digits
+   **/
+  static string ToHex(uint64_t hash) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx",
+             static_cast<unsigned long long>(hash));
+    return string(text);
+  }
+
+  /**
+   * Matches() compares a hash against one written in hex, taking as long
+   * however much of it is right (so that a forger learns nothing from how
+   * quickly a guess is turned down)
+   *
+   * @param     hash      The hash the message should have
+   * @param     text      The hash it came with
+   * @param     length    The number of characters in text
+   *
+   * @returns   True if they are the same
+   **/
+  static bool Matches(uint64_t hash, const char* text, int length) {
+    string expected = ToHex(hash);
+    if (length != static_cast<int>(expected.length()))
+      return false;
+
+    unsigned char difference = 0;
+    for (int i = 0; i < length; i++)
+      difference |= static_cast<unsigned char>(expected[i] ^ text[i]);
+    return difference == 0;
+  }
+
+ private:
+  /**
+   * @returns   The value of a hex digit, or -1 if it is not one
+   **/
+  static int HexDigit(char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+};
+
+#endif  // _PERMANENTIP_COMMON_SIPHASH_H_
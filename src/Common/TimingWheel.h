@@ -0,0 +1,147 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is a hierarchical timing wheel, which schedules any number of
+ * deadlines (measured in ticks) for O(1) work each per tick
+ **/
+
+#ifndef _PERMANENTIP_COMMON_TIMINGWHEEL_H_
+#define _PERMANENTIP_COMMON_TIMINGWHEEL_H_
+
+#include <stdint.h>
+#include <vector>
+
+using std::vector;
+
+/**
+ * Each of the @ref WHEEL_LEVELS wheels has @ref WHEEL_SLOTS slots, and each
+ * slot of a wheel spans a whole turn of the wheel below it.  Deadlines more
+ * than WHEEL_SLOTS^WHEEL_LEVELS ticks away are brought in to the edge of the
+ * outermost wheel (callers check what fires and schedule it again).
+ **/
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/**
+ * A TimingWheel hands back the keys whose deadlines have passed as the wheel
+ * is advanced.  Scheduled keys cannot be cancelled; callers are expected to
+ * keep the real deadline alongside whatever the key refers to and to simply
+ * schedule the key again if it fires early.  The wheel is not thread-safe;
+ * callers must hold their own lock.
+ **/
+class TimingWheel {
+ public:
+  /**
+   * @param     now         The current tick
+   **/
+  explicit TimingWheel(uint64_t now) : current_(now), size_(0) {
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+      slots_[level].resize(WHEEL_SLOTS);
+  }
+
+  /**
+   * Schedule() arranges for a key to be handed back once the wheel reaches
+   * the deadline (or the very next tick, if the deadline has passed)
+   *
+   * @param     key         Whatever the caller needs to find what expired
+   * @param     deadline    The tick at which the key expires
+   **/
+  void Schedule(uint64_t key, uint64_t deadline) {
+    if (deadline <= current_)
+      deadline = current_ + 1;
+
+    uint64_t delta = deadline - current_;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (static_cast<uint64_t>(1) << (WHEEL_BITS * (level + 1))))
+      level++;
+
+    // Too far out for even the outermost wheel
+    uint64_t range = static_cast<uint64_t>(1) << (WHEEL_BITS * WHEEL_LEVELS);
+    if (delta >= range)
+      deadline = current_ + range - 1;
+
+    Entry entry = { key, deadline };
+    slots_[level][(deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]
+      .push_back(entry);
+    size_++;
+  }
+
+  /**
+   * Advance() turns the wheel forward, one tick at a time, to the current
+   * tick
+   *
+   * @param     now         The current tick
+   * @param     expired     Where to append every key whose deadline passed
+   **/
+  void Advance(uint64_t now, vector<uint64_t>* expired) {
+    while (current_ < now) {
+      current_++;
+
+      // Each time a wheel comes full circle, the next slot of the wheel
+      // above it is spread out over the wheels below
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((current_ & ((static_cast<uint64_t>(1) <<
+                          (WHEEL_BITS * level)) - 1)) != 0)
+          break;
+
+        vector<Entry>& slot =
+          slots_[level][(current_ >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+        cascade_.swap(slot);
+        size_ -= cascade_.size();
+        for (unsigned int i = 0; i < cascade_.size(); i++)
+          Schedule(cascade_[i].key, cascade_[i].deadline);
+        cascade_.clear();
+      }
+
+      vector<Entry>& slot = slots_[0][current_ & (WHEEL_SLOTS - 1)];
+      for (unsigned int i = 0; i < slot.size(); i++)
+        expired->push_back(slot[i].key);
+      size_ -= slot.size();
+      slot.clear();
+    }
+  }
+
+  /**
+   * @returns   The number of keys waiting to expire
+   **/
+  uint64_t Size() const {
+    return size_;
+  }
+
+ private:
+  /**
+   * A key along with the tick it expires at
+   **/
+  struct Entry {
+    uint64_t key;
+    uint64_t deadline;
+  };
+
+  /**
+   * How far the wheel has turned...
+   **/
+  uint64_t current_;
+
+  /**
+   * ...how many keys are on it...
+   **/
+  uint64_t size_;
+
+  /**
+   * ...the slots of every wheel (innermost first)...
+   **/
+  vector<vector<Entry> > slots_[WHEEL_LEVELS];
+
+  /**
+   * ...and the slot being spread out over the wheels below it
+   **/
+  vector<Entry> cascade_;
+};
+
+#endif  // _PERMANENTIP_COMMON_TIMINGWHEEL_H_
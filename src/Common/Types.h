@@ -32,10 +32,12 @@ typedef string NetworkMsg;
 
 /**
  * We always lookup on the port specified by @ref GLOB_LOOKUP_PORT and register
- * on the port specified by @ref GLOB_REGIST_PORT to simplify our demo
+ * on the port specified by @ref GLOB_REGIST_PORT to simplify our demo (and
+ * the DNS takes changes to its names on @ref GLOB_DNS_ADMIN_PORT)
  **/
 #define GLOB_LOOKUP_PORT 16000
 #define GLOB_REGIST_PORT 16001
+#define GLOB_DNS_ADMIN_PORT 16002
 
 /**
  * We limit the maximum possible traffic over a network to avoid accidental
@@ -45,6 +47,46 @@ typedef string NetworkMsg;
 #define MAX_CONNECTIONS 64
 #define FULL_SUBNET 16777215
 
+/**
+ * No datagram we send or receive is ever larger than @ref MAX_DATAGRAM_SIZE,
+ * and the servers read up to @ref GLOB_BATCH_SIZE of them per system call
+ * unless told otherwise
+ **/
+#define MAX_DATAGRAM_SIZE 4096
+#define GLOB_BATCH_SIZE 32
+
+/**
+ * The DNS lets clients cache the RS it resolved a name to for
+ * @ref GLOB_RESOLUTION_TTL_S seconds (and the fact that it had none for
+ * @ref NEGATIVE_RESOLUTION_TTL_S), which is also what clients assume when a
+ * reply does not say
+ **/
+#define GLOB_RESOLUTION_TTL_S 300
+#define NEGATIVE_RESOLUTION_TTL_S 30
+
+/**
+ * The RS drops a registration (along with the registrant's subscriptions),
+ * or a single subscription, that has not been renewed for @ref GLOB_LEASE_S
+ * seconds, so mobile nodes renew theirs every @ref LEASE_RENEWAL_S seconds
+ **/
+#define GLOB_LEASE_S 300
+#define LEASE_RENEWAL_S 100
+
+/**
+ * Mobile nodes speak the compact binary protocol of Common/WireProtocol.h
+ * unless TEXT_PROTOCOL_APPLICATION is defined here instead (the servers always
+ * answer each request in whichever protocol it arrived in)
+ **/
+#define BINARY_PROTOCOL_APPLICATION
+
+/**
+ * Text requests to the RS lookup port of the form subscriber|subscribee
+ * subscribe, unless followed by |@ref TEXT_UNSUBSCRIBE or |@ref TEXT_LOOKUP
+ * (every one of them may be repeated without changing the outcome)
+ **/
+#define TEXT_UNSUBSCRIBE "unsubscribe"
+#define TEXT_LOOKUP "lookup"
+
 /** @todo In the future we should support TCP & SCTP applications, but as of now
  *        we use this hash-define to say that we are using UDP always **/
 #define UDP_APPLICATION
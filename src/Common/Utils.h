@@ -15,6 +15,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#include <stdint.h>
+#include <time.h>
 #include <string>
 #include <cstdio>
 #include <cstdarg>
@@ -255,6 +257,22 @@ namespace Utils {
     return word;
   }
 
+  /**
+   * Every message on the wire is its payload followed by a single NUL, so it is
+   * the length of the datagram (not the size of the buffer it was read into)
+   * that delimits a message.  MsgFromDatagram() recovers that payload.
+   *
+   * @param   buffer            The buffer the datagram was read into
+   * @param   bytes_read        The length of the datagram (from recvfrom)
+   * @returns The payload of the datagram, or "" if nothing was read
+   **/
+  static inline NetworkMsg MsgFromDatagram(const char* buffer, int bytes_read) {
+    if (bytes_read <= 0)
+      return "";
+
+    return NetworkMsg(buffer, strnlen(buffer, bytes_read));
+  }
+
   /**
    * IntToIPName() provides a utility to convert a standard IPv4 integer-based
    * address given from sockaddr_in.sin_addr.s_addr to an IP name provided
@@ -343,6 +361,18 @@ namespace Utils {
 
     return -1;
   }
+
+  /**
+   * The GetTime() method reads a monotonic clock, for measuring timeouts that
+   * must not jump when the wall clock is changed
+   *
+   * @returns The number of milliseconds since some fixed point in the past
+   **/
+  static inline uint64_t GetTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+  }
 }
 
 #endif  // _PERMANENTIP_COMMON_UTILS_H_
@@ -0,0 +1,342 @@
+/**
+ * @file
+ * @author Thaddeus Diamond <diamond@cs.yale.edu>
+ * @version 0.1
+ *
+ * @section DESCRIPTION
+ *
+ * This is the compact binary protocol spoken between mobile nodes, the DNS
+ * and the RS, along with a parser and a builder that never allocate
+ **/
+
+#ifndef _PERMANENTIP_COMMON_WIREPROTOCOL_H_
+#define _PERMANENTIP_COMMON_WIREPROTOCOL_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <cstring>
+
+#include "Common/Types.h"
+
+/**
+ * Every binary message begins with @ref WIRE_MAGIC (which is not ASCII, so no
+ * text message can ever be mistaken for one) and the protocol version
+ **/
+#define WIRE_MAGIC 0xB1
+#define WIRE_VERSION 1
+
+/**
+ * A message is a fixed @ref WIRE_HEADER_SIZE byte header (magic, version,
+ * opcode, flags and a request id in network byte order) followed by two
+ * length-prefixed names of at most @ref MAX_WIRE_NAME bytes each and a binary
+ * IPv4 address (also in network byte order).  If the @ref WIRE_TTL flag is
+ * set a @ref WIRE_TTL_SIZE byte TTL (in seconds, network byte order) follows.
+ * Any number of messages can be packed back to back into one datagram.
+ **/
+#define WIRE_HEADER_SIZE 8
+#define MAX_WIRE_NAME 255
+#define MIN_WIRE_MESSAGE (WIRE_HEADER_SIZE + 2 + 4)
+#define WIRE_TTL_SIZE 4
+
+/**
+ * @enum WireOpcode
+ *
+ * What a message asks for (or answers).  Replies carry the request id of the
+ * request they answer and none of its names.
+ **/
+enum WireOpcode {
+  WIRE_REGISTER = 1,      // name: node registering (at the RS)
+  WIRE_REGISTERED = 2,    // address: where the node registered from
+  WIRE_LOOKUP = 3,        // name: asker, target: node looked up (at the RS)
+  WIRE_LOOKED_UP = 4,     // address: where the node is
+  WIRE_RESOLVE = 5,       // name: node to find the RS of (at the DNS)
+  WIRE_RESOLVED = 6,      // address: the RS responsible for the node
+  WIRE_UPDATE = 7,        // name: node that moved, address: where it is now
+  WIRE_DEREGISTER = 8,    // name: node leaving (at the RS)
+  WIRE_DEREGISTERED = 9,  // address: where the node deregistered from
+  WIRE_SUBSCRIBE = 10,    // name: subscriber, target: subscribee (at the RS)
+  WIRE_SUBSCRIBED = 11,   // address: where the subscribee is
+  WIRE_UNSUBSCRIBE = 12,  // name: subscriber, target: subscribee (at the RS)
+  WIRE_UNSUBSCRIBED = 13, // address: where the subscribee is
+};
+
+/**
+ * @enum WireFlags
+ *
+ * Flags qualifying a message (a reply that found nothing says so explicitly
+ * rather than sending an empty address, and a reply may say how long its
+ * answer can be cached for)
+ **/
+enum WireFlags {
+  WIRE_NOT_FOUND = 1,
+  WIRE_TTL = 2,
+};
+
+/**
+ * A WireMessage is a view of one parsed message.  The names point straight
+ * into the datagram they were parsed from and are not NUL-terminated.
+ **/
+struct WireMessage {
+  WireOpcode opcode;
+  uint8_t flags;
+  uint32_t request_id;
+
+  const char* name;
+  int name_length;
+
+  const char* target;
+  int target_length;
+
+  int address;
+
+  /**
+   * How many seconds the answer may be cached for (0 if the message does not
+   * say, see @ref WIRE_TTL)
+   **/
+  uint32_t ttl;
+};
+
+/**
+ * A WireReader walks the messages packed into a datagram
+ **/
+class WireReader {
+ public:
+  /**
+   * @param     data      The datagram to parse
+   * @param     length    The number of bytes in the datagram
+   **/
+  WireReader(const char* data, int length)
+      : data_(reinterpret_cast<const unsigned char*>(data)), length_(length),
+        offset_(0), malformed_(false) {}
+
+  /**
+   * IsWireMessage() lets the servers tell binary requests from the old text
+   * protocol, one datagram at a time
+   *
+   * @param     data      The datagram received
+   * @param     length    The number of bytes in the datagram
+   * @returns   True if the datagram holds binary messages
+   **/
+  static bool IsWireMessage(const char* data, int length) {
+    return (length > 0 && static_cast<unsigned char>(data[0]) == WIRE_MAGIC);
+  }
+
+  /**
+   * Next() parses the next message of the datagram
+   *
+   * @param     message   The view to fill in with the next message
+   * @returns   False once the datagram is exhausted or is malformed
+   **/
+  bool Next(WireMessage* message) {
+    if (malformed_ || offset_ >= length_)
+      return false;
+
+    if (length_ - offset_ < MIN_WIRE_MESSAGE ||
+        data_[offset_] != WIRE_MAGIC || data_[offset_ + 1] != WIRE_VERSION)
+      return Malform();
+
+    message->opcode = static_cast<WireOpcode>(data_[offset_ + 2]);
+    message->flags = data_[offset_ + 3];
+    uint32_t request_id;
+    memcpy(&request_id, &data_[offset_ + 4], sizeof(request_id));
+    message->request_id = ntohl(request_id);
+
+    int offset = offset_ + WIRE_HEADER_SIZE;
+    if (!ReadName(&offset, &message->name, &message->name_length) ||
+        !ReadName(&offset, &message->target, &message->target_length) ||
+        length_ - offset < 4)
+      return Malform();
+
+    memcpy(&message->address, &data_[offset], sizeof(message->address));
+    offset += 4;
+
+    message->ttl = 0;
+    if (message->flags & WIRE_TTL) {
+      if (length_ - offset < WIRE_TTL_SIZE)
+        return Malform();
+      uint32_t ttl;
+      memcpy(&ttl, &data_[offset], sizeof(ttl));
+      message->ttl = ntohl(ttl);
+      offset += WIRE_TTL_SIZE;
+    }
+
+    offset_ = offset;
+    return true;
+  }
+
+  /**
+   * @returns   True if parsing stopped because the datagram was corrupt
+   **/
+  bool Malformed() const {
+    return malformed_;
+  }
+
+  /**
+   * @returns   The number of bytes parsed so far
+   **/
+  int Offset() const {
+    return offset_;
+  }
+
+ private:
+  bool ReadName(int* offset, const char** name, int* name_length) {
+    if (*offset >= length_ || length_ - *offset - 1 < data_[*offset])
+      return false;
+
+    *name_length = data_[*offset];
+    *name = reinterpret_cast<const char*>(&data_[*offset + 1]);
+    *offset += 1 + *name_length;
+    return true;
+  }
+
+  bool Malform() {
+    malformed_ = true;
+    return false;
+  }
+
+  /**
+   * The datagram being parsed...
+   **/
+  const unsigned char* data_;
+  int length_;
+
+  /**
+   * ...how far into it we are...
+   **/
+  int offset_;
+
+  /**
+   * ...and whether we gave up on it
+   **/
+  bool malformed_;
+};
+
+/**
+ * A WireWriter packs messages back to back into a caller-owned buffer.  The
+ * servers build their replies over the very datagram being parsed; this is
+ * safe since a reply (carrying no names) is never longer than its request,
+ * unless it carries a TTL (which callers only add when it still fits before
+ * the next unparsed request).
+ **/
+class WireWriter {
+ public:
+  /**
+   * @param     buffer    Where to write the messages
+   * @param     capacity  The number of bytes available in buffer
+   **/
+  WireWriter(char* buffer, int capacity)
+      : buffer_(reinterpret_cast<unsigned char*>(buffer)),
+        capacity_(capacity), length_(0) {}
+
+  /**
+   * Append() adds one message to the buffer
+   *
+   * @param     opcode          What the message asks for or answers
+   * @param     flags           Any @ref WireFlags qualifying the message
+   * @param     request_id      The request the message is (or answers)
+   * @param     name            The first name (may be NULL if name_length
+   *                            is zero)
+   * @param     name_length     The number of bytes in name
+   * @param     target          The second name (may be NULL if
+   *                            target_length is zero)
+   * @param     target_length   The number of bytes in target
+   * @param     address         A binary IP address in network byte order
+   *
+   * @returns   False (writing nothing) if the message does not fit
+   **/
+  bool Append(WireOpcode opcode, uint8_t flags, uint32_t request_id,
+              const char* name, int name_length, const char* target,
+              int target_length, int address) {
+    if (name_length > MAX_WIRE_NAME || target_length > MAX_WIRE_NAME ||
+        capacity_ - length_ < MIN_WIRE_MESSAGE + name_length + target_length)
+      return false;
+
+    unsigned char* message = &buffer_[length_];
+    message[0] = WIRE_MAGIC;
+    message[1] = WIRE_VERSION;
+    message[2] = opcode;
+    message[3] = flags;
+    uint32_t network_id = htonl(request_id);
+    memcpy(&message[4], &network_id, sizeof(network_id));
+
+    int offset = WIRE_HEADER_SIZE;
+    message[offset++] = name_length;
+    memmove(&message[offset], name, name_length);
+    offset += name_length;
+    message[offset++] = target_length;
+    memmove(&message[offset], target, target_length);
+    offset += target_length;
+    memcpy(&message[offset], &address, sizeof(address));
+
+    length_ += offset + 4;
+    return true;
+  }
+
+  /**
+   * Append() can also build a message from whole logical addresses
+   **/
+  bool Append(WireOpcode opcode, uint8_t flags, uint32_t request_id,
+              const LogicalAddress& name, const LogicalAddress& target,
+              int address) {
+    return Append(opcode, flags, request_id, name.data(), name.length(),
+                  target.data(), target.length(), address);
+  }
+
+  /**
+   * Reply() appends the answer to a request, which carries only an address
+   *
+   * @param     opcode          The opcode of the reply
+   * @param     request         The request being answered
+   * @param     address         The answer, or 0 if there is none
+   *
+   * @returns   False (writing nothing) if the reply does not fit
+   **/
+  bool Reply(WireOpcode opcode, const WireMessage& request, int address) {
+    return Append(opcode, (address == 0 ? WIRE_NOT_FOUND : 0),
+                  request.request_id, NULL, 0, NULL, 0, address);
+  }
+
+  /**
+   * Reply() can also say how long the answer may be cached for
+   *
+   * @param     opcode          The opcode of the reply
+   * @param     request         The request being answered
+   * @param     address         The answer, or 0 if there is none
+   * @param     ttl             The seconds the answer may be cached for
+   *
+   * @returns   False (writing nothing) if the reply does not fit
+   **/
+  bool Reply(WireOpcode opcode, const WireMessage& request, int address,
+             uint32_t ttl) {
+    if (capacity_ - length_ < MIN_WIRE_MESSAGE + WIRE_TTL_SIZE ||
+        !Append(opcode, (address == 0 ? WIRE_NOT_FOUND : 0) | WIRE_TTL,
+                request.request_id, NULL, 0, NULL, 0, address))
+      return false;
+
+    uint32_t network_ttl = htonl(ttl);
+    memcpy(&buffer_[length_], &network_ttl, sizeof(network_ttl));
+    length_ += WIRE_TTL_SIZE;
+    return true;
+  }
+
+  /**
+   * @returns   The number of bytes written so far
+   **/
+  int Length() const {
+    return length_;
+  }
+
+ private:
+  /**
+   * The buffer being written...
+   **/
+  unsigned char* buffer_;
+  int capacity_;
+
+  /**
+   * ...and how much of it is used
+   **/
+  int length_;
+};
+
+#endif  // _PERMANENTIP_COMMON_WIREPROTOCOL_H_
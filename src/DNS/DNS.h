@@ -54,6 +54,16 @@ class DNS {
    **/
   virtual bool AddName(LogicalAddress name, PhysicalAddress address) = 0;
 
+  /**
+   * Every DNS should likewise be able to take a name back out of its
+   * registrar.
+   *
+   * @param     name      The logical address being removed
+   *
+   * @returns   True if the name was in the registrar, false otherwise.
+   **/
+  virtual bool RemoveName(LogicalAddress name) = 0;
+
   /**
    * Given a specific logical address, the DNS should be able to lookup and
    * return its physical address.
@@ -10,20 +10,109 @@
 
 #include "DNS/SimpleDNS.h"
 
+bool DNSWorker::HandleEvent(int fd) {
+  return (fd == admin_listener_ ? dns_->HandleAdminRequests(this) :
+          dns_->HandleRequests(this));
+}
+
+bool DNSWorker::Run() {
+  // Sleep until there are lookups, a SIGINT or a call to ShutDown()
+  while (event_loop_.RunOnce() && Signal::ShouldContinue()) {}
+  return true;
+}
+
+SimpleDNS::SimpleDNS(int batch_size, int workers, const string& snapshot,
+                     const string& zone, const string& admin_key) :
+    port_(GLOB_LOOKUP_PORT), domain_(GLOB_DOM), transport_layer_(GLOB_TL),
+    protocol_(GLOB_PROTO), snapshot_path_(snapshot), zone_path_(zone),
+    admin_key_text_(admin_key), admin_sequence_(0) {
+  for (int i = 0; i < (workers < 1 ? 1 : workers); i++)
+    workers_.push_back(new DNSWorker(this, batch_size));
+}
+
+SimpleDNS::~SimpleDNS() {
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    delete workers_[i];
+}
+
 bool SimpleDNS::Start() {
-  /** @todo   Hypothetically we should accept requests for adding new names
-   *          to the namespace from trusted sources instead of just using
-   *          statically defined names (as we do for a demo) **/
-  assert(AddName("python", "128.36.232.37"));  // RS on Cobra
-  assert(AddName("tick", "128.36.232.37"));    // RS on Cobra
-  assert(BeginListening());
+  // Names come from the last run and the zone file, and only if there are
+  // neither do we fall back on statically defined names (as for a demo)
+  // (a compiled zone is served in place, and any other is loaded name by name)
+  bool restarted = OpenSnapshot();
+  if (!zone_path_.empty() && zone_table_.Open(zone_path_))
+    Log(stderr, SUCCESS, "Serving %d names from %s", zone_table_.Size(),
+        zone_path_.c_str());
+  else if (!zone_path_.empty() && !LoadZone(zone_path_))
+    return ShutDown("Could not load the zone file %s", zone_path_.c_str());
+  if (!restarted && zone_path_.empty()) {
+    assert(AddName("python", "128.36.232.37"));  // RS on Cobra
+    assert(AddName("tick", "128.36.232.37"));    // RS on Cobra
+  }
 
+  // Without a key nobody can change our names, so there is no admin port
+  if (!admin_key_text_.empty() &&
+      !SipHash::ParseKey(admin_key_text_, admin_key_))
+    return ShutDown("The admin key must be %d hex digits",
+                    2 * SIPHASH_KEY_SIZE);
+  if (!admin_key_text_.empty() && !OpenAdminLog())
+    return ShutDown("Could not open the admin log %s%s",
+                    snapshot_path_.c_str(), ADMIN_LOG_SUFFIX);
   Signal::RestartProgram();
   Signal::HandleSignalInterrupts();
-  do {
-    assert(HandleRequests());
-    usleep(500);
-  } while (Signal::ShouldContinue());
+
+  // Every worker binds its own listener, and the kernel balances between them
+  for (unsigned int i = 0; i < workers_.size(); i++) {
+    DNSWorker* worker = workers_[i];
+    if (!BeginListening(port_, &worker->listener_))
+      return false;
+    if (!worker->event_loop_.Watch(worker->listener_, worker))
+      return ShutDown("Could not watch the DNS listener");
+  }
+
+  // ...but admin requests are few, so the first worker takes them all
+  DNSWorker* admin = workers_[0];
+  if (!admin_key_text_.empty() &&
+      !BeginListening(GLOB_DNS_ADMIN_PORT, &admin->admin_listener_))
+    return false;
+  if (admin->admin_listener_ >= 0 &&
+      !admin->event_loop_.Watch(admin->admin_listener_, admin))
+    return ShutDown("Could not watch the DNS admin listener");
+
+  // Only the first worker (on this thread) should ever see a SIGINT
+  sigset_t blocked, previous;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+  for (unsigned int i = 1; i < workers_.size(); i++)
+    pthread_create(&workers_[i]->thread_, NULL, &RunDNSWorkerThread,
+                   workers_[i]);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  workers_[0]->Run();
+
+  // However we got here, make sure the rest of the workers stop too
+  for (unsigned int i = 1; i < workers_.size(); i++) {
+    workers_[i]->event_loop_.Stop();
+    pthread_join(workers_[i]->thread_, NULL);
+  }
+
+  for (unsigned int i = 0; i < workers_.size(); i++) {
+    close(workers_[i]->listener_);
+    if (workers_[i]->admin_listener_ >= 0)
+      close(workers_[i]->admin_listener_);
+  }
+  admin_log_.Close();
+
+  // Whatever we have learned is there for the next run to start from (and
+  // only then can the admin changes be dropped from their log)
+  if (!snapshot_path_.empty() && !Snapshot())
+    Log(stderr, ERROR, "Could not write the DNS snapshot to %s",
+        snapshot_path_.c_str());
+  else if (!admin_key_text_.empty() && !CompactAdminLog())
+    Log(stderr, ERROR, "Could not compact the admin log %s%s",
+        snapshot_path_.c_str(), ADMIN_LOG_SUFFIX);
   return true;
 }
 
@@ -35,90 +124,510 @@ bool SimpleDNS::ShutDown(const char* format, ...) {
   Log(stderr, WARNING, format, arguments);
   perror(")");
 
-  close(listener_);
+  // The listeners are closed by Start() once the event loops have woken up
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    workers_[i]->event_loop_.Stop();
   Signal::ExitProgram(0);
 
   Log(stderr, SUCCESS, "OK");
   return false;
 }
 
-bool SimpleDNS::BeginListening() {
-  listener_ = socket(domain_, transport_layer_, protocol_);
-  if (listener_ < 0)
+bool SimpleDNS::BeginListening(unsigned short port, int* listener) {
+  *listener = socket(domain_, transport_layer_, protocol_);
+  if (*listener < 0)
     return ShutDown("Could not begin listening on DNS");
 
+  // Port sharing must be requested before the bind for it to take effect
+  int on = 1;
+  if (setsockopt(*listener, SOL_SOCKET, SO_REUSEADDR,
+                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
+    return ShutDown("Could not make the socket reusable");
+  if (setsockopt(*listener, SOL_SOCKET, SO_REUSEPORT,
+                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
+    return ShutDown("Could not share the port between workers");
+
   struct sockaddr_in server;
   memset(&server, 0, sizeof(server));
   server.sin_family = domain_;
   server.sin_addr.s_addr = INADDR_ANY;
-  server.sin_port = htons(port_);
+  server.sin_port = htons(port);
 
-  if (bind(listener_, reinterpret_cast<struct sockaddr*>(&server),
+  if (bind(*listener, reinterpret_cast<struct sockaddr*>(&server),
            sizeof(server)))
     return ShutDown("Could not bind listening connection");
 
 #ifdef TCP_APPLICATION
-  if (listen(listener_, MAX_CONNECTIONS))
+  if (listen(*listener, MAX_CONNECTIONS))
     return ShutDown("Could not listen on DNS port");
 #endif
 
-  int on;
-  if (setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR,
-                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
-    return ShutDown("Could not make the socket reusable");
-
   int opts;
-  if ((opts = fcntl(listener_, F_GETFL)) < 0)
+  if ((opts = fcntl(*listener, F_GETFL)) < 0)
     return ShutDown("Error getting the socket options");
-  if (fcntl(listener_, F_SETFL, opts | O_NONBLOCK) < 0)
+  if (fcntl(*listener, F_SETFL, opts | O_NONBLOCK) < 0)
     return ShutDown("Error setting the socket to nonblocking");
 
-  Log(stderr, SUCCESS, "Now listening for requests on port %d", port_);
+  Log(stderr, SUCCESS, "Now listening for requests on port %d", port);
 
   return true;
 }
 
-bool SimpleDNS::HandleRequests() {
-  struct sockaddr_in request_src;
-  socklen_t request_src_size = sizeof(request_src);
-
-  char buffer[4096];
-  memset(buffer, 0, sizeof(buffer));
+bool SimpleDNS::HandleRequests(DNSWorker* worker) {
+  DatagramBatch& batch = worker->batch_;
 
+  // The listener is edge-triggered so we must drain it until EAGAIN
+  for (;;) {
 #ifdef UDP_APPLICATION
-  int bytes_read = recvfrom(listener_, buffer, sizeof(buffer), 0,
-                            reinterpret_cast<struct sockaddr*>(&request_src),
-                            &request_src_size);
+    int received = batch.Receive(worker->listener_);
 #elif TCP_APPLICATION
-  int bytes_read = -1;
-  ShutDown("TCP is not yet supported in the DNS");
+    int received = -1;
+    ShutDown("TCP is not yet supported in the DNS");
 #endif
 
-  if (bytes_read > 0) {
-    Log(stderr, SUCCESS, "Sending DNS lookup of <%s, %s> to (%d:%d)", buffer,
-        LookupName(buffer).c_str(), request_src.sin_addr.s_addr,
-        ntohs(request_src.sin_port));
-    snprintf(buffer, sizeof(buffer), "%s", LookupName(buffer).c_str());
+    if (received < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+      return true;
+    else if (received < 0 && errno == EINTR)
+      continue;
+    else if (received < 0)
+      return ShutDown("Error listening on socket");
+
+    for (int i = 0; i < received; i++) {
+      if (batch.Length(i) == 0)
+        continue;
+
+      const char* buffer = batch.Data(i);
+      struct sockaddr_in* request_src = batch.Source(i);
+
+      // Binary datagrams may carry many lookups, all answered in one reply
+      if (WireReader::IsWireMessage(buffer, batch.Length(i))) {
+        int reply_length = AnswerWireRequests(batch.Data(i), batch.Length(i));
+        Log(stderr, SUCCESS, "Sending DNS lookups (%d bytes) to (%d:%d)",
+            reply_length, request_src->sin_addr.s_addr,
+            ntohs(request_src->sin_port));
+        if (reply_length > 0)
+          batch.QueueReply(i, reply_length);
+        continue;
+      }
+
+      PhysicalAddress address = LookupName(buffer);
+
+      Log(stderr, SUCCESS, "Sending DNS lookup of <%s, %s> to (%d:%d)", buffer,
+          address.c_str(), request_src->sin_addr.s_addr,
+          ntohs(request_src->sin_port));
+      batch.QueueReply(i, address);
+    }
 
 #ifdef UDP_APPLICATION
-    sendto(listener_, buffer, sizeof(buffer), 0,
-           reinterpret_cast<struct sockaddr*>(&request_src),
-           request_src_size);
-#elif TCP_APPLICATION
-    request_src_size = -1;
+    batch.Flush(worker->listener_);
 #endif
-  } else if (bytes_read < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-    return ShutDown("Error listening on socket");
   }
+}
+
+int SimpleDNS::AnswerWireRequests(char* datagram, int length) {
+  WireReader reader(datagram, length);
+  WireWriter writer(datagram, MAX_DATAGRAM_SIZE);
+
+  WireMessage request;
+  while (reader.Next(&request)) {
+    if (request.opcode != WIRE_RESOLVE)
+      continue;
+
+    // The TTL makes a reply longer than a request for a very short name, so
+    // it is left off whenever it would overwrite the next request
+    int address = ResolveName(request.name, request.name_length);
+    if (writer.Length() + MIN_WIRE_MESSAGE + WIRE_TTL_SIZE <= reader.Offset())
+      writer.Reply(WIRE_RESOLVED, request, address,
+                   (address == 0 ? NEGATIVE_RESOLUTION_TTL_S :
+                    GLOB_RESOLUTION_TTL_S));
+    else
+      writer.Reply(WIRE_RESOLVED, request, address);
+  }
+
+  return writer.Length();
+}
+
+int SimpleDNS::ResolveName(const char* name, int name_length) {
+  // A name we have ever held (even one since removed) hides the snapshot's
+  // (and every tier turns an unknown name away at its filter, before its
+  // index is probed)
+  int address;
+  if (names_.Find(name, name_length, &address))
+    return address;
+
+  int entry = zone_table_.Find(name, name_length);
+  if (entry >= 0)
+    return zone_table_.Address(entry);
+  return SnapshotAddress(name, name_length);
+}
 
+int SimpleDNS::SnapshotAddress(const char* name, int name_length) const {
+  int entry = snapshot_.Find(name, name_length);
+  return (entry < 0 ? 0 : snapshot_.Address(entry));
+}
+
+bool SimpleDNS::OpenSnapshot() {
+  if (snapshot_path_.empty() || !snapshot_.Open(snapshot_path_))
+    return false;
+
+  Log(stderr, SUCCESS, "Serving %d names from %s", snapshot_.Size(),
+      snapshot_path_.c_str());
   return true;
 }
 
+bool SimpleDNS::Snapshot() {
+  // Removed names are left out, but still hide the snapshot's
+  vector< pair<LogicalAddress, int> > held, entries;
+  names_.Entries(&held);
+  for (unsigned int i = 0; i < held.size(); i++)
+    if (held[i].second != 0)
+      entries.push_back(held[i]);
+
+  int address;
+  for (int i = 0; i < snapshot_.Size(); i++) {
+    LogicalAddress name = snapshot_.Name(i);
+    if (!names_.Find(name.data(), name.length(), &address))
+      entries.push_back(pair<LogicalAddress, int>(name, snapshot_.Address(i)));
+  }
+
+  return MappedTable::Write(snapshot_path_, &entries, 0);
+}
+
 bool SimpleDNS::AddName(LogicalAddress name, PhysicalAddress address) {
-  registered_names_[name] = address;
+  SetName(name, IPStringToInt(address));
   return true;
 }
 
+void SimpleDNS::SetName(const LogicalAddress& name, int address) {
+  // The first change to a name takes it out of the snapshot for good
+  names_.Set(name.data(), name.length(), address);
+}
+
+bool SimpleDNS::RemoveName(LogicalAddress name) {
+  // The name is kept (as 0) so that the snapshot's is hidden too
+  bool removed = (ResolveName(name.data(), name.length()) != 0);
+  names_.Set(name.data(), name.length(), 0);
+  return removed;
+}
+
 PhysicalAddress SimpleDNS::LookupName(LogicalAddress name) {
-  return (registered_names_.count(name) > 0 ? registered_names_[name] : "");
+  int address = ResolveName(name.data(), name.length());
+  return (address == 0 ? "" : IntToIPString(address));
+}
+
+bool SimpleDNS::LoadZone(const string& path) {
+  uint64_t start = GetTime();
+  vector< pair<LogicalAddress, int> > entries;
+  int malformed;
+  if (!ReadZone(path, &entries, &malformed))
+    return false;
+
+  for (unsigned int i = 0; i < entries.size(); i++)
+    SetName(entries[i].first, entries[i].second);
+
+  if (malformed > 0)
+    Log(stderr, WARNING, "Skipped %d malformed lines of %s", malformed,
+        path.c_str());
+  Log(stderr, SUCCESS, "Loaded %d names from %s in %d ms",
+      static_cast<int>(entries.size()), path.c_str(),
+      static_cast<int>(GetTime() - start));
+  return true;
+}
+
+bool SimpleDNS::CompileZone(const string& zone, const string& compiled) {
+  vector< pair<LogicalAddress, int> > entries;
+  int malformed;
+  if (!ReadZone(zone, &entries, &malformed))
+    return false;
+  if (malformed > 0)
+    Log(stderr, WARNING, "Skipped %d malformed lines of %s", malformed,
+        zone.c_str());
+
+  // A name given twice takes the later line, as it would have if loaded
+  std::reverse(entries.begin(), entries.end());
+  return PerfectTable::Write(compiled, &entries, 0);
+}
+
+bool SimpleDNS::ReadZone(const string& path,
+                         vector< pair<LogicalAddress, int> >* entries,
+                         int* malformed) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    return false;
+  }
+
+  // An empty zone is still a zone, but cannot be mapped
+  size_t size = status.st_size;
+  const char* zone = NULL;
+  if (size > 0) {
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    zone = static_cast<const char*>(mapping);
+    madvise(mapping, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  *malformed = 0;
+  for (size_t offset = 0; offset < size; ) {
+    const char* line = zone + offset;
+    const char* end = static_cast<const char*>(
+      memchr(line, '\n', size - offset));
+    if (end == NULL)
+      end = zone + size;
+    offset = end - zone + 1;
+
+    const char* comment = static_cast<const char*>(
+      memchr(line, ZONE_COMMENT, end - line));
+    if (comment != NULL)
+      end = comment;
+
+    // Each line is a name and an address, and perhaps nothing at all
+    const char* fields[2];
+    int lengths[2], count = 0;
+    for (const char* c = line; c < end; ) {
+      if (isspace(static_cast<unsigned char>(*c))) {
+        c++;
+        continue;
+      }
+
+      const char* field = c;
+      while (c < end && !isspace(static_cast<unsigned char>(*c)))
+        c++;
+      if (count < 2) {
+        fields[count] = field;
+        lengths[count] = c - field;
+      }
+      count++;
+    }
+
+    int address;
+    if (count == 0)
+      continue;
+    if (count != 2 || !ParseAddress(fields[1], lengths[1], &address)) {
+      (*malformed)++;
+      continue;
+    }
+
+    entries->push_back(pair<LogicalAddress, int>(
+      LogicalAddress(fields[0], lengths[0]), address));
+  }
+
+  if (zone != NULL)
+    munmap(const_cast<char*>(zone), size);
+  return true;
+}
+
+bool SimpleDNS::ParseAddress(const char* text, int length, int* address) {
+  unsigned int parsed = 0;
+  int octets = 0, digits = 0, octet = 0;
+  for (int i = 0; i <= length; i++) {
+    if (i < length && text[i] >= '0' && text[i] <= '9') {
+      octet = 10 * octet + (text[i] - '0');
+      if (++digits > 3 || octet > 255)
+        return false;
+      continue;
+    }
+
+    // Every octet but the last ends in a dot (and none may be empty)
+    if (digits == 0 || octets == 4 || (i < length && text[i] != '.'))
+      return false;
+    parsed |= octet << (8 * octets);
+    octets++;
+    digits = octet = 0;
+  }
+
+  *address = parsed;
+  return octets == 4;
+}
+
+bool SimpleDNS::HandleAdminRequests(DNSWorker* worker) {
+  DatagramBatch& batch = worker->batch_;
+
+  for (;;) {
+#ifdef UDP_APPLICATION
+    int received = batch.Receive(worker->admin_listener_);
+#elif TCP_APPLICATION
+    int received = -1;
+    ShutDown("TCP is not yet supported in the DNS");
+#endif
+
+    if (received < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+      return true;
+    else if (received < 0 && errno == EINTR)
+      continue;
+    else if (received < 0)
+      return ShutDown("Error listening on admin socket");
+
+    for (int i = 0; i < received; i++) {
+      struct sockaddr_in* request_src = batch.Source(i);
+      bool accepted = AnswerAdminRequest(batch.Data(i), batch.Length(i));
+      Log(stderr, (accepted ? SUCCESS : WARNING),
+          "%s admin request from (%d:%d)", (accepted ? "Accepted" : "Rejected"),
+          request_src->sin_addr.s_addr, ntohs(request_src->sin_port));
+      batch.QueueReply(i, (accepted ? ADMIN_ACCEPTED : ADMIN_REJECTED));
+    }
+
+#ifdef UDP_APPLICATION
+    batch.Flush(worker->admin_listener_);
+#endif
+  }
+}
+
+bool SimpleDNS::AnswerAdminRequest(const char* request, int length) {
+  // Only the signature and sequence number are trusted before the MAC is
+  // checked, and both are found from the end
+  const char* end = request + length;
+  while (end > request && *(end - 1) == '\0')
+    end--;
+
+  const char* fields[5];
+  int lengths[5], count = 0;
+  for (const char* field = request; ; field++) {
+    if (count == 5)
+      return false;
+
+    const char* separator = static_cast<const char*>(
+      memchr(field, ADMIN_SEPARATOR, end - field));
+    fields[count] = field;
+    lengths[count++] = (separator == NULL ? end : separator) - field;
+    if (separator == NULL)
+      break;
+    field = separator;
+  }
+  if (count < 4)
+    return false;
+
+  const char* mac = fields[count - 1];
+  int signed_length = mac - 1 - request;
+  if (!SipHash::Matches(SipHash::Hash(admin_key_, request, signed_length),
+                        mac, lengths[count - 1]))
+    return false;
+
+  // A signed request may still be a replay of an old one
+  uint64_t sequence = 0;
+  const char* sequence_text = fields[count - 2];
+  for (int i = 0; i < lengths[count - 2]; i++) {
+    if (sequence_text[i] < '0' || sequence_text[i] > '9')
+      return false;
+    sequence = 10 * sequence + (sequence_text[i] - '0');
+  }
+  if (sequence <= admin_sequence_)
+    return false;
+
+  // Nothing is logged (and so no sequence number used up) for a request we
+  // would turn down anyway
+  string operation(fields[0], lengths[0]);
+  LogicalAddress name(fields[1], lengths[1]);
+  AdminChange change;
+  int address = 0;
+  if (operation == ADMIN_ADD && count == 5 &&
+      ParseAddress(fields[2], lengths[2], &address) && lengths[1] > 0)
+    change = ADMIN_CHANGE_ADD;
+  else if (operation == ADMIN_REMOVE && count == 4)
+    change = ADMIN_CHANGE_REMOVE;
+  else
+    return false;
+
+  // The change is durable (along with its sequence number) before it is
+  // made, so a crash neither loses it nor lets the request be replayed
+  if (!LogAdminChange(&admin_log_, change, sequence, name, address))
+    return false;
+
+  if (change == ADMIN_CHANGE_ADD)
+    SetName(name, address);
+  else
+    RemoveName(name);
+  admin_sequence_ = sequence;
+  return true;
+}
+
+bool SimpleDNS::OpenAdminLog() {
+  if (snapshot_path_.empty()) {
+    Log(stderr, WARNING, "Without a snapshot, admin requests may be replayed "
+        "once the DNS restarts");
+    return true;
+  }
+
+  // Changes logged since the snapshot was written go back on top of it (and
+  // a new log has no sequence number in it to go past)
+  string path = snapshot_path_ + ADMIN_LOG_SUFFIX;
+  int records = RecordLog::Replay(path, this);
+  if (records > 0)
+    Log(stderr, SUCCESS, "Replayed %d admin changes from %s", records,
+        path.c_str());
+  return admin_log_.Open(path);
+}
+
+bool SimpleDNS::LogAdminChange(RecordLog* log, AdminChange change,
+                               uint64_t sequence, const LogicalAddress& name,
+                               int address) {
+  if (!log->IsOpen())
+    return true;
+
+  string record;
+  record.reserve(12 + name.length());
+  record.append(reinterpret_cast<char*>(&sequence), 8);
+  record.append(reinterpret_cast<char*>(&address), 4);
+  record.append(name);
+  log->Append(change, record.data(), record.length());
+  return log->Commit();
+}
+
+bool SimpleDNS::CompactAdminLog() {
+  if (snapshot_path_.empty())
+    return true;
+
+  // The new log is moved into place whole, so a crash leaves one or the other
+  string path = snapshot_path_ + ADMIN_LOG_SUFFIX;
+  string temporary = path + ".tmp";
+  RecordLog compacted;
+  if (!compacted.Open(temporary, true) ||
+      !LogAdminChange(&compacted, ADMIN_CHANGE_SEQUENCE, admin_sequence_, "",
+                      0)) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  compacted.Close();
+  return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void SimpleDNS::HandleRecord(uint8_t type, const char* data, int length) {
+  if (length < 12)
+    return;
+
+  uint64_t sequence;
+  int address;
+  memcpy(&sequence, data, 8);
+  memcpy(&address, data + 8, 4);
+  LogicalAddress name(data + 12, length - 12);
+  if (type == ADMIN_CHANGE_ADD)
+    SetName(name, address);
+  else if (type == ADMIN_CHANGE_REMOVE)
+    RemoveName(name);
+
+  if (sequence > admin_sequence_)
+    admin_sequence_ = sequence;
+}
+
+string SimpleDNS::SignAdminRequest(const string& key, const string& change,
+                                   uint64_t sequence) {
+  uint64_t parsed[2];
+  if (!SipHash::ParseKey(key, parsed))
+    return "";
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "%c%llu", ADMIN_SEPARATOR,
+           static_cast<unsigned long long>(sequence));
+  string request = change + suffix;
+  return request + ADMIN_SEPARATOR +
+         SipHash::ToHex(SipHash::Hash(parsed, request.data(),
+                                      request.length()));
 }
@@ -13,72 +13,464 @@
 
 #include <gtest/gtest.h>
 #include <tr1/unordered_map>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <cassert>
+#include <cctype>
 #include <cstdarg>
+#include <algorithm>
+#include <vector>
 
+#include "Common/DatagramBatch.h"
+#include "Common/EventLoop.h"
+#include "Common/MappedTable.h"
+#include "Common/PerfectTable.h"
+#include "Common/RcuTable.h"
+#include "Common/RecordLog.h"
+#include "Common/SipHash.h"
 #include "Common/Utils.h"
 #include "Common/Signal.h"
+#include "Common/WireProtocol.h"
 #include "DNS/DNS.h"
 
 using Utils::Die;
 using Utils::Log;
+using Utils::IntToIPString;
+using Utils::IPStringToInt;
+using Utils::GetTime;
 
 using std::tr1::unordered_map;
+using std::pair;
+using std::vector;
 
-class SimpleDNS : public DNS {
+/**
+ * By default the DNS runs a single worker on the thread that calls Start()
+ **/
+#define GLOB_DNS_WORKERS 1
+
+/**
+ * Given a snapshot file (by default, @ref GLOB_DNS_SNAPSHOT, there is none)
+ * the DNS maps it and answers from it the moment it starts, only bringing a
+ * name into its own table when the name is changed, and writes every name
+ * back to it when it shuts down
+ **/
+#define GLOB_DNS_SNAPSHOT ""
+
+/**
+ * Given a zone file (by default, @ref GLOB_DNS_ZONE, there is none) the DNS
+ * loads every name in it when it starts.  Each line of a zone file holds a
+ * logical address and the IP address of its RS, separated by whitespace;
+ * blank lines and anything after a '#' are ignored.
+ *
+ * A zone that only changes on redeploy can instead be compiled ahead of time
+ * (see SimpleDNS::CompileZone()) into a PerfectTable, which the DNS maps and
+ * serves from in place rather than loading name by name.
+ **/
+#define GLOB_DNS_ZONE ""
+#define ZONE_COMMENT '#'
+
+/**
+ * Given an admin key (@ref SIPHASH_KEY_SIZE bytes in hex; by default,
+ * @ref GLOB_DNS_ADMIN_KEY, there is none and the admin port stays closed)
+ * the DNS takes changes to its names on the @ref GLOB_DNS_ADMIN_PORT.  Each
+ * request is a datagram of '|'-separated fields:
+ *
+ *    ADD|<logical address>|<IP address>|<sequence>|<MAC>
+ *    REMOVE|<logical address>|<sequence>|<MAC>
+ *
+ * where the MAC is the SipHash of everything before its '|', keyed with the
+ * admin key and written in hex.  Every request must carry a higher sequence
+ * number than the last one accepted (the time in microseconds will do) so
+ * that none can be replayed.  Each is answered with @ref ADMIN_ACCEPTED or
+ * @ref ADMIN_REJECTED.  Given a snapshot, every change is logged durably
+ * next to it (with @ref ADMIN_LOG_SUFFIX), along with its sequence number,
+ * before it is accepted, so that no accepted change is lost in a crash and
+ * no request can be replayed after a restart either.  Once the snapshot has
+ * been written the log is cut back to the last sequence number alone.
+ **/
+#define GLOB_DNS_ADMIN_KEY ""
+#define ADMIN_ADD "ADD"
+#define ADMIN_REMOVE "REMOVE"
+#define ADMIN_SEPARATOR '|'
+#define ADMIN_ACCEPTED "OK"
+#define ADMIN_REJECTED "REJECTED"
+#define ADMIN_LOG_SUFFIX ".admin"
+
+/**
+ * @enum AdminChange
+ *
+ * The kinds of record in the admin log, each laid out as the sequence number
+ * (8 bytes), the address (4 bytes) and the name
+ **/
+enum AdminChange {
+  ADMIN_CHANGE_SEQUENCE = 1,  // the last sequence number accepted (no name)
+  ADMIN_CHANGE_ADD = 2,       // name: added (or moved), address: its RS
+  ADMIN_CHANGE_REMOVE = 3,    // name: removed
+};
+
+class SimpleDNS;
+
+/**
+ * Each worker of the DNS owns its own SO_REUSEPORT listener, event loop and
+ * datagram batch, so that workers share nothing but the (lock-free) names.
+ **/
+class DNSWorker : public EventHandler {
+ public:
+  /**
+   * The constructor simply records which DNS we work for
+   *
+   * @param     dns             The DNS whose names this worker serves
+   * @param     batch_size      The most lookups to read per system call
+   **/
+  DNSWorker(SimpleDNS* dns, int batch_size) :
+    dns_(dns), batch_(batch_size), listener_(-1), admin_listener_(-1) {}
+
+  virtual ~DNSWorker() {}
+
+  /**
+   * The event loop calls back HandleEvent() whenever the listener (or the
+   * admin listener) is readable, and we dispatch to the DNS
+   **/
+  virtual bool HandleEvent(int fd);
+
+  /**
+   * Run() sleeps on the worker's event loop until it is stopped
+   *
+   * @returns   True always
+   **/
+  bool Run();
+
+ private:
+  /**
+   * The DNS that owns this worker...
+   **/
+  SimpleDNS* dns_;
+
+  /**
+   * ...the reactor this worker sleeps on...
+   **/
+  EventLoop event_loop_;
+
+  /**
+   * ...the batch of datagrams this worker reads into...
+   **/
+  DatagramBatch batch_;
+
+  /**
+   * ...its own socket bound (with SO_REUSEPORT) to the lookup port, and the
+   * admin socket (only the first worker has one, and only given a key)
+   **/
+  int listener_;
+  int admin_listener_;
+
+  /**
+   * The thread running this worker (unused for the first worker, which runs
+   * on the thread that called Start())
+   **/
+  pthread_t thread_;
+
+  friend class SimpleDNS;
+};
+
+class SimpleDNS : public DNS, public RecordHandler {
  public:
   /**
    * The constructor simply needs a port to listen for lookups
+   *
+   * @param     batch_size      The most lookups to read per system call
+   *                            (Default: @ref GLOB_BATCH_SIZE)
+   * @param     workers         The number of worker threads to serve the
+   *                            port with (Default: @ref GLOB_DNS_WORKERS)
+   * @param     snapshot        The file to keep the names in between runs
+   *                            (Default: @ref GLOB_DNS_SNAPSHOT)
+   * @param     zone            The zone file to load names from at startup
+   *                            (Default: @ref GLOB_DNS_ZONE)
+   * @param     admin_key       The key admin requests are authenticated with
+   *                            (Default: @ref GLOB_DNS_ADMIN_KEY)
    **/
-  explicit SimpleDNS() : port_(GLOB_LOOKUP_PORT),
-    domain_(GLOB_DOM), transport_layer_(GLOB_TL), protocol_(GLOB_PROTO) {}
+  explicit SimpleDNS(int batch_size = GLOB_BATCH_SIZE,
+                     int workers = GLOB_DNS_WORKERS,
+                     const string& snapshot = GLOB_DNS_SNAPSHOT,
+                     const string& zone = GLOB_DNS_ZONE,
+                     const string& admin_key = GLOB_DNS_ADMIN_KEY);
 
   /**
-   * The SimpleDNS destructor does not have to free any memory as none was
-   * aggregated
+   * The SimpleDNS destructor frees its workers
    **/
-  virtual ~SimpleDNS() {}
+  virtual ~SimpleDNS();
 
   virtual bool Start();
   virtual bool ShutDown(const char* format, ...);
 
+  /**
+   * SignAdminRequest() turns a change into an admin request the DNS will
+   * accept
+   *
+   * @param     key             The admin key (in hex)
+   * @param     change          The change, without its sequence and MAC
+   *                            (e.g. "ADD|tick.cs.yale.edu|128.36.232.50")
+   * @param     sequence        A sequence number higher than any sent before
+   *
+   * @returns   The request to send to the admin port
+   **/
+  static string SignAdminRequest(const string& key, const string& change,
+                                 uint64_t sequence);
+
+  /**
+   * CompileZone() compiles a zone file into a (perfectly hashed) table that
+   * can be given to the DNS in its place
+   *
+   * @param     zone            The zone file to compile
+   * @param     compiled        Where to write the compiled zone
+   *
+   * @returns   False if the zone could not be read or compiled
+   **/
+  static bool CompileZone(const string& zone, const string& compiled);
+
  protected:
   virtual bool AddName(LogicalAddress name, PhysicalAddress address);
+  virtual bool RemoveName(LogicalAddress name);
   virtual PhysicalAddress LookupName(LogicalAddress name);
 
+  /**
+   * SetName() is AddName() for a binary address
+   *
+   * @param     name            The logical address being added
+   * @param     address         The binary IP address of its RS
+   **/
+  void SetName(const LogicalAddress& name, int address);
+
+  /**
+   * LoadZone() adds every name in a zone file
+   *
+   * @param     path            The zone file to load
+   *
+   * @returns   False if the zone file could not be read
+   **/
+  bool LoadZone(const string& path);
+
+  /**
+   * ReadZone() reads every name in a zone file straight out of a mapping of
+   * the file (nothing is allocated per line but the names kept)
+   *
+   * @param     path            The zone file to read
+   * @param     entries         Where to append every name and its address
+   * @param     malformed       Set to the number of lines skipped
+   *
+   * @returns   False if the zone file could not be read
+   **/
+  static bool ReadZone(const string& path,
+                       vector< pair<LogicalAddress, int> >* entries,
+                       int* malformed);
+
+  /**
+   * ParseAddress() reads a dotted IPv4 address without making a string of it
+   *
+   * @param     text            The (unterminated) address to read
+   * @param     length          The number of characters in text
+   * @param     address         Set to the binary IP address read
+   *
+   * @returns   False if text is not a dotted IPv4 address
+   **/
+  static bool ParseAddress(const char* text, int length, int* address);
+
   /**
    * We specifically want to respond to connections given to us on the specified
    * port.  For this, we first need to listen.
+   *
+   * @param     port            The port to listen on
+   * @param     listener        Set to the listening socket
+   *
+   * @returns   False (having called ShutDown()) if we could not listen
+   **/
+  bool BeginListening(unsigned short port, int* listener);
+  /**
+   * After the socket has begun listening on that port, we handle requests
+   * (a batch at a time) until the listener is drained.
+   *
+   * @param     worker          The worker (and thus listener and batch)
+   *                            doing the reading
+   **/
+  bool HandleRequests(DNSWorker* worker);
+
+  /**
+   * A datagram in the binary protocol may pack many lookups, which are all
+   * answered (in order) by a single reply written over the datagram itself
+   *
+   * @param     datagram        The datagram received (and the reply sent)
+   * @param     length          The number of bytes received
+   *
+   * @returns   The number of bytes of the reply
+   **/
+  int AnswerWireRequests(char* datagram, int length);
+
+  /**
+   * ResolveName() is LookupName() for the binary protocol, which needs
+   * neither a new string per name nor a dotted IP string per answer (and,
+   * like every lookup, takes no lock and never waits for a writer)
+   *
+   * @param     name            The (unterminated) logical address to find
+   * @param     name_length     The number of bytes in name
+   *
+   * @returns   The binary IP address of the responsible RS, or 0 if none
+   **/
+  int ResolveName(const char* name, int name_length);
+
+  /**
+   * HandleAdminRequests() authenticates and applies every pending admin
+   * request, answering each
+   *
+   * @param     worker          The (first) worker, which has the admin port
    **/
-  bool BeginListening();
+  bool HandleAdminRequests(DNSWorker* worker);
+
+  /**
+   * AnswerAdminRequest() authenticates and applies a single admin request
+   *
+   * @param     request         The (NUL-terminated) request
+   * @param     length          The number of bytes in the request
+   *
+   * @returns   True if the request was accepted
+   **/
+  bool AnswerAdminRequest(const char* request, int length);
+
+  /**
+   * OpenAdminLog() replays the log of admin changes (if we have a snapshot
+   * to keep it next to), picking up where the last run left off, and opens
+   * it to log every change from here on
+   *
+   * @returns   False if the log could not be opened
+   **/
+  bool OpenAdminLog();
+
   /**
-   * After the socket has begun listening on that port, we handle requests.
+   * LogAdminChange() appends an admin change to a log and commits it
+   * (doing nothing if the log is not open)
+   *
+   * @param     log             The log to append the change to
+   * @param     change          The kind of change
+   * @param     sequence        The sequence number of the request
+   * @param     name            The name changed ("" for none)
+   * @param     address         The name's new address (0 for none)
+   *
+   * @returns   False if the change could not be logged
    **/
-  bool HandleRequests();
+  bool LogAdminChange(RecordLog* log, AdminChange change, uint64_t sequence,
+                      const LogicalAddress& name, int address);
+
+  /**
+   * CompactAdminLog() replaces the log with one holding only the last
+   * sequence number, once every change in it is in the snapshot
+   *
+   * @returns   False if the log could not be replaced
+   **/
+  bool CompactAdminLog();
+
+  /**
+   * While replaying the admin log, HandleRecord() applies every change read
+   * back from it
+   **/
+  virtual void HandleRecord(uint8_t type, const char* data, int length);
+
+  /**
+   * SnapshotAddress() looks up a name that is not in our own table in the
+   * snapshot we started from
+   *
+   * @param     name            The (unterminated) logical address to find
+   * @param     name_length     The number of bytes in name
+   *
+   * @returns   The binary IP address of the responsible RS, or 0 if none
+   **/
+  int SnapshotAddress(const char* name, int name_length) const;
+
+  /**
+   * OpenSnapshot() maps the snapshot (if we keep one) so that lookups can
+   * be answered from it straight away
+   *
+   * @returns   False if there is no snapshot to start from
+   **/
+  bool OpenSnapshot();
+
+  /**
+   * Snapshot() writes every name (ours and those we have only ever served
+   * from the snapshot) to a new snapshot, which replaces the old one whole
+   *
+   * @returns   False if the snapshot could not be written
+   **/
+  bool Snapshot();
 
  private:
   /**
-   * Privately, we keep a key-value store of logical addresses to physical
-   * addresses that correspond to the rendezvous server that maintains that
-   * logical address or the node itself.
+   * Privately, we keep a key-value store of logical addresses to (binary)
+   * physical addresses that correspond to the rendezvous server that
+   * maintains that logical address or the node itself.  Every worker reads
+   * it without locks while the admin port and zone loading write to it.
    **/
-  unordered_map<LogicalAddress, PhysicalAddress> registered_names_;
+  RcuTable names_;
 
   /** We maintain which port we are listening for incoming lookups on **/
   unsigned short port_;
-  int listener_;
 
   /** Keep connectivity member variables **/
   Domain domain_;
   TransportLayer transport_layer_;
   Protocol protocol_;
 
+  /**
+   * The workers that serve the lookup (and admin) ports
+   **/
+  vector<DNSWorker*> workers_;
+
+  /**
+   * Where we keep our names between runs ("" if nowhere) and the snapshot we
+   * started from, which only answers for names our own table has never held
+   * (once changed, or removed, a name stays in our table for good)
+   **/
+  string snapshot_path_;
+  MappedTable snapshot_;
+
+  /**
+   * The zone file we load at startup ("" if none) and, if it was compiled,
+   * the table we serve it from (which, like the snapshot, only answers for
+   * names our own table has never held)
+   **/
+  string zone_path_;
+  PerfectTable zone_table_;
+
+  /**
+   * The key admin requests must be signed with (in hex, and as the key
+   * itself), the sequence number of the last admin request accepted, and the
+   * log of changes it is kept in across runs (not open if there is no
+   * snapshot to keep it next to)
+   **/
+  string admin_key_text_;
+  uint64_t admin_key_[2];
+  uint64_t admin_sequence_;
+  RecordLog admin_log_;
+
   // Declare friend tests for access to private methods
   friend class SimpleDNSTest;
+  friend class SimpleDNSReader;
+  friend class DNSWorker;
   FRIEND_TEST(SimpleDNSTest, AddsAndLooksUp);
+  FRIEND_TEST(SimpleDNSSnapshotTest, ServesFromSnapshot);
+  FRIEND_TEST(SimpleDNSSnapshotTest, RefusesAdminReplaysAfterRestart);
+  FRIEND_TEST(SimpleDNSSnapshotTest, KeepsAcceptedAdminChangesThroughCrashes);
+  FRIEND_TEST(SimpleDNSZoneTest, LoadsZoneAndTakesAdminChanges);
+  FRIEND_TEST(SimpleDNSZoneTest, ServesCompiledZone);
+  FRIEND_TEST(SimpleDNSWorkersTest, AnswersWhileNamesChange);
+  FRIEND_TEST(SimpleDNSFilterTest, FiltersEveryTier);
 };
 
+/** Separate non-class method required by pthread **/
+static inline void* RunDNSWorkerThread(void* worker) {
+  (reinterpret_cast<DNSWorker*>(worker))->Run();
+  return NULL;
+}
+
 #endif  // _PERMANENTIP_DNS_SIMPLEDNS_H_
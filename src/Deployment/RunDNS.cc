@@ -16,18 +16,36 @@ using Utils::Die;
 
 #define MIN_ARGUMENTS 2
 #define SRS_NUM_ARGUMENTS 2
+#define SRS_MAX_ARGUMENTS 7
+#define COMPILE_NUM_ARGUMENTS 4
 
 int main(int argc, char* argv[]) {
   if (argc < MIN_ARGUMENTS)
     Die("Must specify an DNS to use");
 
   if (!strcmp(argv[1], "SDNS")) {
-    if (argc != SRS_NUM_ARGUMENTS)
-      Die("Usage: ./RunDNS SDNS");
+    if (argc < SRS_NUM_ARGUMENTS || argc > SRS_MAX_ARGUMENTS)
+      Die("Usage: ./RunDNS SDNS [Batch Size] [Workers] [Snapshot File] "
+          "[Zone File] [Admin Key]");
 
-    DNS* dns = new SimpleDNS();
+    int batch_size = (argc > 2 ? atoi(argv[2]) : GLOB_BATCH_SIZE);
+    int workers = (argc > 3 ? atoi(argv[3]) : GLOB_DNS_WORKERS);
+    string snapshot = (argc > 4 ? argv[4] : GLOB_DNS_SNAPSHOT);
+    string zone = (argc > 5 ? argv[5] : GLOB_DNS_ZONE);
+    string admin_key = (argc > 6 ? argv[6] : GLOB_DNS_ADMIN_KEY);
+
+    DNS* dns = new SimpleDNS(batch_size, workers, snapshot, zone, admin_key);
     return dns->Start();
   }
 
+  // Zones that only change on redeploy can be compiled ahead of time
+  if (!strcmp(argv[1], "COMPILE")) {
+    if (argc != COMPILE_NUM_ARGUMENTS)
+      Die("Usage: ./RunDNS COMPILE [Zone File] [Compiled Zone File]");
+    if (!SimpleDNS::CompileZone(argv[2], argv[3]))
+      Die("Could not compile the zone file %s", argv[2]);
+    return EXIT_SUCCESS;
+  }
+
   exit(EXIT_FAILURE);
 }
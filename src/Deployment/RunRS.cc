@@ -16,17 +16,24 @@ using Utils::Die;
 
 #define MIN_ARGUMENTS 2
 #define SRS_NUM_ARGUMENTS 2
+#define SRS_MAX_ARGUMENTS 6
 
 int main(int argc, char* argv[]) {
   if (argc < MIN_ARGUMENTS)
     Die("Must specify an RS to use");
 
   if (!strcmp(argv[1], "SRS")) {
-    if (argc != SRS_NUM_ARGUMENTS)
-      Die("Usage: ./RunRS SRS");
+    if (argc < SRS_NUM_ARGUMENTS || argc > SRS_MAX_ARGUMENTS)
+      Die("Usage: ./RunRS SRS [Batch Size] [Workers] [Coalescing ms] "
+          "[State Directory]");
+
+    int batch_size = (argc > 2 ? atoi(argv[2]) : GLOB_BATCH_SIZE);
+    int workers = (argc > 3 ? atoi(argv[3]) : GLOB_RS_WORKERS);
+    int coalesce_ms = (argc > 4 ? atoi(argv[4]) : GLOB_COALESCE_MS);
+    string state_dir = (argc > 5 ? argv[5] : GLOB_RS_STATE_DIR);
 
     RendezvousServer* rendezvous_server =
-      new SimpleRendezvousServer();
+      new SimpleRendezvousServer(batch_size, workers, coalesce_ms, state_dir);
     return rendezvous_server->Start();
   }
 
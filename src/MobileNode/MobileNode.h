@@ -53,23 +53,30 @@ class MobileNode {
    * @returns A pointer to a generic sockaddr struct that can be reinterpreted
    *          by the application to send messages to the peer. The mobile
    *          node retains this pointer so that it can transparently
-   *          update the peer's location
+   *          update the peer's location (registering the socket again, even
+   *          to another peer, hands back the same pointer)
    **/
   virtual struct sockaddr* RegisterPeer(int app_socket,
                                         LogicalAddress peer_addr) = 0;
   /**
    * Any application needs to notify the mobile node client when a message is
-   * sent so that it can pack it into a buffer and resend if necessary.
+   * about to be sent so that it can pack it into a buffer and resend if
+   * necessary.
    *
    * @param   app_socket    The app socket on which to send the message
    * @param   message       The message being sent
+   *
+   * @returns False if too much is outstanding to the peer already, in which
+   *          case the message must not be sent until some are acknowledged
    **/
-  virtual void MessageSent(int app_socket, NetworkMsg message) = 0;
+  virtual bool MessageSent(int app_socket, NetworkMsg message) = 0;
 
   /**
    * Any application needs to notify the mobile node client when a message is
    * received so that it can free it from the buffer pool and not resend in
-   * the case of failure.
+   * the case of failure.  Only the matching message is freed, since a
+   * payload says nothing about what was sent before it (applications that
+   * can say more should acknowledge by sequence number instead).
    *
    * @param   app_socket    The app socket on which to send the message
    * @param   message       The message for which ACK was received
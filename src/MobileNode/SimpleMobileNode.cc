@@ -11,17 +11,67 @@
 #include "MobileNode/SimpleMobileNode.h"
 
 bool SimpleMobileNode::Start() {
-  ConnectToServer(rendezvous_server_, rendezvous_port_, logical_address_);
+  // The application owns the signal handlers, but we may have been restarted
+  Signal::RestartProgram();
+
+  if (!event_loop_.Watch(client_socket_, this) ||
+      !event_loop_.Watch(control_socket_, this))
+    return ShutDown("Could not watch the client and control sockets");
+
+  SendRequest(rendezvous_server_, rendezvous_port_, WIRE_REGISTER,
+              logical_address_, "", -1, false);
+
+  if (WatchAddressChanges() && !event_loop_.Watch(netlink_socket_, this)) {
+    close(netlink_socket_);
+    netlink_socket_ = -1;
+  }
+  if (netlink_socket_ < 0)
+    Log(stderr, WARNING, "No netlink, checking for address changes by polling");
+  uint64_t next_address_check = GetTime() + MAX_ADDRESS_CHECK_MS;
+  uint64_t next_lease_renewal = GetTime() + LEASE_RENEWAL_S * 1000;
 
   do {
-    sleep(1);
-    if (last_known_ip_address_ != GetCurrentIPAddress())
-      UpdateRendezvousServer();
+    // Sleep until the RS pushes an update, an address changes or a request
+    // needs to be resent
+    address_changed_ = false;
+    if (!event_loop_.RunOnce(RequestTimeout(GLOB_WAKEUP_INTERVAL_MS)))
+      break;
+    ServiceRequests(0);
+
+    pthread_mutex_lock(&requests_lock_);
+    ReplayMessages(GetTime());
+    pthread_mutex_unlock(&requests_lock_);
+
+    // Only walk the interfaces when we have reason to believe they changed
+    uint64_t now = GetTime();
+    if (address_changed_ || netlink_socket_ < 0 || now >= next_address_check) {
+      next_address_check = now + MAX_ADDRESS_CHECK_MS;
+
+      int current_ip_address = GetCurrentIPAddress();
+      if (last_known_ip_address_ != current_ip_address) {
+        last_known_ip_address_ = current_ip_address;
+        UpdateRendezvousServer();
+      }
+
+      // Sweep for updates in case one slipped past the event loop
+      PollSubscriptions();
+    }
 
-    PollSubscriptions();
-    last_known_ip_address_ = GetCurrentIPAddress();
+    // The RSs forget us (and our subscriptions) unless we renew our leases,
+    // which is safe to do blindly since subscribing again only renews
+    if (now >= next_lease_renewal) {
+      next_lease_renewal = now + LEASE_RENEWAL_S * 1000;
+      SendRequest(rendezvous_server_, rendezvous_port_, WIRE_REGISTER,
+                  logical_address_, "", -1, false);
+      RenewSubscriptions();
+    }
   } while (Signal::ShouldContinue());
 
+  if (netlink_socket_ >= 0) {
+    event_loop_.Unwatch(netlink_socket_);
+    close(netlink_socket_);
+  }
+  netlink_socket_ = -1;
   return true;
 }
 
@@ -33,6 +83,8 @@ bool SimpleMobileNode::ShutDown(const char* format, ...) {
   Log(stderr, WARNING, format, arguments);
   perror(")");
 
+  // The event loop is torn down by Start() once it has woken up
+  event_loop_.Stop();
   Signal::ExitProgram(0);
 
   Log(stderr, SUCCESS, "OK");
@@ -41,146 +93,604 @@ bool SimpleMobileNode::ShutDown(const char* format, ...) {
 
 void SimpleMobileNode::UpdateRendezvousServer() {
   Log(stderr, WARNING, "Location has changed, sending an update to the RS... ");
-  ConnectToServer(rendezvous_server_, rendezvous_port_, logical_address_);
+  SendRequest(rendezvous_server_, rendezvous_port_, WIRE_REGISTER,
+              logical_address_, "", -1, false);
   Log(stderr, SUCCESS, "OK");
 }
 
+bool SimpleMobileNode::WatchAddressChanges() {
+  netlink_socket_ = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK,
+                           NETLINK_ROUTE);
+  if (netlink_socket_ < 0)
+    return false;
+
+  struct sockaddr_nl groups;
+  memset(&groups, 0, sizeof(groups));
+  groups.nl_family = AF_NETLINK;
+  groups.nl_groups = RTMGRP_IPV4_IFADDR;
+  if (bind(netlink_socket_, reinterpret_cast<struct sockaddr*>(&groups),
+           sizeof(groups))) {
+    close(netlink_socket_);
+    netlink_socket_ = -1;
+    return false;
+  }
+
+  return true;
+}
+
+bool SimpleMobileNode::AddressChanged() {
+  if (netlink_socket_ < 0)
+    return false;
+
+  bool changed = false;
+  for (;;) {
+    struct nlmsghdr buffer[MAX_DATAGRAM_SIZE / sizeof(struct nlmsghdr)];
+    int bytes_read = recv(netlink_socket_, buffer, sizeof(buffer),
+                          MSG_DONTWAIT);
+
+    // If the kernel had to drop notifications, assume the worst
+    if (bytes_read < 0 && errno == ENOBUFS) {
+      changed = true;
+      continue;
+    } else if (bytes_read <= 0) {
+      break;
+    }
+
+    unsigned int remaining = bytes_read;
+    for (struct nlmsghdr* message = buffer; NLMSG_OK(message, remaining);
+         message = NLMSG_NEXT(message, remaining))
+      if (message->nlmsg_type == RTM_NEWADDR ||
+          message->nlmsg_type == RTM_DELADDR)
+        changed = true;
+  }
+
+  if (changed)
+    Log(stderr, WARNING, "Netlink reports that an interface address changed");
+  return changed;
+}
+
+bool SimpleMobileNode::HandleEvent(int fd) {
+  if (fd == netlink_socket_) {
+    address_changed_ |= AddressChanged();
+  } else {
+    pthread_mutex_lock(&requests_lock_);
+    ReadDatagrams(fd);
+    pthread_mutex_unlock(&requests_lock_);
+  }
+
+  return true;
+}
+
 void SimpleMobileNode::PollSubscriptions() {
-  // Listen on server addr
-  struct sockaddr_in server;
-  memset(&server, 0, sizeof(server));
-
-  // Make sure none of the subscriptions have changed
-  unordered_map<int, struct sockaddr*>::iterator it;
-  for (it = app_sockets_.begin(); it != app_sockets_.end(); it++) {
-    struct sockaddr_in* peer =
-      reinterpret_cast<struct sockaddr_in*>(it->second);
-    socklen_t server_size;
-
-    char buffer[4096];
-    memset(buffer, 0, sizeof(buffer));
+  // Every subscription pushes its updates to the control socket
+  pthread_mutex_lock(&requests_lock_);
+  ReadDatagrams(control_socket_);
+  pthread_mutex_unlock(&requests_lock_);
+}
+
+void SimpleMobileNode::RenewSubscriptions() {
+  vector<pair<LogicalAddress, int> > subscriptions;
+  pthread_mutex_lock(&requests_lock_);
+  unordered_map<LogicalAddress, PeerSubscription>::iterator it;
+  for (it = peer_subscriptions_.begin(); it != peer_subscriptions_.end(); it++)
+    subscriptions.push_back(pair<LogicalAddress, int>(it->first,
+                                                      it->second.server));
+  pthread_mutex_unlock(&requests_lock_);
+
+  for (unsigned int i = 0; i < subscriptions.size(); i++)
+    SendRequest(IntToIPString(subscriptions[i].second), GLOB_LOOKUP_PORT,
+                WIRE_SUBSCRIBE, logical_address_, subscriptions[i].first,
+                control_socket_, false);
+}
+
+void SimpleMobileNode::ReadDatagrams(int receiver) {
+  for (;;) {
+    char buffer[MAX_DATAGRAM_SIZE];
+    struct sockaddr_in source;
+    socklen_t source_size = sizeof(source);
 #ifdef UDP_APPLICATION
-    int bytes_read = recvfrom(it->first, buffer, sizeof(buffer), MSG_PEEK,
-                              reinterpret_cast<struct sockaddr*>(&server),
-                              &server_size);
+    int bytes_read = recvfrom(receiver, buffer, sizeof(buffer), MSG_DONTWAIT,
+                              reinterpret_cast<struct sockaddr*>(&source),
+                              &source_size);
 #elif TCP_APPLICATION
     int bytes_read = -1;
-    ShutDown("TCP is not yet supported");
-    return;
 #endif
+    if (bytes_read < 0 && errno != EWOULDBLOCK && errno != EAGAIN &&
+        errno != EINTR)
+      Log(stderr, ERROR, "Error reading from socket #%d", receiver);
+    if (bytes_read < 0)
+      return;
+
+    // Answers to our lookups arrive on the same socket as updates
+    if (!HandleReply(receiver, buffer, bytes_read, source) &&
+        !ApplyUpdates(buffer, bytes_read, source))
+      Log(stderr, WARNING, "Dropping a datagram that answers no request");
+  }
+}
+
+bool SimpleMobileNode::ApplyUpdates(const char* datagram, int length,
+                                    const struct sockaddr_in& source) {
+  bool moved = false;
+
+#ifdef BINARY_PROTOCOL_APPLICATION
+  WireReader reader(datagram, length);
+  WireMessage update;
+  while (reader.Next(&update))
+    if (update.opcode == WIRE_UPDATE && !(update.flags & WIRE_NOT_FOUND))
+      moved |= MovePeer(LogicalAddress(update.name, update.name_length),
+                        update.address, source.sin_addr.s_addr);
+#elif defined(TEXT_PROTOCOL_APPLICATION)
+  // Text updates name who moved after the location and its terminator
+  int location_length = strnlen(datagram, length);
+  if (location_length < length)
+    moved = MovePeer(LogicalAddress(&datagram[location_length + 1],
+                                    length - location_length - 1),
+                     IPStringToInt(MsgFromDatagram(datagram, length)),
+                     source.sin_addr.s_addr);
+#endif
+
+  return moved;
+}
+
+bool SimpleMobileNode::MovePeer(const LogicalAddress& peer, int address,
+                                int server) {
+  unordered_map<LogicalAddress, PeerSubscription>::iterator subscription =
+    peer_subscriptions_.find(peer);
+  if (subscription == peer_subscriptions_.end() ||
+      subscription->second.server != server)
+    return false;
+
+  subscription->second.address = address;
+  PhysicalAddress location = IntToIPString(address);
+
+  const vector<int>& app_sockets = subscription->second.app_sockets;
+  for (unsigned int i = 0; i < app_sockets.size(); i++) {
+    // Update the peer struct the application sends to
+    struct sockaddr_in* peer_in =
+      reinterpret_cast<struct sockaddr_in*>(app_sockets_[app_sockets[i]]);
+    Log(stderr, WARNING, "Updating socket #%d's struct sockaddr from %d to %s",
+        app_sockets[i], peer_in->sin_addr.s_addr, location.c_str());
+    peer_in->sin_addr.s_addr = address;
+
+    /// Replay only what is still in flight (starting right away)
+    MessageRing& unsent = app_socket_messages_[app_sockets[i]];
+    unsent.Rewind();
+    if (unsent.Replaying()) {
+      Log(stderr, WARNING, "Resending %d messages to %s", unsent.Size(),
+          location.c_str());
+      replays_[app_sockets[i]] = 0;
+    }
+  }
+
+  ReplayMessages(GetTime());
+  return true;
+}
 
-    // Update the sockets with a sockopt and update the peer structs
-    if (bytes_read > 0 && server.sin_addr.s_addr ==
-        static_cast<unsigned int>(IPStringToInt(rendezvous_server_))) {
-      recvfrom(it->first, buffer, sizeof(buffer), 0,
-               reinterpret_cast<struct sockaddr*>(&server), &server_size);
-      Log(stderr, WARNING,
-          "Updating socket #%d's struct sockaddr from %d to %s", it->first,
-          peer->sin_addr.s_addr, buffer);
-      peer->sin_addr.s_addr = IPStringToInt(string(buffer));
-
-      /// Resend all outstanding messages
-      set<NetworkMsg>::iterator msg_it;
-      set<NetworkMsg> unsent = app_socket_messages_[it->first];
-      for (msg_it = unsent.begin(); msg_it != unsent.end(); msg_it++) {
-        Log(stderr, WARNING, "Resending %s to %s", msg_it->c_str(), buffer);
+void SimpleMobileNode::ReplayMessages(uint64_t now) {
+  unordered_map<int, uint64_t>::iterator it = replays_.begin();
+  while (it != replays_.end()) {
+    if (it->second > now) {
+      it++;
+      continue;
+    }
 
+    MessageRing& unsent = app_socket_messages_[it->first];
 #ifdef UDP_APPLICATION
-        socklen_t peer_size = sizeof(*peer);
-        sendto(it->first, msg_it->c_str(), msg_it->length(), 0,
-               reinterpret_cast<struct sockaddr*>(peer), peer_size);
+    unsent.Replay(it->first, app_sockets_[it->first], sizeof(sockaddr_in),
+                  MAX_REPLAY_BURST_BYTES);
 #elif TCP_APPLICATION
-        ShutDown("TCP is not yet supported");
-        return;
+    ShutDown("TCP is not yet supported");
 #endif
-      }
 
-    // Error on the socket
-    } else if (bytes_read < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-      ShutDown("Error listening on socket");
+    // Pace the rest of the replay
+    if (unsent.Replaying()) {
+      it->second = now + REPLAY_PACING_MS;
+      it++;
+    } else {
+      replays_.erase(it++);
     }
   }
 }
 
 struct sockaddr* SimpleMobileNode::RegisterPeer(int app_socket,
                                                 LogicalAddress peer_addr) {
-  // Establish connection to DNS and receive RS to contact
-  PhysicalAddress rs_addr = ConnectToServer(dns_server_, GLOB_LOOKUP_PORT,
-                                            peer_addr);
-  if (rs_addr == "")
-    return NULL;
-  PhysicalAddress peer_loc = ConnectToServer(rs_addr, GLOB_LOOKUP_PORT,
-                                             logical_address_ + "|" + peer_addr,
-                                             app_socket);
-  if (peer_loc == "")
+  return RegisterPeers(vector<pair<int, LogicalAddress> >(
+    1, pair<int, LogicalAddress>(app_socket, peer_addr)))[0];
+}
+
+vector<struct sockaddr*> SimpleMobileNode::RegisterPeers(
+    const vector<pair<int, LogicalAddress> >& peers) {
+  // Peers we already follow need no new subscription (subscribing again
+  // would be harmless, but it would cost a round trip to the RS)
+  vector<LogicalAddress> names;
+  vector<PhysicalAddress> rs_addrs;
+  vector<bool> cached;
+  set<LogicalAddress> named;
+  pthread_mutex_lock(&requests_lock_);
+  for (unsigned int i = 0; i < peers.size(); i++) {
+    if (peer_subscriptions_.count(peers[i].second) > 0 ||
+        !named.insert(peers[i].second).second)
+      continue;
+
+    PhysicalAddress rs_addr;
+    names.push_back(peers[i].second);
+    cached.push_back(CachedServer(peers[i].second, &rs_addr));
+    rs_addrs.push_back(rs_addr);
+  }
+  pthread_mutex_unlock(&requests_lock_);
+
+  // Ask the DNS which RS to contact for every uncached peer at once...
+  vector<uint32_t> resolutions(names.size(), 0);
+  for (unsigned int i = 0; i < names.size(); i++)
+    if (!cached[i])
+      resolutions[i] = SendRequest(dns_server_, GLOB_LOOKUP_PORT,
+                                   WIRE_RESOLVE, names[i]);
+  AwaitRequests(resolutions);
+
+  // ...and then subscribe to every peer's updates (learning where it is) at
+  // once
+  vector<uint32_t> lookups(names.size(), 0);
+  vector<int> servers(names.size(), 0);
+  for (unsigned int i = 0; i < names.size(); i++) {
+    if (!cached[i])
+      rs_addrs[i] = TakeAnswer(resolutions[i]);
+    if (rs_addrs[i] == "")
+      continue;
+    lookups[i] = SendRequest(rs_addrs[i], GLOB_LOOKUP_PORT, WIRE_SUBSCRIBE,
+                             logical_address_, names[i], control_socket_);
+    servers[i] = IPStringToInt(rs_addrs[i]);
+  }
+  AwaitRequests(lookups);
+
+  vector<PhysicalAddress> peer_locs(names.size());
+  vector<bool> unanswered(names.size(), false);
+  for (unsigned int i = 0; i < names.size(); i++) {
+    bool answered = true;
+    if (lookups[i] != 0)
+      peer_locs[i] = TakeAnswer(lookups[i], &answered);
+    unanswered[i] = !answered;
+  }
+
+  vector<struct sockaddr*> locations(peers.size(),
+                                     static_cast<struct sockaddr*>(NULL));
+  pthread_mutex_lock(&requests_lock_);
+  for (unsigned int i = 0; i < names.size(); i++) {
+    // An RS that never answered may be stale, so ask the DNS again next time
+    if (unanswered[i])
+      resolutions_.erase(names[i]);
+    if (peer_locs[i] == "")
+      continue;
+    PeerSubscription& subscription = peer_subscriptions_[names[i]];
+    subscription.server = servers[i];
+    subscription.address = IPStringToInt(peer_locs[i]);
+  }
+
+  for (unsigned int i = 0; i < peers.size(); i++) {
+    unordered_map<LogicalAddress, PeerSubscription>::iterator subscription =
+      peer_subscriptions_.find(peers[i].second);
+    if (subscription == peer_subscriptions_.end())
+      continue;
+
+    // A socket registered before follows only its new peer from now on, but
+    // through the container it was first handed (the app may still hold it)
+    struct sockaddr_in* peer_in = DetachAppSocket(peers[i].first);
+    if (peer_in == NULL) {
+      peer_in = new sockaddr_in();
+      memset(peer_in, 0, sizeof(*peer_in));
+    }
+    peer_in->sin_addr.s_addr = subscription->second.address;
+
+    // Register the peer in our list of app sockets and return container
+    subscription->second.app_sockets.push_back(peers[i].first);
+    app_sockets_[peers[i].first] = reinterpret_cast<struct sockaddr*>(peer_in);
+    locations[i] = reinterpret_cast<struct sockaddr*>(peer_in);
+  }
+  pthread_mutex_unlock(&requests_lock_);
+
+  return locations;
+}
+
+struct sockaddr_in* SimpleMobileNode::DetachAppSocket(int app_socket) {
+  unordered_map<int, struct sockaddr*>::iterator registered =
+    app_sockets_.find(app_socket);
+  if (registered == app_sockets_.end())
     return NULL;
 
-  // Construct a container for the peer's real location
-  struct sockaddr_in* peer_in = new sockaddr_in();
-  memset(peer_in, 0, sizeof(*peer_in));
-  peer_in->sin_addr.s_addr = IPStringToInt(peer_loc);
-
-  // Register the peer in our list of app sockets and return container
-  app_sockets_[app_socket] = reinterpret_cast<struct sockaddr*>(peer_in);
-  return reinterpret_cast<struct sockaddr*>(peer_in);
-}
-
-NetworkMsg SimpleMobileNode::ConnectToServer(PhysicalAddress server_addr,
-                                             unsigned short server_port,
-                                             NetworkMsg information,
-                                             int sender) {
-  bool close_sender = (sender < 0 ? true : false);
-  sender = (sender < 0 ? socket(domain_, transport_layer_, protocol_) : sender);
-
-  // We need to ensure that the socket is blocking if it previously wasn't
-  int opts;
-  if ((opts = fcntl(sender, F_GETFL)) < 0)
-    return "";
-  if (fcntl(sender, F_SETFL, opts & ~O_NONBLOCK) < 0)
-    return "";
-
-  // Actually connect to the server
-  struct sockaddr_in server;
-  memset(&server, 0, sizeof(server));
-  server.sin_family = domain_;
-  server.sin_addr.s_addr = IPStringToInt(server_addr);
-  server.sin_port = htons(server_port);
-  socklen_t server_size = sizeof(server);
-
-  int on;
-  setsockopt(sender, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&on),
-             sizeof(on));
-
-  char buffer[4096];
-  memset(buffer, 0, sizeof(buffer));
+  unordered_map<LogicalAddress, PeerSubscription>::iterator it;
+  for (it = peer_subscriptions_.begin(); it != peer_subscriptions_.end();
+       it++) {
+    vector<int>& app_sockets = it->second.app_sockets;
+    app_sockets.erase(std::remove(app_sockets.begin(), app_sockets.end(),
+                                  app_socket), app_sockets.end());
+  }
+
+  return reinterpret_cast<struct sockaddr_in*>(registered->second);
+}
+
+uint32_t SimpleMobileNode::SendRequest(PhysicalAddress server_addr,
+                                       unsigned short server_port,
+                                       WireOpcode opcode,
+                                       const LogicalAddress& name,
+                                       const LogicalAddress& target,
+                                       int sender, bool awaited) {
+  PendingRequest request;
+  request.sender = (sender < 0 ? client_socket_ : sender);
+  request.attempts = 0;
+  request.timeout = GLOB_REQUEST_TIMEOUT_MS;
+  request.awaited = awaited;
+  request.opcode = opcode;
+  request.name = name;
+
+  memset(&request.server, 0, sizeof(request.server));
+  request.server.sin_family = domain_;
+  request.server.sin_addr.s_addr = IPStringToInt(server_addr);
+  request.server.sin_port = htons(server_port);
+
+  pthread_mutex_lock(&requests_lock_);
+  uint32_t id = next_request_id_++;
+  if (next_request_id_ == 0)
+    next_request_id_ = 1;
+
+  // Build the request in whichever protocol we speak
+#ifdef BINARY_PROTOCOL_APPLICATION
+  char buffer[MIN_WIRE_MESSAGE + 2 * MAX_WIRE_NAME];
+  WireWriter writer(buffer, sizeof(buffer));
+  writer.Append(opcode, 0, id, name, target, 0);
+  request.datagram = NetworkMsg(buffer, writer.Length());
+#elif defined(TEXT_PROTOCOL_APPLICATION)
+  request.datagram = name;
+  if (opcode == WIRE_SUBSCRIBE)
+    request.datagram += "|" + target;
+  else if (opcode == WIRE_UNSUBSCRIBE)
+    request.datagram += "|" + target + "|" + TEXT_UNSUBSCRIBE;
+  else if (opcode == WIRE_LOOKUP)
+    request.datagram += "|" + target + "|" + TEXT_LOOKUP;
+  request.datagram.push_back('\0');
+#endif
 
+  PendingRequest& pending = pending_requests_[id];
+  pending = request;
+  TransmitRequest(&pending, GetTime());
+  pthread_mutex_unlock(&requests_lock_);
+
+  return id;
+}
+
+void SimpleMobileNode::TransmitRequest(PendingRequest* request,
+                                       uint64_t now) {
 #ifdef UDP_APPLICATION
-  sendto(sender, information.c_str(), information.length(), 0,
-         reinterpret_cast<struct sockaddr*>(&server),
-         server_size);
-  recvfrom(sender, buffer, sizeof(buffer), 0,
-           reinterpret_cast<struct sockaddr*>(&server),
-           &server_size);
+  sendto(request->sender, request->datagram.data(), request->datagram.length(),
+         MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&request->server),
+         sizeof(request->server));
 #elif TCP_APPLICATION
   ShutDown("TCP is not yet supported");
-  return "";
 #endif
 
-  // Fix and close the socket we mutzed
-  if (fcntl(sender, F_SETFL, opts) < 0)
-    return "";
-  if (close_sender)
-    close(sender);
+  // Back off a little more after every attempt
+  if (request->attempts++ > 0)
+    request->timeout = (2 * request->timeout < MAX_REQUEST_TIMEOUT_MS ?
+                        2 * request->timeout : MAX_REQUEST_TIMEOUT_MS);
+  request->deadline = now + request->timeout;
+}
+
+void SimpleMobileNode::ServiceRequests(int timeout) {
+  vector<uint32_t> expired;
+  vector<struct pollfd> receivers;
+  uint64_t now = GetTime();
+
+  // Retransmit anything overdue and find out which sockets to listen on
+  pthread_mutex_lock(&requests_lock_);
+  unordered_map<uint32_t, PendingRequest>::iterator it;
+  for (it = pending_requests_.begin(); it != pending_requests_.end(); it++) {
+    PendingRequest& request = it->second;
+    if (now >= request.deadline && request.attempts >= MAX_ATTEMPTS) {
+      expired.push_back(it->first);
+      continue;
+    } else if (now >= request.deadline) {
+      Log(stderr, WARNING, "Request #%u went unanswered, resending", it->first);
+      TransmitRequest(&request, now);
+    }
+
+    if (static_cast<int>(request.deadline - now) < timeout)
+      timeout = request.deadline - now;
+
+    bool watched = false;
+    for (unsigned int i = 0; i < receivers.size() && !watched; i++)
+      watched = (receivers[i].fd == request.sender);
+    if (!watched) {
+      struct pollfd receiver;
+      receiver.fd = request.sender;
+      receiver.events = POLLIN;
+      receiver.revents = 0;
+      receivers.push_back(receiver);
+    }
+  }
+
+  for (unsigned int i = 0; i < expired.size(); i++) {
+    Log(stderr, ERROR, "Giving up on request #%u", expired[i]);
+    FinishRequest(expired[i], "", -1);
+  }
+  pthread_mutex_unlock(&requests_lock_);
+
+  if (poll((receivers.empty() ? NULL : &receivers[0]), receivers.size(),
+           timeout) <= 0)
+    return;
+
+  // Drain every socket that has answers waiting
+  pthread_mutex_lock(&requests_lock_);
+  for (unsigned int i = 0; i < receivers.size(); i++)
+    if (receivers[i].revents & POLLIN)
+      ReadDatagrams(receivers[i].fd);
+  pthread_mutex_unlock(&requests_lock_);
+}
+
+int SimpleMobileNode::RequestTimeout(int timeout) {
+  uint64_t now = GetTime();
+
+  pthread_mutex_lock(&requests_lock_);
+  unordered_map<uint32_t, PendingRequest>::iterator it;
+  for (it = pending_requests_.begin(); it != pending_requests_.end(); it++) {
+    int remaining = (it->second.deadline > now ? it->second.deadline - now : 0);
+    if (remaining < timeout)
+      timeout = remaining;
+  }
+
+  unordered_map<int, uint64_t>::iterator replay;
+  for (replay = replays_.begin(); replay != replays_.end(); replay++) {
+    int remaining = (replay->second > now ? replay->second - now : 0);
+    if (remaining < timeout)
+      timeout = remaining;
+  }
+  pthread_mutex_unlock(&requests_lock_);
+
+  return timeout;
+}
+
+void SimpleMobileNode::AwaitRequests(const vector<uint32_t>& ids) {
+  for (;;) {
+    bool finished = true;
+    pthread_mutex_lock(&requests_lock_);
+    for (unsigned int i = 0; i < ids.size() && finished; i++)
+      finished = (pending_requests_.count(ids[i]) == 0);
+    pthread_mutex_unlock(&requests_lock_);
+
+    if (finished || !Signal::ShouldContinue())
+      return;
+    ServiceRequests(REQUEST_POLL_INTERVAL_MS);
+  }
+}
+
+PhysicalAddress SimpleMobileNode::TakeAnswer(uint32_t id, bool* answered) {
+  PhysicalAddress answer;
+
+  pthread_mutex_lock(&requests_lock_);
+  pending_requests_.erase(id);
+  unordered_map<uint32_t, PhysicalAddress>::iterator it = answers_.find(id);
+  if (answered != NULL)
+    *answered = (it != answers_.end());
+  if (it != answers_.end()) {
+    answer = it->second;
+    answers_.erase(it);
+  }
+  pthread_mutex_unlock(&requests_lock_);
+
+  return answer;
+}
+
+bool SimpleMobileNode::HandleReply(int receiver, const char* datagram,
+                                   int length,
+                                   const struct sockaddr_in& source) {
+  bool answered = false;
+
+#ifdef BINARY_PROTOCOL_APPLICATION
+  WireReader reader(datagram, length);
+  WireMessage reply;
+  while (reader.Next(&reply)) {
+    if (reply.opcode != WIRE_REGISTERED && reply.opcode != WIRE_RESOLVED &&
+        reply.opcode != WIRE_LOOKED_UP && reply.opcode != WIRE_SUBSCRIBED &&
+        reply.opcode != WIRE_UNSUBSCRIBED)
+      continue;
+
+    unordered_map<uint32_t, PendingRequest>::iterator it =
+      pending_requests_.find(reply.request_id);
+    if (it == pending_requests_.end() || it->second.sender != receiver ||
+        it->second.server.sin_addr.s_addr != source.sin_addr.s_addr)
+      continue;
+
+    // Replies that do not say how long to cache for get the usual TTL
+    bool found = !(reply.flags & WIRE_NOT_FOUND);
+    int ttl = (found ? GLOB_RESOLUTION_TTL_S : NEGATIVE_RESOLUTION_TTL_S);
+    if (reply.flags & WIRE_TTL)
+      ttl = (reply.ttl > 0x7FFFFFFF ? 0x7FFFFFFF : reply.ttl);
+    FinishRequest(reply.request_id,
+                  (found ? IntToIPString(reply.address) : ""), ttl);
+    answered = true;
+  }
+#elif defined(TEXT_PROTOCOL_APPLICATION)
+  // Text answers carry no id, so they answer the oldest request to the server
+  uint32_t oldest = 0;
+  unordered_map<uint32_t, PendingRequest>::iterator it;
+  for (it = pending_requests_.begin(); it != pending_requests_.end(); it++)
+    if (it->second.sender == receiver &&
+        it->second.server.sin_addr.s_addr == source.sin_addr.s_addr &&
+        it->second.server.sin_port == source.sin_port &&
+        (oldest == 0 || it->first < oldest))
+      oldest = it->first;
+
+  if (oldest != 0) {
+    PhysicalAddress answer = MsgFromDatagram(datagram, length);
+    FinishRequest(oldest, answer, (answer == "" ? NEGATIVE_RESOLUTION_TTL_S :
+                                   GLOB_RESOLUTION_TTL_S));
+    answered = true;
+  }
+#endif
+
+  return answered;
+}
+
+void SimpleMobileNode::FinishRequest(uint32_t id,
+                                     const PhysicalAddress& answer, int ttl) {
+  unordered_map<uint32_t, PendingRequest>::iterator it =
+    pending_requests_.find(id);
+  if (it == pending_requests_.end())
+    return;
+
+  // An unreachable DNS says nothing about the name, so only answers count
+  if (it->second.opcode == WIRE_RESOLVE && ttl > 0) {
+    CachedResolution& resolution = resolutions_[it->second.name];
+    resolution.server = (answer == "" ? 0 : IPStringToInt(answer));
+    resolution.expires = GetTime() + 1000 * static_cast<uint64_t>(ttl);
+  }
+
+  // Requests that were never answered leave no answer behind
+  if (it->second.awaited && ttl >= 0)
+    answers_[id] = answer;
+  pending_requests_.erase(it);
+}
+
+bool SimpleMobileNode::CachedServer(const LogicalAddress& name,
+                                    PhysicalAddress* server) {
+  unordered_map<LogicalAddress, CachedResolution>::iterator it =
+    resolutions_.find(name);
+  if (it == resolutions_.end())
+    return false;
+
+  if (it->second.expires <= GetTime()) {
+    resolutions_.erase(it);
+    return false;
+  }
 
-  return NetworkMsg(buffer);
+  *server = (it->second.server == 0 ? "" : IntToIPString(it->second.server));
+  return true;
 }
 
-void SimpleMobileNode::MessageSent(int app_socket, NetworkMsg message) {
-  app_socket_messages_[app_socket].insert(message);
+bool SimpleMobileNode::MessageSent(int app_socket, NetworkMsg message) {
+  return MessageSent(app_socket, message, NULL);
+}
+
+bool SimpleMobileNode::MessageSent(int app_socket, const NetworkMsg& message,
+                                   uint32_t* sequence) {
+  pthread_mutex_lock(&requests_lock_);
+  bool accepted = app_socket_messages_[app_socket].Push(message, sequence);
+  pthread_mutex_unlock(&requests_lock_);
+
+  if (!accepted)
+    Log(stderr, WARNING, "Too much is unacknowledged on socket #%d, holding off",
+        app_socket);
+  return accepted;
 }
 
 void SimpleMobileNode::MessageReceived(int app_socket, NetworkMsg message) {
-  set<NetworkMsg> buffer_log = app_socket_messages_[app_socket];
-  if (buffer_log.count(message) > 0)
-    buffer_log.erase(buffer_log.find(message));
+  pthread_mutex_lock(&requests_lock_);
+  MessageRing& buffer_log = app_socket_messages_[app_socket];
+  uint32_t sequence;
+  if (buffer_log.Find(message, &sequence))
+    buffer_log.Release(sequence);
+  pthread_mutex_unlock(&requests_lock_);
+}
+
+void SimpleMobileNode::MessageAcknowledged(int app_socket, uint32_t sequence) {
+  pthread_mutex_lock(&requests_lock_);
+  app_socket_messages_[app_socket].Acknowledge(sequence);
+  pthread_mutex_unlock(&requests_lock_);
 }
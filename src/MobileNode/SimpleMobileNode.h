@@ -11,30 +11,153 @@
 #ifndef _PERMANENTIP_MOBILENODE_SIMPLEMOBILENODE_H_
 #define _PERMANENTIP_MOBILENODE_SIMPLEMOBILENODE_H_
 
+#include <gtest/gtest.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <tr1/unordered_map>
 #include <cerrno>
 #include <cassert>
 #include <cstdarg>
+#include <algorithm>
 #include <string>
 #include <set>
+#include <utility>
+#include <vector>
 
+#include "Common/EventLoop.h"
+#include "Common/MessageRing.h"
 #include "Common/Signal.h"
 #include "Common/Types.h"
 #include "Common/Utils.h"
+#include "Common/WireProtocol.h"
 #include "MobileNode/MobileNode.h"
 
 using Utils::Die;
 using Utils::Log;
 using Utils::IPStringToInt;
+using Utils::IntToIPString;
 using Utils::GetCurrentIPAddress;
+using Utils::GetTime;
+using Utils::MsgFromDatagram;
 
 using std::tr1::unordered_map;
 using std::string;
 using std::set;
+using std::pair;
+using std::vector;
 
-class SimpleMobileNode : public MobileNode {
+/**
+ * A request to the DNS or RS is retransmitted if it has not been answered
+ * within @ref GLOB_REQUEST_TIMEOUT_MS, doubling the timeout each time (up to
+ * @ref MAX_REQUEST_TIMEOUT_MS) until @ref MAX_ATTEMPTS have gone unanswered
+ **/
+#define GLOB_REQUEST_TIMEOUT_MS 250
+#define MAX_REQUEST_TIMEOUT_MS 2000
+
+/**
+ * Another thread may read the answer someone is waiting on, so waiters check
+ * back at least every @ref REQUEST_POLL_INTERVAL_MS
+ **/
+#define REQUEST_POLL_INTERVAL_MS 20
+
+/**
+ * The daemon sleeps in an epoll set until an RS pushes an update to the
+ * control socket, netlink reports an interface address change, a request
+ * is due to be resent or @ref GLOB_WAKEUP_INTERVAL_MS passes.  It only walks
+ * the interfaces (and sweeps the control socket for updates) itself on every
+ * wakeup if netlink is unavailable, and otherwise every
+ * @ref MAX_ADDRESS_CHECK_MS in case a notification was lost.
+ **/
+#define GLOB_WAKEUP_INTERVAL_MS 1000
+#define MAX_ADDRESS_CHECK_MS 30000
+
+/**
+ * After a handover whatever was in flight to the peer is replayed to its new
+ * location at most @ref MAX_REPLAY_BURST_BYTES at a time, one burst every
+ * @ref REPLAY_PACING_MS, so as not to flood the new link
+ **/
+#define MAX_REPLAY_BURST_BYTES (16 * 1024)
+#define REPLAY_PACING_MS 5
+
+/**
+ * A request that has been sent (maybe more than once) but not yet answered
+ **/
+struct PendingRequest {
+  /**
+   * The socket the request was sent on (and the answer will arrive on)...
+   **/
+  int sender;
+
+  /**
+   * ...where it was sent...
+   **/
+  struct sockaddr_in server;
+
+  /**
+   * ...exactly what was sent...
+   **/
+  NetworkMsg datagram;
+
+  /**
+   * ...and what it asked about (so that DNS answers can be cached)
+   **/
+  WireOpcode opcode;
+  LogicalAddress name;
+
+  /**
+   * How many times it has been sent, how long we wait before the next
+   * attempt and when that is (see Utils::GetTime())
+   **/
+  int attempts;
+  int timeout;
+  uint64_t deadline;
+
+  /**
+   * Whether anyone will collect the answer (or it can be dropped)
+   **/
+  bool awaited;
+};
+
+/**
+ * What the DNS last told us about a name, until the TTL it gave runs out
+ **/
+struct CachedResolution {
+  /**
+   * The RS responsible for the name, or 0 if the DNS had none...
+   **/
+  int server;
+
+  /**
+   * ...until when (see Utils::GetTime())
+   **/
+  uint64_t expires;
+};
+
+/**
+ * A peer we are subscribed to, shared by every app socket that talks to it
+ **/
+struct PeerSubscription {
+  /**
+   * The RS we subscribed at (and the only one we take updates from)...
+   **/
+  int server;
+
+  /**
+   * ...where it last told us the peer is...
+   **/
+  int address;
+
+  /**
+   * ...and the app sockets whose peer sockaddr must follow the peer
+   **/
+  vector<int> app_sockets;
+};
+
+class SimpleMobileNode : public MobileNode, public EventHandler {
  public:
   /**
    * The constructor for a mobile node is responsible for initializing
@@ -45,43 +168,269 @@ class SimpleMobileNode : public MobileNode {
     logical_address_(logical_address),
     last_known_ip_address_(GetCurrentIPAddress()), dns_server_(dns_server),
     rendezvous_server_(rendezvous_server), rendezvous_port_(GLOB_REGIST_PORT),
-    domain_(GLOB_DOM), transport_layer_(GLOB_TL), protocol_(GLOB_PROTO) {}
+    domain_(GLOB_DOM), transport_layer_(GLOB_TL), protocol_(GLOB_PROTO),
+    netlink_socket_(-1), address_changed_(false), next_request_id_(1) {
+    client_socket_ = socket(domain_, transport_layer_, protocol_);
+    control_socket_ = socket(domain_, transport_layer_, protocol_);
+    pthread_mutex_init(&requests_lock_, NULL);
+  }
 
   /**
-   * The simple mobile node implementation destructor does not need to free
-   * any data because none is aggregated
+   * The simple mobile node implementation destructor only needs to free the
+   * sockets and lock it uses to talk to the DNS, RS and kernel
    **/
-  virtual ~SimpleMobileNode() {}
+  virtual ~SimpleMobileNode() {
+    close(client_socket_);
+    close(control_socket_);
+    if (netlink_socket_ >= 0)
+      close(netlink_socket_);
+    pthread_mutex_destroy(&requests_lock_);
+  }
 
   virtual bool Start();
   virtual bool ShutDown(const char* format, ...);
   virtual struct sockaddr* RegisterPeer(int app_socket,
                                         LogicalAddress peer_addr);
-  virtual void MessageSent(int app_socket, NetworkMsg message);
+
+  /**
+   * RegisterPeers() is RegisterPeer() for many peers at once.  Every DNS
+   * resolution is in flight at the same time, and then every RS lookup, so
+   * that any number of peers come up in about two round trips.  Resolutions
+   * are cached for as long as the DNS allows (so retries skip the DNS), and
+   * each peer is only ever subscribed to once (from the control socket),
+   * however many app sockets talk to it.
+   *
+   * @param   peers         The app socket and logical address of each peer
+   *
+   * @returns The sockaddr of each peer (in the same order), or NULL for the
+   *          peers that could not be found
+   **/
+  vector<struct sockaddr*> RegisterPeers(
+      const vector<pair<int, LogicalAddress> >& peers);
+  virtual bool MessageSent(int app_socket, NetworkMsg message);
   virtual void MessageReceived(int app_socket, NetworkMsg message);
 
+  /**
+   * MessageSent() can also hand back the sequence number of the message, for
+   * applications that acknowledge by sequence number rather than by payload
+   *
+   * @param     app_socket      The app socket on which to send the message
+   * @param     message         The message being sent
+   * @param     sequence        Set to the sequence number of the message
+   *
+   * @returns   False if the message must not be sent yet (see MessageSent())
+   **/
+  bool MessageSent(int app_socket, const NetworkMsg& message,
+                   uint32_t* sequence);
+
+  /**
+   * MessageAcknowledged() frees a message and every message sent before it
+   *
+   * @param     app_socket      The app socket the messages were sent on
+   * @param     sequence        The newest sequence number the peer received
+   **/
+  void MessageAcknowledged(int app_socket, uint32_t sequence);
+
+  /**
+   * HandleEvent() is called by the event loop whenever our client, control
+   * or netlink socket becomes readable
+   *
+   * @param     fd              The socket that is ready to be read from
+   *
+   * @returns   Always true (errors are dealt with by ShutDown())
+   **/
+  virtual bool HandleEvent(int fd);
+
  protected:
   virtual void UpdateRendezvousServer();
   virtual void PollSubscriptions();
 
   /**
-   * A mobile agent needs to connect to arbitrary servers to gain information.
-   * However, this separation is not strictly required, we provide it for a
-   * simple mobile node as a means of conciseness
+   * ReadDatagrams() reads everything waiting on one of our own sockets,
+   * matching answers to their requests and applying location updates.  The
+   * requests lock must be held.
+   *
+   * @param     receiver        The client or control socket to drain
+   **/
+  void ReadDatagrams(int receiver);
+
+  /**
+   * RenewSubscriptions() subscribes to every peer we follow all over again
+   * (without waiting for the answers) so that their RSs renew our leases
+   **/
+  void RenewSubscriptions();
+
+  /**
+   * ApplyUpdates() applies every location update in a datagram pushed by
+   * an RS (or, in the text protocol, the one update it holds).  The requests
+   * lock must be held.
+   *
+   * @param     datagram        The datagram the RS pushed
+   * @param     length          The number of bytes in the datagram
+   * @param     source          Who sent the datagram
+   *
+   * @returns   True if the datagram moved any peer we are subscribed to
+   **/
+  bool ApplyUpdates(const char* datagram, int length,
+                    const struct sockaddr_in& source);
+
+  /**
+   * MovePeer() points every app socket talking to a peer at its new location
+   * and starts replaying everything they have not had acknowledged.  The
+   * requests lock must be held.
+   *
+   * @param     peer            The peer that moved
+   * @param     address         Where it is now (in network byte order)
+   * @param     server          The RS that told us (in network byte order)
+   *
+   * @returns   True unless we are not subscribed to the peer at that RS
+   **/
+  bool MovePeer(const LogicalAddress& peer, int address, int server);
+
+  /**
+   * DetachAppSocket() takes an app socket off the peer it was registered to
+   * (if any).  The requests lock must be held.
    *
-   * @param     server_addr     The physical address of the server to connect to
-   * @param     server_port     The server port we will attempt the connection
-   * @param     information     The message we wish to send to the server
-   * @param     sender          The socket to send the message on (if there
-   *                            isn't a special one we have in mind we create
-   *                            a vanilla one)
+   * @param     app_socket      The app socket being registered afresh
    *
-   * @returns   The message we received back from the server, or "" if an
-   *            error occurred in connection
+   * @returns   The peer sockaddr the socket was handed (to be reused, since
+   *            the app may still hold it), or NULL if it was never registered
    **/
-  NetworkMsg ConnectToServer(PhysicalAddress server_addr,
-                             unsigned short server_port,
-                             NetworkMsg information, int sender = -1);
+  struct sockaddr_in* DetachAppSocket(int app_socket);
+
+  /**
+   * ReplayMessages() sends the next burst of every replay that is due.  The
+   * requests lock must be held.
+   *
+   * @param     now             The current time (see Utils::GetTime())
+   **/
+  void ReplayMessages(uint64_t now);
+
+  /**
+   * A mobile agent needs to send requests to arbitrary servers to gain
+   * information.  SendRequest() sends one without waiting for its answer, in
+   * the binary protocol (see @ref BINARY_PROTOCOL_APPLICATION) or as text.
+   *
+   * @param     server_addr     The physical address of the server to ask
+   * @param     server_port     The server port we send the request to
+   * @param     opcode          What we are asking the server (a registration,
+   *                            DNS resolution or RS lookup)
+   * @param     name            The logical address the request is about (or
+   *                            who is subscribing, for a lookup)
+   * @param     target          Who is being subscribed to, for a lookup
+   * @param     sender          The socket to send the request on (if there
+   *                            isn't a special one we have in mind we use
+   *                            our own client socket)
+   * @param     awaited         Whether the answer will be collected with
+   *                            TakeAnswer() (or is simply dropped)
+   *
+   * @returns   The id of the request
+   **/
+  uint32_t SendRequest(PhysicalAddress server_addr, unsigned short server_port,
+                       WireOpcode opcode, const LogicalAddress& name,
+                       const LogicalAddress& target = "", int sender = -1,
+                       bool awaited = true);
+
+  /**
+   * ServiceRequests() reads any answers that have arrived and retransmits (or
+   * gives up on) overdue requests, sleeping until something happens
+   *
+   * @param     timeout         The most milliseconds to sleep for
+   **/
+  void ServiceRequests(int timeout);
+
+  /**
+   * RequestTimeout() shortens a sleep so that we wake up in time to resend
+   * (or give up on) the most urgent request, or the next replay burst
+   *
+   * @param     timeout         The most milliseconds we would like to sleep
+   *
+   * @returns   The most milliseconds we may sleep for
+   **/
+  int RequestTimeout(int timeout);
+
+  /**
+   * WatchAddressChanges() subscribes to the kernel's notifications of IPv4
+   * interface addresses being added or removed (RTM_NEWADDR/RTM_DELADDR)
+   *
+   * @returns   True unless netlink is unavailable (in which case we fall
+   *            back to walking the interfaces on every wakeup)
+   **/
+  bool WatchAddressChanges();
+
+  /**
+   * AddressChanged() reads every pending address notification
+   *
+   * @returns   True if any interface address was added or removed
+   **/
+  bool AddressChanged();
+
+  /**
+   * AwaitRequests() services requests until every one of them is answered or
+   * given up on (or the node is shutting down)
+   *
+   * @param     ids             The requests to wait for (0 is ignored)
+   **/
+  void AwaitRequests(const vector<uint32_t>& ids);
+
+  /**
+   * TakeAnswer() collects (and forgets) the answer to a finished request
+   *
+   * @param     id              The id returned by SendRequest()
+   * @param     answered        Set to whether the server answered at all
+   *                            (may be NULL)
+   *
+   * @returns   The physical address the server answered with, or "" if it
+   *            had none or never answered
+   **/
+  PhysicalAddress TakeAnswer(uint32_t id, bool* answered = NULL);
+
+  /**
+   * HandleReply() matches a datagram to the request(s) it answers (by
+   * request id in the binary protocol, or the oldest request sent to that
+   * server in the text protocol).  The requests lock must be held.
+   *
+   * @param     receiver        The socket the datagram arrived on
+   * @param     datagram        The datagram received
+   * @param     length          The number of bytes in the datagram
+   * @param     source          Who sent the datagram
+   *
+   * @returns   True if the datagram answered any request
+   **/
+  bool HandleReply(int receiver, const char* datagram, int length,
+                   const struct sockaddr_in& source);
+
+  /**
+   * TransmitRequest() (re)sends a request and sets its next deadline.  The
+   * requests lock must be held.
+   *
+   * @param     request         The request to send
+   * @param     now             The current time (see Utils::GetTime())
+   **/
+  void TransmitRequest(PendingRequest* request, uint64_t now);
+
+  /**
+   * FinishRequest() records the answer to a request (if anyone is awaiting
+   * it), caches DNS answers and forgets the request.  The requests lock must
+   * be held.
+   *
+   * @param     id              The id of the request
+   * @param     answer          The answer, or "" if there is none
+   * @param     ttl             The seconds the answer may be cached for, or
+   *                            -1 if the request was never answered
+   **/
+  void FinishRequest(uint32_t id, const PhysicalAddress& answer, int ttl);
+
+  /**
+   * CachedServer() looks up the RS responsible for a name in the resolution
+   * cache (forgetting it if it has expired).  The requests lock must be held.
+   *
+   * @param     name            The logical address to look up
+   * @param     server          Set to the RS, or "" if the DNS had none
+   *
+   * @returns   True if the cache had an answer
+   **/
+  bool CachedServer(const LogicalAddress& name, PhysicalAddress* server);
 
   /**
    * We keep the current node's logical address stashed...
@@ -126,15 +475,86 @@ class SimpleMobileNode : public MobileNode {
 
   /**
    * We keep track of the applications with open sockets (a mapping of
-   * app socket to the peer sockaddr struct it connects to)
+   * app socket to the peer sockaddr struct it connects to)...
    **/
   unordered_map<int, struct sockaddr*> app_sockets_;
 
   /**
-   * We keep track of a list of previously sent messages over the network
-   * so that if we need to reconnect we can resend
+   * ...and of the peers those sockets talk to, so that a single update can
+   * patch every app socket following the peer that moved
+   **/
+  unordered_map<LogicalAddress, PeerSubscription> peer_subscriptions_;
+
+  /**
+   * We keep track of the messages sent over each app socket that have not
+   * been acknowledged yet so that if we need to reconnect we can resend
+   **/
+  unordered_map<int, MessageRing> app_socket_messages_;
+
+  /**
+   * The app sockets with a replay under way, and when their next burst is due
+   **/
+  unordered_map<int, uint64_t> replays_;
+
+  /**
+   * Requests to the DNS and RS go out (and are answered) on our own client
+   * socket...
+   **/
+  int client_socket_;
+
+  /**
+   * ...except for lookups, which subscribe us to a peer and so are sent on
+   * the control socket every update is then pushed to (leaving the app
+   * sockets to carry nothing but application data)
+   **/
+  int control_socket_;
+
+  /**
+   * The kernel tells us about address changes on our netlink socket (or -1
+   * if we could not subscribe)...
    **/
-  unordered_map<int, set<NetworkMsg> > app_socket_messages_;
+  int netlink_socket_;
+
+  /**
+   * ...which we note whenever the event loop wakes us up for it
+   **/
+  bool address_changed_;
+
+  /**
+   * The daemon sleeps on every socket above (and every app socket) at once
+   **/
+  EventLoop event_loop_;
+
+  /**
+   * Every request we send carries a new request id...
+   **/
+  uint32_t next_request_id_;
+
+  /**
+   * ...and is remembered until it is answered or given up on...
+   **/
+  unordered_map<uint32_t, PendingRequest> pending_requests_;
+
+  /**
+   * ...when its answer waits here until it is collected
+   **/
+  unordered_map<uint32_t, PhysicalAddress> answers_;
+
+  /**
+   * Which RS the DNS said is responsible for a name (or that none is)
+   **/
+  unordered_map<LogicalAddress, CachedResolution> resolutions_;
+
+  /**
+   * Both the daemon and the applications send requests and touch the app
+   * sockets, so the request state, caches, subscriptions and the app socket
+   * maps are guarded by a lock
+   **/
+  pthread_mutex_t requests_lock_;
+
+  // Declare friend tests for access to private methods
+  FRIEND_TEST(SimpleMobileNodeTest, NoticesAddressChanges);
+  FRIEND_TEST(SimpleMobileNodeTest, MovesReregisteredSockets);
 };
 
 #endif  // _PERMANENTIP_MOBILENODE_SIMPLEMOBILENODE_H_
@@ -27,8 +27,8 @@ class RendezvousServer {
   /**
    * The rendezvous server follows a typical server-like mechanism, where the
    * Start() function is responsible for opening socket listeners for address
-   * lookups and registrations, and then continually cycling through those two
-   * sockets and polling for lookups and registrations.
+   * lookups and registrations, and then sleeping until either of those two
+   * sockets has lookups or registrations waiting to be handled.
    *
    * @returns  True unless there was an error connecting to the RS
     **/
@@ -59,21 +59,43 @@ class RendezvousServer {
 
   /**
    * When a peer is trying to connect to the user, it must request to be added
-   * to the subscriber list, and there must be some mechanism to unsubscribe the
-   * user from that list at some point.  When the subscriber is added to the
-   * list the user's last known physical address is returned for the connecting
-   * user to make a connection to.
+   * to the subscriber list.  When the subscriber is added to the list the
+   * user's last known physical address is returned for the connecting user to
+   * make a connection to.  Subscribing again changes nothing, so requests may
+   * be retransmitted freely.
    *
    * @param   subscriber    The logical-address|port combination of the
    *                        subscriber connected to the RS
-   * @param   client        The name of the client the subscriber is changing
-   *                        its subscription with
+   * @param   client        The name of the client being subscribed to
    *
    * @returns The last known physical address of the client subscribed to
    **/
-  virtual PhysicalAddress ChangeSubscription(
+  virtual PhysicalAddress Subscribe(
       pair<LogicalAddress, unsigned short> subscriber,
       LogicalAddress client) = 0;
+
+  /**
+   * The subscriber may later take itself off the list (which, again, is
+   * harmless to repeat)
+   *
+   * @param   subscriber    The logical-address|port combination of the
+   *                        subscriber connected to the RS
+   * @param   client        The name of the client being unsubscribed from
+   *
+   * @returns The last known physical address of the client
+   **/
+  virtual PhysicalAddress Unsubscribe(
+      pair<LogicalAddress, unsigned short> subscriber,
+      LogicalAddress client) = 0;
+
+  /**
+   * A peer may also just ask where the user is, without subscribing
+   *
+   * @param   name          The logical address being looked up
+   *
+   * @returns The physical address registered for name, "" if none
+   **/
+  virtual PhysicalAddress LookupAddress(const LogicalAddress& name) = 0;
 };
 
 #endif  // _PERMANENTIP_RENDEZVOUSSERVER_RENDEZVOUSSERVER_H_
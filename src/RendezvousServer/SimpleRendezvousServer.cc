@@ -10,17 +10,142 @@
 
 #include "RendezvousServer/SimpleRendezvousServer.h"
 
-bool SimpleRendezvousServer::Start() {
-  registration_listener_ = BeginListening(registration_port_);
-  lookup_listener_ = BeginListening(lookup_port_);
+bool RendezvousWorker::HandleEvent(int fd) {
+  if (fd == lease_timer_) {
+    server_->ExpireLeases(GetTime());
+    return true;
+  } else if (fd == flush_timer_) {
+    server_->FlushHeld(GetTime());
+    return true;
+  } else if (fd == commit_timer_) {
+    server_->CommitLog(GetTime());
+    return true;
+  }
+
+  return server_->HandleRequests(this, fd, fd == lookup_listener_);
+}
+
+bool RendezvousWorker::Run() {
+  // Sleep until there are requests, a SIGINT or a call to ShutDown()
+  while (event_loop_.RunOnce() && Signal::ShouldContinue()) {}
+  return true;
+}
+
+SimpleRendezvousServer::SimpleRendezvousServer(int batch_size, int workers,
+                                               int coalesce_ms,
+                                               const string& state_dir) :
+    leases_(GetTime() / LEASE_TICK_MS), coalesce_ms_(coalesce_ms),
+    state_dir_(state_dir), generation_(0), snapshot_generation_(0),
+    snapshot_expires_(0),
+    registration_port_(GLOB_REGIST_PORT),
+    lookup_port_(GLOB_LOOKUP_PORT), domain_(GLOB_DOM),
+    transport_layer_(GLOB_TL), protocol_(GLOB_PROTO) {
+  pthread_mutex_init(&lease_lock_, NULL);
+  pthread_mutex_init(&held_lock_, NULL);
+  pthread_mutex_init(&caller_lock_, NULL);
+  for (int i = 0; i < REGISTRY_SHARDS; i++)
+    shards_[i].index_ = i;
+
+  for (int i = 0; i < (workers < 1 ? 1 : workers); i++) {
+    workers_.push_back(new RendezvousWorker(this, batch_size));
+    workers_[i]->update_socket_ = socket(domain_, transport_layer_, protocol_);
+  }
+
+  // Callers outside the workers never read requests, so need no batch
+  caller_ = new RendezvousWorker(this, 1);
+  caller_->update_socket_ = socket(domain_, transport_layer_, protocol_);
+  persister_ = new RendezvousWorker(this, 1);
+}
+
+SimpleRendezvousServer::~SimpleRendezvousServer() {
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    delete workers_[i];
+  delete caller_;
+  delete persister_;
+  pthread_mutex_destroy(&caller_lock_);
+  pthread_mutex_destroy(&lease_lock_);
+  pthread_mutex_destroy(&held_lock_);
+}
 
+bool SimpleRendezvousServer::Start() {
   Signal::RestartProgram();
   Signal::HandleSignalInterrupts();
-  do {
-    assert(HandleRequests(lookup_listener_, true));
-    assert(HandleRequests(registration_listener_, false));
-    usleep(500);
-  } while (Signal::ShouldContinue());
+
+  // Rebuild the registry before anyone can ask for it
+  if (!Recover())
+    return ShutDown("Could not recover the RS state from %s",
+                    state_dir_.c_str());
+
+  // Every worker binds its own listeners, and the kernel balances between them
+  for (unsigned int i = 0; i < workers_.size(); i++) {
+    RendezvousWorker* worker = workers_[i];
+    worker->registration_listener_ = BeginListening(registration_port_);
+    worker->lookup_listener_ = BeginListening(lookup_port_);
+    if (!Signal::ShouldContinue())
+      return false;
+
+    if (!worker->event_loop_.Watch(worker->lookup_listener_, worker) ||
+        !worker->event_loop_.Watch(worker->registration_listener_, worker))
+      return ShutDown("Could not watch the RS listeners");
+  }
+
+  // Lapsed leases are swept up by the first worker in between requests
+  workers_[0]->lease_timer_ =
+    workers_[0]->event_loop_.AddTimer(LEASE_TICK_MS, workers_[0]);
+  if (workers_[0]->lease_timer_ < 0)
+    return ShutDown("Could not start the lease timer");
+
+  // ...as are held updates, if we hold any back
+  if (coalesce_ms_ > 0) {
+    int tick = coalesce_ms_ / COALESCE_TICKS;
+    workers_[0]->flush_timer_ =
+      workers_[0]->event_loop_.AddTimer((tick < 1 ? 1 : tick), workers_[0]);
+    if (workers_[0]->flush_timer_ < 0)
+      return ShutDown("Could not start the coalescing timer");
+  }
+
+  // The log (if we keep one) is committed by the persister on its own
+  bool persisting = log_.IsOpen();
+  if (persisting) {
+    persister_->commit_timer_ =
+      persister_->event_loop_.AddTimer(WAL_COMMIT_MS, persister_);
+    if (persister_->commit_timer_ < 0)
+      return ShutDown("Could not start the log commit timer");
+  }
+
+  // Only the first worker (on this thread) should ever see a SIGINT
+  sigset_t blocked, previous;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+  for (unsigned int i = 1; i < workers_.size(); i++)
+    pthread_create(&workers_[i]->thread_, NULL, &RunRendezvousWorkerThread,
+                   workers_[i]);
+  if (persisting)
+    pthread_create(&persister_->thread_, NULL, &RunRendezvousWorkerThread,
+                   persister_);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  workers_[0]->Run();
+
+  // However we got here, make sure the rest of the workers stop too
+  for (unsigned int i = 1; i < workers_.size(); i++) {
+    workers_[i]->event_loop_.Stop();
+    pthread_join(workers_[i]->thread_, NULL);
+  }
+  if (persisting) {
+    persister_->event_loop_.Stop();
+    pthread_join(persister_->thread_, NULL);
+  }
+
+  for (unsigned int i = 0; i < workers_.size(); i++) {
+    close(workers_[i]->registration_listener_);
+    close(workers_[i]->lookup_listener_);
+  }
+
+  // Whatever was logged since the last commit is made durable too
+  log_.Close();
   return true;
 }
 
@@ -32,8 +157,9 @@ bool SimpleRendezvousServer::ShutDown(const char* format, ...) {
   Log(stderr, WARNING, format, arguments);
   perror(")");
 
-  close(registration_listener_);
-  close(lookup_listener_);
+  // The listeners are closed by Start() once the event loops have woken up
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    workers_[i]->event_loop_.Stop();
   Signal::ExitProgram(0);
 
   Log(stderr, SUCCESS, "OK");
@@ -45,6 +171,15 @@ int SimpleRendezvousServer::BeginListening(unsigned short port) {
   if (listener < 0)
     return ShutDown("Could not begin listening on RS");
 
+  // Port sharing must be requested before the bind for it to take effect
+  int on = 1;
+  if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR,
+                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
+    return ShutDown("Could not make the socket reusable");
+  if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT,
+                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
+    return ShutDown("Could not share the port between workers");
+
   struct sockaddr_in server;
   memset(&server, 0, sizeof(server));
   server.sin_family = domain_;
@@ -60,11 +195,6 @@ int SimpleRendezvousServer::BeginListening(unsigned short port) {
     return ShutDown("Could not listen on RS port");
 #endif
 
-  int on;
-  if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR,
-                 reinterpret_cast<char*>(&on), sizeof(on)) < 0)
-    return ShutDown("Could not make the socket reusable");
-
   int opts;
   if ((opts = fcntl(listener, F_GETFL)) < 0)
     return ShutDown("Error getting the socket options");
@@ -76,110 +206,1128 @@ int SimpleRendezvousServer::BeginListening(unsigned short port) {
   return listener;
 }
 
-bool SimpleRendezvousServer::HandleRequests(int listening_socket, bool lookup) {
-  struct sockaddr_in request_src;
-  socklen_t request_src_size = sizeof(request_src);
-
-  char buffer[4096];
-  memset(buffer, 0, sizeof(buffer));
+bool SimpleRendezvousServer::HandleRequests(RendezvousWorker* worker,
+                                            int listening_socket,
+                                            bool lookup) {
+  DatagramBatch& batch = worker->batch_;
 
+  // The listeners are edge-triggered so we must drain them until EAGAIN
+  for (;;) {
 #ifdef UDP_APPLICATION
-  int bytes_read = recvfrom(listening_socket, buffer, sizeof(buffer), 0,
-                            reinterpret_cast<struct sockaddr*>(&request_src),
-                            &request_src_size);
+    int received = batch.Receive(listening_socket);
 #elif TCP_APPLICATION
-  int bytes_read = -1;
-  ShutDown("TCP is not yet supported in the RS");
+    int received = -1;
+    ShutDown("TCP is not yet supported in the RS");
 #endif
 
-  int source_address = request_src.sin_addr.s_addr;
+    // Either the socket is drained or there was an error on it
+    if (received < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+      return true;
+    else if (received < 0 && errno == EINTR)
+      continue;
+    else if (received < 0)
+      return ShutDown("Error listening on socket");
 
-  // Handle address lookup
-  if (bytes_read > 0 && lookup) {
-    // The string sent is of the form subscriber|subscribee so we need to
-    // parse it out in order to update the subscription
-    NetworkMsg request = NetworkMsg(buffer);
-    LogicalAddress subscriber = request.substr(0, request.find("|"));
-    LogicalAddress subscribee = request.substr(request.find("|") + 1);
+    for (int i = 0; i < received; i++) {
+      if (batch.Length(i) == 0)
+        continue;
 
-    const char* peer = ChangeSubscription(
-      pair<LogicalAddress, unsigned short>(subscriber, request_src.sin_port),
-      subscribee).c_str();
+      const char* buffer = batch.Data(i);
+      struct sockaddr_in* request_src = batch.Source(i);
+      int source_address = request_src->sin_addr.s_addr;
 
-    Log(stderr, SUCCESS, "Sending RS lookup of <%s, %s> to (%d:%d)",
-        subscriber.c_str(), peer, source_address, ntohs(request_src.sin_port));
-    snprintf(buffer, sizeof(buffer), "%s", peer);
+      // Binary datagrams may carry many requests, all answered in one reply
+      if (WireReader::IsWireMessage(buffer, batch.Length(i))) {
+        int reply_length = AnswerWireRequests(worker, i, lookup);
+        if (reply_length > 0)
+          batch.QueueReply(i, reply_length);
+        continue;
+      }
 
-  // Handle address updating
-  } else if (bytes_read > 0) {
-    Log(stderr, WARNING, "Updating RS registration of <%s> from (%d:%d)",
-        buffer, source_address, ntohs(request_src.sin_port));
-    UpdateAddress(buffer, IntToIPString(source_address));
+      // Handle address lookup
+      if (lookup) {
+        // The string sent is of the form subscriber|subscribee[|operation]
+        // so we need to parse it out in order to update the subscription
+        NetworkMsg request = NetworkMsg(buffer);
+        LogicalAddress subscriber = request.substr(0, request.find("|"));
+        LogicalAddress subscribee = request.substr(request.find("|") + 1);
+        NetworkMsg operation;
+        if (subscribee.find("|") != string::npos) {
+          operation = subscribee.substr(subscribee.find("|") + 1);
+          subscribee.erase(subscribee.find("|"));
+        }
 
-    char switcher[4096];
-    strncpy(switcher, buffer, sizeof(buffer));
-    snprintf(buffer, sizeof(buffer), "%s %d", switcher, source_address);
+        pair<LogicalAddress, unsigned short> identity(subscriber,
+                                                      request_src->sin_port);
+        PhysicalAddress peer;
+        if (operation == TEXT_UNSUBSCRIBE)
+          peer = Unsubscribe(identity, subscribee);
+        else if (operation == TEXT_LOOKUP)
+          peer = LookupAddress(subscribee);
+        else
+          peer = Subscribe(identity, subscribee);
 
-  // Error on the socket
-  } else if (bytes_read < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-    return ShutDown("Error listening on socket");
-  }
+        Log(stderr, SUCCESS, "Sending RS lookup of <%s, %s> to (%d:%d)",
+            subscriber.c_str(), peer.c_str(), source_address,
+            ntohs(request_src->sin_port));
+        batch.QueueReply(i, peer);
+
+      // Handle address updating
+      } else {
+        Log(stderr, WARNING, "Updating RS registration of <%s> from (%d:%d)",
+            buffer, source_address, ntohs(request_src->sin_port));
+        UpdateAddress(worker, buffer, source_address);
+
+        char address[16];
+        snprintf(address, sizeof(address), " %d", source_address);
+        batch.QueueReply(i, LogicalAddress(buffer) + address);
+      }
+    }
 
-  if (bytes_read > 0) {
 #ifdef UDP_APPLICATION
-    sendto(listening_socket, buffer, sizeof(buffer), 0,
-           reinterpret_cast<struct sockaddr*>(&request_src), request_src_size);
-#elif TCP_APPLICATION
-    request_src_size = -1;
+    batch.Flush(listening_socket);
 #endif
   }
+}
 
-  return true;
+int SimpleRendezvousServer::AnswerWireRequests(RendezvousWorker* worker,
+                                               int i, bool lookup) {
+  DatagramBatch& batch = worker->batch_;
+  struct sockaddr_in* request_src = batch.Source(i);
+
+  WireReader reader(batch.Data(i), batch.Length(i));
+  WireWriter writer(batch.Data(i), MAX_DATAGRAM_SIZE);
+
+  // Each name is copied out before its reply can be written over it
+  WireMessage request;
+  while (reader.Next(&request)) {
+    worker->name_.assign(request.name, request.name_length);
+
+    if (lookup && (request.opcode == WIRE_SUBSCRIBE ||
+                   request.opcode == WIRE_UNSUBSCRIBE)) {
+      worker->target_.assign(request.target, request.target_length);
+      bool subscribe = (request.opcode == WIRE_SUBSCRIBE);
+      int address = 0;
+      SetSubscription(worker->name_, request_src->sin_port, worker->target_,
+                      true, subscribe, &address);
+      writer.Reply((subscribe ? WIRE_SUBSCRIBED : WIRE_UNSUBSCRIBED), request,
+                   address);
+
+    } else if (lookup && request.opcode == WIRE_LOOKUP) {
+      worker->target_.assign(request.target, request.target_length);
+      writer.Reply(WIRE_LOOKED_UP, request, RegisteredAddress(worker->target_));
+
+    } else if (!lookup && request.opcode == WIRE_REGISTER) {
+      UpdateAddress(worker, worker->name_, request_src->sin_addr.s_addr);
+      writer.Reply(WIRE_REGISTERED, request, request_src->sin_addr.s_addr);
+
+    } else if (!lookup && request.opcode == WIRE_DEREGISTER) {
+      worker->departures_.push_back(worker->name_);
+      writer.Reply(WIRE_DEREGISTERED, request, request_src->sin_addr.s_addr);
+    }
+  }
+
+  // Everyone leaving in this datagram is dropped together
+  if (!worker->departures_.empty()) {
+    Deregister(worker->departures_);
+    worker->departures_.clear();
+  }
+
+  Log(stderr, SUCCESS, "Answered %d bytes of binary %s requests from (%d:%d)",
+      reader.Offset(), (lookup ? "lookup" : "registration"),
+      request_src->sin_addr.s_addr, ntohs(request_src->sin_port));
+  return writer.Length();
+}
+
+RegistryShard* SimpleRendezvousServer::ShardFor(const LogicalAddress& name) {
+  return &shards_[hash<LogicalAddress>()(name) % REGISTRY_SHARDS];
+}
+
+PhysicalAddress SimpleRendezvousServer::LookupAddress(
+    const LogicalAddress& name) {
+  int address = RegisteredAddress(name);
+  return (address == 0 ? "" : IntToIPString(address));
+}
+
+int SimpleRendezvousServer::RegisteredAddress(const LogicalAddress& name) {
+  RegistryShard* shard = ShardFor(name);
+  int address = 0;
+
+  pthread_mutex_lock(&shard->lock_);
+  NameId id = shard->Find(name);
+  if (id != INVALID_NAME_ID && shard->Record(id).registered) {
+    address = shard->Record(id).address;
+  } else if (id == INVALID_NAME_ID && shard->snapshot_ != NULL) {
+    // Names nobody has touched since the restart are served from the table
+    // (whose own filter turns the rest away before its index is probed)
+    int entry = shard->snapshot_->Find(name);
+    if (entry >= 0 && !promoted_[entry])
+      address = shard->snapshot_->Address(entry);
+  }
+  pthread_mutex_unlock(&shard->lock_);
+
+  return address;
+}
+
+set< pair<LogicalAddress, unsigned short> >
+    SimpleRendezvousServer::Subscribers(const LogicalAddress& name) {
+  RegistryShard* shard = ShardFor(name);
+  vector<SubscriberId> identities;
+
+  pthread_mutex_lock(&shard->lock_);
+  NameId id = shard->Find(name);
+  if (id != INVALID_NAME_ID)
+    identities = shard->Record(id).subscribers.Identities();
+  pthread_mutex_unlock(&shard->lock_);
+
+  // Names are only forgotten once nothing refers to them, so (barring a lease
+  // running out in between) each can be resolved alone
+  set< pair<LogicalAddress, unsigned short> > subscribers;
+  for (unsigned int i = 0; i < identities.size(); i++) {
+    RegistryShard* subscriber_shard = ShardFor(identities[i].first);
+    pthread_mutex_lock(&subscriber_shard->lock_);
+    subscribers.insert(pair<LogicalAddress, unsigned short>(
+      subscriber_shard->Name(identities[i].first), identities[i].second));
+    pthread_mutex_unlock(&subscriber_shard->lock_);
+  }
+
+  return subscribers;
+}
+
+void SimpleRendezvousServer::PatchSubscriber(NameId name, int address) {
+  RegistryShard* shard = ShardFor(name);
+
+  pthread_mutex_lock(&shard->lock_);
+  vector<NameId> following = shard->Record(name).following;
+  pthread_mutex_unlock(&shard->lock_);
+
+  // We follow a name once per subscribed port but only need to patch it once
+  std::sort(following.begin(), following.end());
+  following.erase(std::unique(following.begin(), following.end()),
+                  following.end());
+
+  for (unsigned int i = 0; i < following.size(); i++) {
+    RegistryShard* followed_shard = ShardFor(following[i]);
+    pthread_mutex_lock(&followed_shard->lock_);
+    followed_shard->Record(following[i]).subscribers.Patch(name, address);
+    pthread_mutex_unlock(&followed_shard->lock_);
+  }
 }
 
 bool SimpleRendezvousServer::UpdateAddress(LogicalAddress name,
                                            PhysicalAddress address) {
-  registered_names_[name] = address;
-
-  int update_socket = socket(domain_, transport_layer_, protocol_);
-  set< pair<LogicalAddress, unsigned short> >::iterator i;
-
-  for (i = subscriptions_[name].begin(); i != subscriptions_[name].end(); i++) {
-    /**
-     * @todo  For now we assume all communications deal with the same RS. In the
-     *        future we need to do a full round robin to the DNS
-     **/
-    struct sockaddr_in subscriber;
-    subscriber.sin_family = domain_;
-    subscriber.sin_addr.s_addr =
-      IPStringToInt(registered_names_[i->first]);
-    subscriber.sin_port = i->second;
-    socklen_t subscriber_size = sizeof(subscriber);
-
-    // Send out the actual update
-    Log(stderr, WARNING, "Sending update of %s<%s> to %s(%s:%d)", name.c_str(),
-            address.c_str(), i->first.c_str(),
-            registered_names_[i->first].c_str(), ntohs(i->second));
-#ifdef UDP_APPLICATION
-    sendto(update_socket, address.c_str(), address.length() + 1, 0,
-           reinterpret_cast<struct sockaddr*>(&subscriber), subscriber_size);
-#elif TCP_APPLICATION
+  // The workers' fan-outs are only ever touched from their own threads
+  pthread_mutex_lock(&caller_lock_);
+  bool updated = UpdateAddress(caller_, name, IPStringToInt(address));
+  pthread_mutex_unlock(&caller_lock_);
+  return updated;
+}
+
+bool SimpleRendezvousServer::UpdateAddress(RendezvousWorker* worker,
+                                           const LogicalAddress& name,
+                                           int address) {
+  /**
+   * @todo  For now we assume all communications deal with the same RS. In the
+   *        future we need to do a full round robin to the DNS
+   **/
+  RegistryShard* shard = ShardFor(name);
+  worker->fan_out_.Clear();
+  worker->wire_fan_out_.Clear();
+
+  pthread_mutex_lock(&shard->lock_);
+  NameId id = Promote(shard, name);
+  if (id == INVALID_NAME_ID)
+    id = shard->Intern(name);
+  NameRecord& record = shard->Record(id);
+  RenewLease(id, record);
+
+  // Renewing a registration from where the name already is changes nothing
+  bool moved = (!record.registered || record.address != address);
+  record.registered = true;
+  record.address = address;
+  if (moved)
+    LogChange(&log_, CHANGE_REGISTER, name, address);
+  if (moved && !HoldUpdate(id, record))
+    GatherSubscribers(worker, record);
+  pthread_mutex_unlock(&shard->lock_);
+
+  if (!FanOut(worker, name, address))
     return false;
-#endif
+
+  // Anyone we are subscribed to must now send their updates to our new address
+  if (moved)
+    PatchSubscriber(id, address);
+  return true;
+}
+
+bool SimpleRendezvousServer::HoldUpdate(NameId id, NameRecord& record) {
+  if (coalesce_ms_ <= 0)
+    return false;
+
+  // An update already held back will go out with the latest address anyway
+  if (record.held)
+    return true;
+
+  uint64_t now = GetTime();
+  if (now >= record.fanned_out + coalesce_ms_) {
+    record.fanned_out = now;
+    return false;
+  }
+
+  // Whatever is ahead in the queue was held earlier, so is due no later than
+  // one window from now either
+  record.held = true;
+  pthread_mutex_lock(&held_lock_);
+  held_.push_back(pair<uint64_t, NameId>(record.fanned_out + coalesce_ms_,
+                                         id));
+  pthread_mutex_unlock(&held_lock_);
+  return true;
+}
+
+void SimpleRendezvousServer::FlushHeld(uint64_t now) {
+  RendezvousWorker* worker = workers_[0];
+
+  for (;;) {
+    pthread_mutex_lock(&held_lock_);
+    if (held_.empty() || held_.front().first > now) {
+      pthread_mutex_unlock(&held_lock_);
+      return;
+    }
+    NameId id = held_.front().second;
+    held_.pop_front();
+    pthread_mutex_unlock(&held_lock_);
+
+    worker->fan_out_.Clear();
+    worker->wire_fan_out_.Clear();
+
+    // A name that has since left (or lapsed) has nothing left to send
+    RegistryShard* shard = ShardFor(id);
+    pthread_mutex_lock(&shard->lock_);
+    NameRecord& record = shard->Record(id);
+    bool flush = (record.held && record.registered);
+    LogicalAddress name;
+    int address = record.address;
+    record.held = false;
+    if (flush) {
+      record.fanned_out = now;
+      name = shard->Name(id);
+      GatherSubscribers(worker, record);
+    }
+    pthread_mutex_unlock(&shard->lock_);
+
+    if (flush)
+      FanOut(worker, name, address);
   }
+}
+
+void SimpleRendezvousServer::GatherSubscribers(RendezvousWorker* worker,
+                                               const NameRecord& record) {
+  for (int i = 0; i < record.subscribers.Size(); i++)
+    (record.subscribers.Binary(i) ? worker->wire_fan_out_ : worker->fan_out_)
+      .AddTarget(record.subscribers.Endpoints()[i]);
+}
+
+bool SimpleRendezvousServer::FanOut(RendezvousWorker* worker,
+                                    const LogicalAddress& name, int address) {
+  if (worker->fan_out_.Size() + worker->wire_fan_out_.Size() == 0)
+    return true;
 
+  // Send out the actual update to every subscriber at once (per protocol)
+  PhysicalAddress location = IntToIPString(address);
+  Log(stderr, WARNING, "Sending update of %s<%s> to %d subscribers",
+      name.c_str(), location.c_str(),
+      worker->fan_out_.Size() + worker->wire_fan_out_.Size());
+
+  char update[MIN_WIRE_MESSAGE + MAX_WIRE_NAME];
+  WireWriter writer(update, sizeof(update));
+  writer.Append(WIRE_UPDATE, 0, 0, name, "", address);
+
+  // Text updates name who moved after the location (and its terminator) so
+  // that one subscriber socket can follow many nodes
+  NetworkMsg text_update = location;
+  text_update.push_back('\0');
+  text_update.append(name);
+#ifdef UDP_APPLICATION
+  if (worker->fan_out_.Size() > 0)
+    worker->fan_out_.Send(worker->update_socket_, text_update.data(),
+                          text_update.length());
+  if (worker->wire_fan_out_.Size() > 0 && writer.Length() > 0)
+    worker->wire_fan_out_.Send(worker->update_socket_, update,
+                               writer.Length());
+#elif TCP_APPLICATION
+  return false;
+#endif
   return true;
 }
 
-PhysicalAddress SimpleRendezvousServer::ChangeSubscription(
+PhysicalAddress SimpleRendezvousServer::Subscribe(
+    pair<LogicalAddress, unsigned short> subscriber,
+    LogicalAddress client) {
+  int address;
+  if (!SetSubscription(subscriber.first, subscriber.second, client, false,
+                       true, &address))
+    return "";
+  return IntToIPString(address);
+}
+
+PhysicalAddress SimpleRendezvousServer::Unsubscribe(
     pair<LogicalAddress, unsigned short> subscriber,
     LogicalAddress client) {
-  if (registered_names_.count(client) > 0) {
-    if (subscriptions_[client].find(subscriber) == subscriptions_[client].end())
-      subscriptions_[client].insert(subscriber);
+  int address;
+  SetSubscription(subscriber.first, subscriber.second, client, false, false,
+                  &address);
+  return (address == 0 ? "" : IntToIPString(address));
+}
+
+bool SimpleRendezvousServer::SetSubscription(
+    const LogicalAddress& subscriber, unsigned short port,
+    const LogicalAddress& client, bool binary, bool subscribe, int* address) {
+  RegistryShard* shard = ShardFor(client);
+  RegistryShard* subscriber_shard = ShardFor(subscriber);
+
+  // Only registered names can be subscribed to (and we intern nothing if not)
+  pthread_mutex_lock(&shard->lock_);
+  NameId client_id = Promote(shard, client);
+  bool registered = (client_id != INVALID_NAME_ID &&
+                     shard->Record(client_id).registered);
+  *address = (registered ? shard->Record(client_id).address : 0);
+  pthread_mutex_unlock(&shard->lock_);
+  if (subscribe && !registered)
+    return false;
+  if (client_id == INVALID_NAME_ID)
+    return true;
+
+  // Resolve the subscriber once now instead of on every fan-out (interning
+  // it on its first subscription; a name never seen follows nothing, so
+  // there is nothing to unsubscribe it from)
+  pthread_mutex_lock(&subscriber_shard->lock_);
+  NameId subscriber_id = Promote(subscriber_shard, subscriber);
+  if (subscribe && subscriber_id == INVALID_NAME_ID)
+    subscriber_id = subscriber_shard->Intern(subscriber);
+  int subscriber_address = 0;
+  if (subscriber_id != INVALID_NAME_ID) {
+    NameRecord& subscribing = subscriber_shard->Record(subscriber_id);
+    if (subscribe)
+      RenewLease(subscriber_id, subscribing);
+    subscriber_address = subscribing.address;
+  }
+  pthread_mutex_unlock(&subscriber_shard->lock_);
+  if (subscriber_id == INVALID_NAME_ID)
+    return true;
+
+  // A repeated request finds the subscription already as asked (and renews
+  // it)
+  SubscriberId identity(subscriber_id, port);
+  uint64_t expires = (GetTime() + GLOB_LEASE_S * 1000) / LEASE_TICK_MS;
+  bool changed = false;
+
+  // Every time a lock is taken again, either name may have been forgotten
+  // (and its identifier handed to some other name) in the meantime
+  pthread_mutex_lock(&shard->lock_);
+  if (!shard->Holds(client_id, client)) {
+    pthread_mutex_unlock(&shard->lock_);
+    *address = 0;
+    return !subscribe;
+  }
+  NameRecord& record = shard->Record(client_id);
+  bool subscribed = record.subscribers.Contains(identity);
+  if (subscribe && !subscribed) {
+    record.subscribers.Add(identity, subscriber_address, expires, binary);
+    LogChange(&log_, CHANGE_SUBSCRIBE, subscriber, 0, client, port, binary);
+    changed = true;
+  } else if (subscribe) {
+    record.subscribers.Renew(identity, expires);
+  } else if (!subscribe && subscribed) {
+    record.subscribers.Remove(identity);
+    LogChange(&log_, CHANGE_UNSUBSCRIBE, subscriber, 0, client, port);
+    changed = true;
+  }
+  if (subscribe && record.subscriptions_due == 0) {
+    record.subscriptions_due = expires;
+    pthread_mutex_lock(&lease_lock_);
+    leases_.Schedule(SUBSCRIPTIONS_DUE | client_id, expires);
+    pthread_mutex_unlock(&lease_lock_);
+  }
+  *address = (record.registered ? record.address : 0);
+  pthread_mutex_unlock(&shard->lock_);
+  if (!changed)
+    return true;
+
+  // Keep the reverse index in step (in the subscriber's own shard), or take
+  // back the subscription if the subscriber is gone already
+  pthread_mutex_lock(&subscriber_shard->lock_);
+  if (!subscriber_shard->Holds(subscriber_id, subscriber)) {
+    pthread_mutex_unlock(&subscriber_shard->lock_);
+    if (subscribe) {
+      pthread_mutex_lock(&shard->lock_);
+      if (shard->Holds(client_id, client)) {
+        shard->Record(client_id).subscribers.Remove(identity);
+        LogChange(&log_, CHANGE_UNSUBSCRIBE, subscriber, 0, client, port);
+      }
+      pthread_mutex_unlock(&shard->lock_);
+    }
+    return true;
+  }
+  NameRecord& subscriber_record = subscriber_shard->Record(subscriber_id);
+  vector<NameId>& following = subscriber_record.following;
+  if (subscribe) {
+    following.push_back(client_id);
+  } else {
+    vector<NameId>::iterator it =
+      std::find(following.begin(), following.end(), client_id);
+    if (it != following.end()) {
+      *it = following.back();
+      following.pop_back();
+    }
+  }
+  int current_address = subscriber_record.address;
+  pthread_mutex_unlock(&subscriber_shard->lock_);
+
+  // The subscriber may have moved while we were adding it
+  if (subscribe && current_address != subscriber_address) {
+    pthread_mutex_lock(&shard->lock_);
+    if (shard->Holds(client_id, client))
+      shard->Record(client_id).subscribers.Patch(subscriber_id,
+                                                 current_address);
+    pthread_mutex_unlock(&shard->lock_);
+  }
+
+  return true;
+}
+
+void SimpleRendezvousServer::RenewLease(NameId id, NameRecord& record) {
+  record.expires = (GetTime() + GLOB_LEASE_S * 1000) / LEASE_TICK_MS;
+  if (record.leased)
+    return;
+
+  record.leased = true;
+  pthread_mutex_lock(&lease_lock_);
+  leases_.Schedule(id, record.expires);
+  pthread_mutex_unlock(&lease_lock_);
+}
+
+void SimpleRendezvousServer::ExpireLeases(uint64_t now) {
+  uint64_t tick = now / LEASE_TICK_MS;
+  vector<uint64_t> expired;
+  pthread_mutex_lock(&lease_lock_);
+  leases_.Advance(tick, &expired);
+  pthread_mutex_unlock(&lease_lock_);
+  if (expired.empty())
+    return;
+
+  vector<NameId> lapsed[REGISTRY_SHARDS], due[REGISTRY_SHARDS];
+  for (unsigned int i = 0; i < expired.size(); i++) {
+    NameId id = static_cast<NameId>(expired[i]);
+    if (expired[i] & SUBSCRIPTIONS_DUE)
+      due[id & (REGISTRY_SHARDS - 1)].push_back(id);
+    else
+      lapsed[id & (REGISTRY_SHARDS - 1)].push_back(id);
+  }
+  vector<LapsedSubscription> ended[REGISTRY_SHARDS];
+  LapseSubscriptions(tick, due, ended);
+  Unfollow(ended);
+
+  // Every shard is locked once for all of its lapsed names...
+  vector<Subscription> subscriptions[REGISTRY_SHARDS];
+  int count = 0;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (lapsed[i].empty())
+      continue;
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < lapsed[i].size(); j++) {
+      NameRecord& record = shards_[i].Record(lapsed[i][j]);
+
+      // Renewed since it went on the wheel, so it goes straight back on
+      if (record.expires > tick) {
+        pthread_mutex_lock(&lease_lock_);
+        leases_.Schedule(lapsed[i][j], record.expires);
+        pthread_mutex_unlock(&lease_lock_);
+        lapsed[i][j] = INVALID_NAME_ID;
+        continue;
+      }
+
+      record.leased = false;
+      LogChange(&log_, CHANGE_DEREGISTER, shards_[i].Name(lapsed[i][j]));
+      Unregister(lapsed[i][j], record, subscriptions);
+      count++;
+    }
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+
+  // ...once more for the names they followed...
+  DropSubscriptions(subscriptions);
+
+  // ...and a last time to forget whichever of them nothing refers to now
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (lapsed[i].empty())
+      continue;
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < lapsed[i].size(); j++)
+      if (lapsed[i][j] != INVALID_NAME_ID)
+        shards_[i].ForgetIfUnused(lapsed[i][j]);
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+
+  if (count > 0)
+    Log(stderr, DEBUG, "Expired %d lapsed leases", count);
+}
+
+void SimpleRendezvousServer::LapseSubscriptions(
+    uint64_t tick, vector<NameId>* due, vector<LapsedSubscription>* ended) {
+  // Every shard is locked once for all of its names' lapsed subscriptions,
+  // each logged before the lock is let go so that no subscribing again can
+  // reach the log ahead of it
+  int count = 0;
+  vector<SubscriberId> lapsed;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (due[i].empty())
+      continue;
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < due[i].size(); j++) {
+      // Some other hand on the wheel is (or was) due for this name instead
+      NameRecord& record = shards_[i].Record(due[i][j]);
+      if (record.subscriptions_due == 0 || record.subscriptions_due > tick)
+        continue;
+
+      lapsed.clear();
+      record.subscriptions_due = record.subscribers.Lapse(tick, &lapsed);
+      if (record.subscriptions_due != 0) {
+        pthread_mutex_lock(&lease_lock_);
+        leases_.Schedule(SUBSCRIPTIONS_DUE | due[i][j],
+                         record.subscriptions_due);
+        pthread_mutex_unlock(&lease_lock_);
+      }
+
+      // A subscriber's shard is only ever locked inside the shard of a name
+      // it follows (here and below), and nothing else holds two shard locks
+      const LogicalAddress& name = shards_[i].Name(due[i][j]);
+      for (unsigned int k = 0; k < lapsed.size(); k++) {
+        RegistryShard* subscriber_shard = ShardFor(lapsed[k].first);
+        if (subscriber_shard != &shards_[i])
+          pthread_mutex_lock(&subscriber_shard->lock_);
+        LogChange(&log_, CHANGE_UNSUBSCRIBE,
+                  subscriber_shard->Name(lapsed[k].first), 0, name,
+                  lapsed[k].second);
+        if (subscriber_shard != &shards_[i])
+          pthread_mutex_unlock(&subscriber_shard->lock_);
+
+        ended[i].push_back(LapsedSubscription(due[i][j], name, lapsed[k]));
+        count++;
+      }
+      shards_[i].ForgetIfUnused(due[i][j]);
+    }
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+
+  if (count > 0)
+    Log(stderr, DEBUG, "Expired %d lapsed subscriptions", count);
+}
+
+void SimpleRendezvousServer::Unfollow(vector<LapsedSubscription>* ended) {
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (ended[i].empty())
+      continue;
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < ended[i].size(); j++) {
+      // Subscribing again since has put (or is about to put) the name back
+      // into the subscriber's reverse index, so the old entry stands for it
+      const LapsedSubscription& lapsed = ended[i][j];
+      if (shards_[i].Holds(lapsed.followed, lapsed.name) &&
+          shards_[i].Record(lapsed.followed).subscribers.Contains(
+            lapsed.subscriber))
+        continue;
+
+      RegistryShard* subscriber_shard = ShardFor(lapsed.subscriber.first);
+      if (subscriber_shard != &shards_[i])
+        pthread_mutex_lock(&subscriber_shard->lock_);
+      vector<NameId>& following =
+        subscriber_shard->Record(lapsed.subscriber.first).following;
+      vector<NameId>::iterator it = std::find(following.begin(),
+                                              following.end(),
+                                              lapsed.followed);
+      if (it != following.end()) {
+        *it = following.back();
+        following.pop_back();
+      }
+      subscriber_shard->ForgetIfUnused(lapsed.subscriber.first);
+      if (subscriber_shard != &shards_[i])
+        pthread_mutex_unlock(&subscriber_shard->lock_);
+    }
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+}
+
+int SimpleRendezvousServer::Deregister(const vector<LogicalAddress>& names) {
+  vector<int> departed[REGISTRY_SHARDS];
+  for (unsigned int i = 0; i < names.size(); i++)
+    departed[ShardFor(names[i]) - shards_].push_back(i);
+
+  vector<Subscription> subscriptions[REGISTRY_SHARDS];
+  int count = 0;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (departed[i].empty())
+      continue;
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < departed[i].size(); j++) {
+      NameId id = Promote(&shards_[i], names[departed[i][j]]);
+      if (id == INVALID_NAME_ID)
+        continue;
+
+      // The record itself goes once the wheel gets to it
+      NameRecord& record = shards_[i].Record(id);
+      if (record.registered)
+        count++;
+      record.expires = 0;
+      LogChange(&log_, CHANGE_DEREGISTER, names[departed[i][j]]);
+      Unregister(id, record, subscriptions);
+    }
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+
+  DropSubscriptions(subscriptions);
+  return count;
+}
+
+void SimpleRendezvousServer::Unregister(NameId id, NameRecord& record,
+                                        vector<Subscription>* subscriptions) {
+  record.registered = false;
+  record.address = 0;
+  for (unsigned int i = 0; i < record.following.size(); i++) {
+    NameId followed = record.following[i];
+    subscriptions[followed & (REGISTRY_SHARDS - 1)].push_back(
+      Subscription(followed, id));
+  }
+  record.following.clear();
+}
+
+void SimpleRendezvousServer::DropSubscriptions(
+    vector<Subscription>* subscriptions) {
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (subscriptions[i].empty())
+      continue;
+
+    // A name is followed once per subscribed port but need only be cut once
+    vector<Subscription>& dropped = subscriptions[i];
+    std::sort(dropped.begin(), dropped.end());
+    dropped.erase(std::unique(dropped.begin(), dropped.end()), dropped.end());
+
+    pthread_mutex_lock(&shards_[i].lock_);
+    for (unsigned int j = 0; j < dropped.size(); j++) {
+      shards_[i].Record(dropped[j].first).subscribers.RemoveAll(
+        dropped[j].second);
+      shards_[i].ForgetIfUnused(dropped[j].first);
+    }
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+}
+
+bool SimpleRendezvousServer::Recover() {
+  if (state_dir_.empty())
+    return true;
+  mkdir(state_dir_.c_str(), 0755);
+
+  // The snapshot says which log it is followed by...
+  uint64_t start = GetTime();
+  generation_ = snapshot_generation_ = 0;
+  int records = RecordLog::Replay(SnapshotPath(), this);
+  if (records < 0)
+    records = 0;
+
+  // ...and each log is followed by the next, until there are no more
+  uint64_t log_bytes = 0;
+  for (;;) {
+    int replayed = RecordLog::Replay(LogPath(generation_), this);
+    if (replayed < 0)
+      break;
+
+    struct stat status;
+    if (stat(LogPath(generation_).c_str(), &status) == 0)
+      log_bytes += status.st_size;
+    records += replayed;
+    generation_++;
+  }
+
+  Log(stderr, SUCCESS, "Recovered %d registry changes (and %d registrations "
+      "to serve in place) in %d ms", records, snapshot_names_.Size(),
+      static_cast<int>(GetTime() - start));
+
+  // A crash in the middle of a snapshot may have left behind logs (and
+  // tables) that it replaced, or a table for a snapshot that never landed
+  DIR* directory = opendir(state_dir_.c_str());
+  for (struct dirent* entry; directory != NULL &&
+                             (entry = readdir(directory)) != NULL; ) {
+    uint32_t generation;
+    if ((sscanf(entry->d_name, "registry.log.%u", &generation) == 1 &&
+         generation < snapshot_generation_) ||
+        (sscanf(entry->d_name, "registry.names.%u", &generation) == 1 &&
+         generation != snapshot_generation_))
+      unlink((state_dir_ + "/" + entry->d_name).c_str());
+  }
+  if (directory != NULL)
+    closedir(directory);
+
+  // The last log may end in a torn record, so we never append to it.  The
+  // registry is only snapshotted again (which costs as much as the snapshot
+  // we just skipped reading) once the logs have grown long.
+  if (!log_.Open(LogPath(generation_)))
+    return false;
+  return (log_bytes < WAL_SNAPSHOT_BYTES || Snapshot());
+}
+
+NameId SimpleRendezvousServer::Promote(RegistryShard* shard,
+                                       const LogicalAddress& name) {
+  NameId id = shard->Find(name);
+  if (id != INVALID_NAME_ID || shard->snapshot_ == NULL)
+    return id;
+
+  int entry = shard->snapshot_->Find(name);
+  if (entry < 0 || promoted_[entry])
+    return INVALID_NAME_ID;
+
+  // From here on the shard's record is the only one that counts
+  promoted_[entry] = true;
+  id = shard->Intern(name);
+  NameRecord& record = shard->Record(id);
+  record.registered = true;
+  record.address = shard->snapshot_->Address(entry);
+  record.leased = true;
+  record.expires = snapshot_expires_;
+  pthread_mutex_lock(&lease_lock_);
+  leases_.Schedule(id, record.expires);
+  pthread_mutex_unlock(&lease_lock_);
+  return id;
+}
+
+bool SimpleRendezvousServer::MapSnapshot() {
+  if (!snapshot_names_.Open(NamesPath(generation_)) ||
+      snapshot_names_.Tag() != generation_) {
+    snapshot_names_.Close();
+    return false;
+  }
+
+  // Everything in the table has a lease from now, like every other name (and
+  // is in the filter the table built as it was mapped, until it lapses)
+  promoted_.assign(snapshot_names_.Size(), false);
+  snapshot_expires_ = (GetTime() + GLOB_LEASE_S * 1000) / LEASE_TICK_MS;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    pthread_mutex_lock(&shards_[i].lock_);
+    shards_[i].snapshot_ = &snapshot_names_;
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+  return true;
+}
+
+void SimpleRendezvousServer::LapseSnapshot() {
+  // Once no shard serves from the table, nothing else can touch it
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    pthread_mutex_lock(&shards_[i].lock_);
+    shards_[i].snapshot_ = NULL;
+    pthread_mutex_unlock(&shards_[i].lock_);
+  }
+
+  int lapsed = std::count(promoted_.begin(), promoted_.end(), false);
+  snapshot_names_.Close();
+  vector<char>().swap(promoted_);
+  Log(stderr, DEBUG, "Expired %d registrations not renewed since the restart",
+      lapsed);
+
+  // The table would bring them back if we restarted from it
+  if (lapsed > 0 && log_.IsOpen() && !Snapshot())
+    Log(stderr, ERROR, "Could not snapshot the RS registry");
+}
+
+void SimpleRendezvousServer::RestoreAddress(const LogicalAddress& name,
+                                            int address) {
+  RegistryShard* shard = ShardFor(name);
+
+  pthread_mutex_lock(&shard->lock_);
+  NameId id = Promote(shard, name);
+  if (id == INVALID_NAME_ID)
+    id = shard->Intern(name);
+  NameRecord& record = shard->Record(id);
+  RenewLease(id, record);
+  record.registered = true;
+  record.address = address;
+  pthread_mutex_unlock(&shard->lock_);
+
+  PatchSubscriber(id, address);
+}
+
+void SimpleRendezvousServer::HandleRecord(uint8_t type, const char* data,
+                                          int length) {
+  // Every record is laid out the same way, whatever it is
+  uint16_t name_length, target_length;
+  if (length < 2)
+    return;
+  memcpy(&name_length, data, 2);
+  if (length < 4 + name_length)
+    return;
+  memcpy(&target_length, data + 2 + name_length, 2);
+  if (length != 11 + name_length + target_length)
+    return;
+
+  LogicalAddress name(data + 2, name_length);
+  LogicalAddress target(data + 4 + name_length, target_length);
+  const char* fields = data + 4 + name_length + target_length;
+  int address;
+  unsigned short port;
+  memcpy(&address, fields, 4);
+  memcpy(&port, fields + 4, 2);
+  bool binary = (fields[6] != 0);
+
+  int current;
+  switch (type) {
+    case CHANGE_GENERATION:
+      generation_ = snapshot_generation_ = address;
+      if (!MapSnapshot())
+        Log(stderr, ERROR, "Could not map the registrations of snapshot %u",
+            generation_);
+      break;
+    case CHANGE_REGISTER:
+      RestoreAddress(name, address);
+      break;
+    case CHANGE_DEREGISTER:
+      Deregister(vector<LogicalAddress>(1, name));
+      break;
+    case CHANGE_SUBSCRIBE:
+    case CHANGE_UNSUBSCRIBE:
+      SetSubscription(name, port, target, binary, (type == CHANGE_SUBSCRIBE),
+                      &current);
+      break;
+  }
+}
+
+void SimpleRendezvousServer::LogChange(RecordLog* log, RegistryChange change,
+                                       const LogicalAddress& name,
+                                       int address,
+                                       const LogicalAddress& target,
+                                       unsigned short port, bool binary) {
+  if (!log->IsOpen())
+    return;
+
+  uint16_t name_length = name.length(), target_length = target.length();
+  string record;
+  record.reserve(11 + name_length + target_length);
+  record.append(reinterpret_cast<char*>(&name_length), 2);
+  record.append(name);
+  record.append(reinterpret_cast<char*>(&target_length), 2);
+  record.append(target);
+  record.append(reinterpret_cast<char*>(&address), 4);
+  record.append(reinterpret_cast<char*>(&port), 2);
+  record.push_back(binary ? 1 : 0);
+  log->Append(change, record.data(), record.length());
+}
+
+void SimpleRendezvousServer::CommitLog(uint64_t now) {
+  if (snapshot_names_.IsOpen() && now / LEASE_TICK_MS >= snapshot_expires_)
+    LapseSnapshot();
+
+  if (!log_.Commit())
+    Log(stderr, ERROR, "Could not commit the RS log");
+  if (log_.Bytes() >= WAL_SNAPSHOT_BYTES && !Snapshot())
+    Log(stderr, ERROR, "Could not snapshot the RS registry");
+}
+
+bool SimpleRendezvousServer::Snapshot() {
+  // Everything from here on goes to a new log, which the snapshot precedes
+  // (and only once the current one is whole, or the snapshot would follow a
+  // log missing its tail)
+  uint64_t start = GetTime();
+  if (!log_.Rotate(LogPath(generation_ + 1)))
+    return false;
+  generation_++;
+
+  RecordLog snapshot;
+  string temporary = SnapshotPath() + ".tmp";
+  if (!snapshot.Open(temporary, true))
+    return false;
+  LogChange(&snapshot, CHANGE_GENERATION, "", generation_);
+
+  // The names still only in the table we restarted from are sorted by shard
+  // (this, like LapseSnapshot(), only ever runs on the persister)...
+  vector<int> unpromoted[REGISTRY_SHARDS];
+  for (int i = 0; i < snapshot_names_.Size(); i++)
+    unpromoted[ShardFor(snapshot_names_.Name(i)) - shards_].push_back(i);
+
+  // ...so that every registration can be gathered a shard at a time (along
+  // with who is subscribed to it)...
+  typedef pair<LogicalAddress, pair<SubscriberId, bool> > Subscribed;
+  vector<Subscribed> subscribed[REGISTRY_SHARDS];
+  vector< pair<LogicalAddress, int> > registered;
+  int subscriptions = 0;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    RegistryShard& shard = shards_[i];
+    pthread_mutex_lock(&shard.lock_);
+    for (unsigned int j = 0; shard.snapshot_ != NULL &&
+                             j < unpromoted[i].size(); j++) {
+      int entry = unpromoted[i][j];
+      if (!promoted_[entry])
+        registered.push_back(pair<LogicalAddress, int>(
+          snapshot_names_.Name(entry), snapshot_names_.Address(entry)));
+    }
+
+    for (NameId id = i; id < shard.End(); id += REGISTRY_SHARDS) {
+      if (!shard.Interned(id))
+        continue;
+
+      const NameRecord& record = shard.Record(id);
+      if (record.registered)
+        registered.push_back(pair<LogicalAddress, int>(shard.Name(id),
+                                                       record.address));
+
+      const vector<SubscriberId>& subscribers =
+        record.subscribers.Identities();
+      for (unsigned int j = 0; j < subscribers.size(); j++)
+        subscribed[subscribers[j].first & (REGISTRY_SHARDS - 1)].push_back(
+          Subscribed(shard.Name(id), pair<SubscriberId, bool>(
+            subscribers[j], record.subscribers.Binary(j))));
+    }
+    pthread_mutex_unlock(&shard.lock_);
+  }
+
+  // ...into a table of their own, which must be whole before the snapshot
+  // that refers to it is...
+  int registrations = registered.size();
+  if (!MappedTable::Write(NamesPath(generation_), &registered, generation_))
+    return false;
+
+  // ...then every subscription, once the subscriber's shard names it
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    if (subscribed[i].empty())
+      continue;
+
+    RegistryShard& shard = shards_[i];
+    pthread_mutex_lock(&shard.lock_);
+    for (unsigned int j = 0; j < subscribed[i].size(); j++) {
+      const SubscriberId& subscriber = subscribed[i][j].second.first;
+      if (!shard.Interned(subscriber.first))
+        continue;
+
+      LogChange(&snapshot, CHANGE_SUBSCRIBE, shard.Name(subscriber.first), 0,
+                subscribed[i][j].first, subscriber.second,
+                subscribed[i][j].second.second);
+      subscriptions++;
+    }
+    pthread_mutex_unlock(&shard.lock_);
+  }
+
+  if (!snapshot.Commit())
+    return false;
+  snapshot.Close();
+  if (rename(temporary.c_str(), SnapshotPath().c_str()) != 0)
+    return false;
+  int directory = open(state_dir_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (directory >= 0) {
+    fsync(directory);
+    close(directory);
+  }
+
+  // The logs (and tables) the new snapshot replaces are no longer needed
+  for (uint32_t i = snapshot_generation_; i < generation_; i++) {
+    unlink(LogPath(i).c_str());
+    unlink(NamesPath(i).c_str());
+  }
+  snapshot_generation_ = generation_;
+
+  Log(stderr, SUCCESS, "Snapshot of %d registrations and %d subscriptions "
+      "written in %d ms", registrations, subscriptions,
+      static_cast<int>(GetTime() - start));
+  return true;
+}
+
+string SimpleRendezvousServer::LogPath(uint32_t generation) const {
+  char path[32];
+  snprintf(path, sizeof(path), "/registry.log.%u", generation);
+  return state_dir_ + path;
+}
+
+string SimpleRendezvousServer::NamesPath(uint32_t generation) const {
+  char path[32];
+  snprintf(path, sizeof(path), "/registry.names.%u", generation);
+  return state_dir_ + path;
+}
+
+string SimpleRendezvousServer::SnapshotPath() const {
+  return state_dir_ + "/registry.snapshot";
+}
+
+bool SubscriberList::Contains(const SubscriberId& subscriber) const {
+  return Position(subscriber) >= 0;
+}
+
+void SubscriberList::Add(const SubscriberId& subscriber, int address,
+                         uint64_t expires, bool binary) {
+  struct sockaddr_in endpoint;
+  memset(&endpoint, 0, sizeof(endpoint));
+  endpoint.sin_family = GLOB_DOM;
+  endpoint.sin_addr.s_addr = address;
+  endpoint.sin_port = subscriber.second;
+
+  positions_[Key(subscriber)] = subscribers_.size();
+  subscribers_.push_back(subscriber);
+  endpoints_.push_back(endpoint);
+  binary_.push_back(binary);
+  expires_.push_back(expires);
+}
+
+void SubscriberList::Renew(const SubscriberId& subscriber, uint64_t expires) {
+  int i = Position(subscriber);
+  if (i >= 0)
+    expires_[i] = expires;
+}
+
+uint64_t SubscriberList::Lapse(uint64_t tick, vector<SubscriberId>* lapsed) {
+  uint64_t next = 0;
+  for (unsigned int i = 0; i < subscribers_.size();) {
+    if (expires_[i] <= tick) {
+      lapsed->push_back(subscribers_[i]);
+      Erase(i);
+    } else {
+      if (next == 0 || expires_[i] < next)
+        next = expires_[i];
+      i++;
+    }
+  }
+  return next;
+}
+
+void SubscriberList::Remove(const SubscriberId& subscriber) {
+  int i = Position(subscriber);
+  if (i >= 0)
+    Erase(i);
+}
+
+void SubscriberList::RemoveAll(NameId name) {
+  for (unsigned int i = 0; i < subscribers_.size();) {
+    if (subscribers_[i].first == name)
+      Erase(i);
     else
-      subscriptions_[client].erase(subscriber);
+      i++;
   }
+}
+
+void SubscriberList::Erase(int i) {
+  positions_.erase(Key(subscribers_[i]));
+  if (i + 1 < static_cast<int>(subscribers_.size()))
+    positions_[Key(subscribers_.back())] = i;
+
+  subscribers_[i] = subscribers_.back();
+  endpoints_[i] = endpoints_.back();
+  binary_[i] = binary_.back();
+  expires_[i] = expires_.back();
+  subscribers_.pop_back();
+  endpoints_.pop_back();
+  binary_.pop_back();
+  expires_.pop_back();
+}
 
-  return (registered_names_.count(client) > 0 ? registered_names_[client] : "");
+void SubscriberList::Patch(NameId name, int address) {
+  for (unsigned int i = 0; i < subscribers_.size(); i++)
+    if (subscribers_[i].first == name)
+      endpoints_[i].sin_addr.s_addr = address;
 }
@@ -13,53 +13,663 @@
 
 #include <gtest/gtest.h>
 #include <tr1/unordered_map>
+#include <tr1/functional>
+#include <pthread.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 
 #include <cassert>
 #include <cstdarg>
+#include <algorithm>
+#include <deque>
 #include <set>
 #include <utility>
+#include <vector>
 
+#include "Common/DatagramBatch.h"
+#include "Common/DatagramFanOut.h"
+#include "Common/EventLoop.h"
+#include "Common/MappedTable.h"
+#include "Common/NameTable.h"
+#include "Common/RecordLog.h"
 #include "Common/Utils.h"
 #include "Common/Signal.h"
+#include "Common/TimingWheel.h"
+#include "Common/WireProtocol.h"
 #include "RendezvousServer/RendezvousServer.h"
 
 using Utils::Die;
 using Utils::Log;
 using Utils::IntToIPString;
 using Utils::IPStringToInt;
+using Utils::GetTime;
 
 using std::tr1::unordered_map;
+using std::tr1::hash;
+using std::deque;
 using std::set;
 using std::pair;
+using std::vector;
 
-class SimpleRendezvousServer : public RendezvousServer {
+/**
+ * The registry is split into @ref REGISTRY_SHARDS independently locked shards
+ * (by hash of the logical address) so that workers rarely contend.  The low
+ * @ref REGISTRY_SHARD_BITS of every interned name's identifier say which shard
+ * it lives in.
+ **/
+#define REGISTRY_SHARD_BITS 6
+#define REGISTRY_SHARDS (1 << REGISTRY_SHARD_BITS)
+
+/**
+ * By default the RS runs a single worker on the thread that calls Start()
+ **/
+#define GLOB_RS_WORKERS 1
+
+/**
+ * Leases are kept in ticks of @ref LEASE_TICK_MS milliseconds, and the first
+ * worker expires whatever has lapsed once every tick
+ **/
+#define LEASE_TICK_MS 1000
+
+/**
+ * Each subscription holds a lease of its own (renewed by subscribing again),
+ * and the subscriptions of a name go on the lease wheel under the name's
+ * identifier with @ref SUBSCRIPTIONS_DUE set
+ **/
+#define SUBSCRIPTIONS_DUE (static_cast<uint64_t>(1) << 63)
+
+/**
+ * A name that moves again within @ref GLOB_COALESCE_MS of its last fan-out
+ * has its update held back, and only its latest address is sent once the
+ * window is up (a window of 0 turns this off).  Held updates are flushed
+ * @ref COALESCE_TICKS times a window, so none waits for more than a window
+ * and a tick.
+ **/
+#define GLOB_COALESCE_MS 0
+#define COALESCE_TICKS 4
+
+/**
+ * Given a state directory (by default, @ref GLOB_RS_STATE_DIR, there is none)
+ * the RS logs every change to its registry, commits the log (making every
+ * change since the last commit durable at once) every @ref WAL_COMMIT_MS, and
+ * writes a compact snapshot (starting a fresh log) whenever the log grows past
+ * @ref WAL_SNAPSHOT_BYTES, both on a thread of its own.  It recovers from them
+ * when it starts.
+ *
+ * A snapshot keeps every registration in a MappedTable, which a restarted RS
+ * answers lookups from straight away; a name is only brought into the
+ * registry proper the first time it changes.  Names that are not renewed
+ * within a lease of the restart lapse along with the table.
+ **/
+#define GLOB_RS_STATE_DIR ""
+#define WAL_COMMIT_MS 10
+#define WAL_SNAPSHOT_BYTES (64 * 1024 * 1024)
+
+/**
+ * @enum RegistryChange
+ *
+ * The kinds of record in the RS log (and snapshot), each of which may be
+ * replayed any number of times with the same result
+ **/
+enum RegistryChange {
+  CHANGE_GENERATION = 1,  // address: the first log a snapshot is followed by
+                          // (and the table of registrations it comes with)
+  CHANGE_REGISTER = 2,    // name: node, address: where it registered from
+  CHANGE_DEREGISTER = 3,  // name: node that left (or lapsed)
+  CHANGE_SUBSCRIBE = 4,   // name: subscriber, port, binary, target: subscribee
+  CHANGE_UNSUBSCRIBE = 5, // name: subscriber, port, target: subscribee
+};
+
+class SimpleRendezvousServer;
+
+/**
+ * Each worker of the RS owns its own pair of SO_REUSEPORT listeners, event
+ * loop and datagram batch, so that workers share nothing but the registry.
+ **/
+class RendezvousWorker : public EventHandler {
+ public:
+  /**
+   * The constructor simply records which server we work for
+   *
+   * @param     server          The RS whose registry this worker serves
+   * @param     batch_size      The most requests to read per system call
+   **/
+  RendezvousWorker(SimpleRendezvousServer* server, int batch_size) :
+    server_(server), batch_(batch_size), registration_listener_(-1),
+    lookup_listener_(-1), update_socket_(-1), lease_timer_(-1),
+    flush_timer_(-1), commit_timer_(-1) {}
+
+  /**
+   * The worker closes the update socket it was given by the server
+   **/
+  virtual ~RendezvousWorker() {
+    if (update_socket_ >= 0)
+      close(update_socket_);
+  }
+
+  /**
+   * The event loop calls back HandleEvent() whenever one of our listeners
+   * becomes readable, and we dispatch to the server's HandleRequests() (or,
+   * when one of its timers fires, to its ExpireLeases(), FlushHeld() or
+   * CommitLog())
+   **/
+  virtual bool HandleEvent(int fd);
+
+  /**
+   * Run() sleeps on the worker's event loop until it is stopped
+   *
+   * @returns   True always
+   **/
+  bool Run();
+
+ private:
+  /**
+   * The server that owns this worker...
+   **/
+  SimpleRendezvousServer* server_;
+
+  /**
+   * ...the reactor this worker sleeps on...
+   **/
+  EventLoop event_loop_;
+
+  /**
+   * ...the batch of datagrams this worker reads into...
+   **/
+  DatagramBatch batch_;
+
+  /**
+   * ...and its own sockets bound (with SO_REUSEPORT) to the shared ports
+   **/
+  int registration_listener_;
+  int lookup_listener_;
+
+  /**
+   * Location updates go out over a single long-lived (blocking) socket per
+   * worker, a whole set of subscribers (of each protocol) at a time
+   **/
+  int update_socket_;
+  DatagramFanOut fan_out_;
+  DatagramFanOut wire_fan_out_;
+
+  /**
+   * The timers that expire leases and flush held updates (only the first
+   * worker has them) and that commit the log (only the persister has it)
+   **/
+  int lease_timer_;
+  int flush_timer_;
+  int commit_timer_;
+
+  /**
+   * Reusable strings to look up the names in binary requests with
+   **/
+  LogicalAddress name_;
+  LogicalAddress target_;
+
+  /**
+   * The names deregistered by the binary datagram being answered, which are
+   * dropped all at once after it has been read
+   **/
+  vector<LogicalAddress> departures_;
+
+  /**
+   * The thread running this worker (unused for the first worker, which runs
+   * on the thread that called Start())
+   **/
+  pthread_t thread_;
+
+  friend class SimpleRendezvousServer;
+};
+
+/**
+ * Subscribers are identified by the (interned) logical-address|port
+ * combination they looked us up from
+ **/
+typedef pair<NameId, unsigned short> SubscriberId;
+
+/**
+ * A subscription as seen from the reverse index: the name followed and the
+ * name following it
+ **/
+typedef pair<NameId, NameId> Subscription;
+
+/**
+ * A subscription that has lapsed, along with the name it followed (whose
+ * identifier may be handed to some other name once it is forgotten)
+ **/
+struct LapsedSubscription {
+  LapsedSubscription(NameId followed, const LogicalAddress& name,
+                     const SubscriberId& subscriber)
+      : followed(followed), name(name), subscriber(subscriber) {}
+
+  NameId followed;
+  LogicalAddress name;
+  SubscriberId subscriber;
+};
+
+/**
+ * A SubscriberList keeps everyone subscribed to one logical address along with
+ * a parallel, contiguous array of their already resolved endpoints so that a
+ * fan-out is a straight copy with no hashing or string parsing.
+ **/
+class SubscriberList {
+ public:
+  SubscriberList() {}
+  virtual ~SubscriberList() {}
+
+  /**
+   * @param     subscriber      The subscriber to search for
+   * @returns   True if subscriber is in the list
+   **/
+  bool Contains(const SubscriberId& subscriber) const;
+
+  /**
+   * Add() appends a subscriber along with the address it is reachable at
+   *
+   * @param     subscriber      The subscriber being added
+   * @param     address         The subscriber's current (binary) IP address
+   * @param     expires         The tick its subscription lapses at
+   * @param     binary          Whether the subscriber speaks the binary
+   *                            protocol (and so should be sent updates in it)
+   **/
+  void Add(const SubscriberId& subscriber, int address, uint64_t expires,
+           bool binary = false);
+
+  /**
+   * Renew() extends the subscription of a subscriber in the list
+   *
+   * @param     subscriber      The subscriber renewing
+   * @param     expires         The tick its subscription now lapses at
+   **/
+  void Renew(const SubscriberId& subscriber, uint64_t expires);
+
+  /**
+   * Lapse() takes every subscriber whose subscription has run out of the list
+   *
+   * @param     tick            The current tick
+   * @param     lapsed          Has the subscribers taken out appended to it
+   *
+   * @returns   The tick the next of the remaining subscriptions lapses at, or
+   *            0 if none remain
+   **/
+  uint64_t Lapse(uint64_t tick, vector<SubscriberId>* lapsed);
+
+  /**
+   * Remove() takes a subscriber out of the list (the last subscriber takes
+   * its slot so that the endpoints stay contiguous)
+   *
+   * @param     subscriber      The subscriber being removed
+   **/
+  void Remove(const SubscriberId& subscriber);
+
+  /**
+   * RemoveAll() takes every port of a subscriber out of the list
+   *
+   * @param     name            The subscriber being removed
+   **/
+  void RemoveAll(NameId name);
+
+  /**
+   * Patch() points every endpoint belonging to a logical address at its new
+   * physical address
+   *
+   * @param     name            The subscriber that has moved
+   * @param     address         The subscriber's new (binary) IP address
+   **/
+  void Patch(NameId name, int address);
+
+  /**
+   * @returns   The number of subscribers in the list
+   **/
+  int Size() const { return subscribers_.size(); }
+
+  /**
+   * @returns   The contiguous array of Size() resolved endpoints
+   **/
+  const struct sockaddr_in* Endpoints() const {
+    return (endpoints_.empty() ? NULL : &endpoints_[0]);
+  }
+
+  /**
+   * @param     i               The index of a subscriber in the list
+   * @returns   True if the i-th subscriber speaks the binary protocol
+   **/
+  bool Binary(int i) const { return binary_[i]; }
+
+  /**
+   * @returns   The identities of every subscriber in the list
+   **/
+  const vector<SubscriberId>& Identities() const { return subscribers_; }
+
+ private:
+  /**
+   * Who each subscriber is...
+   **/
+  vector<SubscriberId> subscribers_;
+
+  /**
+   * ...and, at the same index, where we send their updates...
+   **/
+  vector<struct sockaddr_in> endpoints_;
+
+  /**
+   * ...which protocol we send them in...
+   **/
+  vector<bool> binary_;
+
+  /**
+   * ...and the tick their subscription lapses at
+   **/
+  vector<uint64_t> expires_;
+
+  /**
+   * Where each subscriber is in the list (by Key()), so that finding one
+   * does not scan the list
+   **/
+  unordered_map<uint64_t, int> positions_;
+
+  /**
+   * @returns   The key of a subscriber in the positions_ index
+   **/
+  static uint64_t Key(const SubscriberId& subscriber) {
+    return (static_cast<uint64_t>(subscriber.first) << 16) | subscriber.second;
+  }
+
+  /**
+   * @returns   Where a subscriber is in the list, or -1 if it is not
+   **/
+  int Position(const SubscriberId& subscriber) const {
+    unordered_map<uint64_t, int>::const_iterator it =
+      positions_.find(Key(subscriber));
+    return (it == positions_.end() ? -1 : it->second);
+  }
+
+  /**
+   * Erase() takes the i-th subscriber out of the list (the last subscriber
+   * takes its slot)
+   **/
+  void Erase(int i);
+};
+
+/**
+ * Everything the registry knows about one interned logical address
+ **/
+struct NameRecord {
+  NameRecord() : registered(false), address(0), leased(false), expires(0),
+                 held(false), fanned_out(0), subscriptions_due(0) {}
+
+  /**
+   * Whether the name has registered at this RS, and if so the (binary) IP
+   * address it last registered from
+   **/
+  bool registered;
+  int address;
+
+  /**
+   * Whether the name is on the server's lease wheel, and the tick its lease
+   * really runs out at (renewing only moves this, so the wheel may hand the
+   * name back early, at which point it is put back on the wheel)
+   **/
+  bool leased;
+  uint64_t expires;
+
+  /**
+   * Whether an update of this name is being held back to be coalesced, and
+   * when (as given by GetTime()) its last update was sent out
+   **/
+  bool held;
+  uint64_t fanned_out;
+
+  /**
+   * Everyone (and their resolved endpoints) that should be sent an update
+   * whenever this name's physical address changes
+   **/
+  SubscriberList subscribers;
+
+  /**
+   * The tick the wheel next hands back the name's subscriptions at (0 if
+   * they are not on the wheel)
+   **/
+  uint64_t subscriptions_due;
+
+  /**
+   * The reverse mapping (every name this one is subscribed to, once per
+   * subscribed port) so that when it moves we can patch its cached endpoints
+   **/
+  vector<NameId> following;
+};
+
+/**
+ * A single shard of the registry.  Each shard is guarded by its own lock and
+ * holds every logical address that hashes to it.  Names are interned once
+ * and everything else in the registry refers to them by identifier.
+ **/
+class RegistryShard {
  public:
+  RegistryShard() : index_(0), snapshot_(NULL) {
+    pthread_mutex_init(&lock_, NULL);
+  }
+  ~RegistryShard() { pthread_mutex_destroy(&lock_); }
+
+ private:
   /**
-   * The constructor instantiates default member variables
+   * Find() looks up the identifier of a name in this shard (the lock must be
+   * held)
+   *
+   * @param     name            The logical address to look up
+   * @returns   The registry-wide identifier of name, or @ref INVALID_NAME_ID
    **/
-  explicit SimpleRendezvousServer() :
-    registration_port_(GLOB_REGIST_PORT), lookup_port_(GLOB_LOOKUP_PORT),
-    domain_(GLOB_DOM), transport_layer_(GLOB_TL), protocol_(GLOB_PROTO) {}
+  NameId Find(const LogicalAddress& name) const {
+    NameId local = names_.Find(name);
+    return (local == INVALID_NAME_ID ? INVALID_NAME_ID :
+            (local << REGISTRY_SHARD_BITS) | index_);
+  }
 
   /**
-   * The destructor doesn't need to free nay memory because none is aggregated
+   * Intern() looks up the identifier of a name in this shard, giving it an
+   * empty record if it is new (the lock must be held)
+   *
+   * @param     name            The logical address to intern
+   * @returns   The registry-wide identifier of name
    **/
-  virtual ~SimpleRendezvousServer() {}
+  NameId Intern(const LogicalAddress& name) {
+    NameId local = names_.Intern(name);
+    if (local == records_.size())
+      records_.push_back(NameRecord());
+    return (local << REGISTRY_SHARD_BITS) | index_;
+  }
+
+  /**
+   * @param     id              An identifier belonging to this shard
+   * @returns   The record of that name (the lock must be held)
+   **/
+  NameRecord& Record(NameId id) {
+    return records_[id >> REGISTRY_SHARD_BITS];
+  }
+
+  /**
+   * @param     id              An identifier belonging to this shard
+   * @returns   The logical address with that identifier
+   **/
+  const LogicalAddress& Name(NameId id) const {
+    return names_.Name(id >> REGISTRY_SHARD_BITS);
+  }
+
+  /**
+   * @param     id              An identifier belonging to this shard
+   * @returns   True unless the name has been forgotten (the lock must be held)
+   **/
+  bool Interned(NameId id) const {
+    NameId local = id >> REGISTRY_SHARD_BITS;
+    return names_.Find(names_.Name(local)) == local;
+  }
+
+  /**
+   * @param     id              An identifier belonging to this shard
+   * @param     name            The name it was handed out for
+   * @returns   True if the identifier still stands for that name (it may
+   *            have been forgotten and handed to another since the lock was
+   *            last held; the lock must be held)
+   **/
+  bool Holds(NameId id, const LogicalAddress& name) const {
+    return Interned(id) && Name(id) == name;
+  }
+
+  /**
+   * @returns   One past the highest identifier in this shard (the lock must
+   *            be held)
+   **/
+  NameId End() const {
+    return (names_.Size() << REGISTRY_SHARD_BITS) | index_;
+  }
+
+  /**
+   * ForgetIfUnused() frees a name (so that its identifier and record can be
+   * reused) once it is unregistered, unleased and neither subscribed to nor
+   * subscribing to anything (the lock must be held)
+   *
+   * @param     id              An identifier belonging to this shard
+   * @returns   True if the name was forgotten
+   **/
+  bool ForgetIfUnused(NameId id) {
+    // The name may already have been forgotten (and its record cleared)
+    if (!Interned(id))
+      return false;
+
+    NameRecord& record = Record(id);
+    if (record.registered || record.leased || record.subscribers.Size() > 0 ||
+        !record.following.empty())
+      return false;
+
+    names_.Forget(id >> REGISTRY_SHARD_BITS);
+    record = NameRecord();
+    return true;
+  }
+
+  /**
+   * The lock that must be held to touch anything else in the shard
+   **/
+  pthread_mutex_t lock_;
+
+  /**
+   * Which of the server's shards this is (the low bits of every identifier)
+   **/
+  NameId index_;
+
+  /**
+   * Every logical address that hashes to this shard...
+   **/
+  NameTable names_;
+
+  /**
+   * ...and, indexed by their local identifier, what we know about them
+   **/
+  deque<NameRecord> records_;
+
+  /**
+   * The table of registrations the server was restarted from, while names
+   * of this shard may still be served out of it (NULL once it has lapsed)
+   **/
+  const MappedTable* snapshot_;
+
+  // Declare friend tests for access to private members
+  friend class SimpleRendezvousServer;
+  FRIEND_TEST(SimpleRendezvousServerTest, PatchesMovedSubscribers);
+  FRIEND_TEST(SimpleRendezvousServerTest, InternsEachNameOnce);
+  FRIEND_TEST(SimpleRendezvousServerTest, ExpiresLapsedLeases);
+  FRIEND_TEST(SimpleRendezvousServerTest, ExpiresLapsedSubscriptions);
+  FRIEND_TEST(SimpleRendezvousServerPersistenceTest, RecoversAfterRestart);
+  FRIEND_TEST(SimpleRendezvousServerPersistenceTest,
+              LogsLapsesAheadOfResubscriptions);
+};
+
+class SimpleRendezvousServer : public RendezvousServer, public RecordHandler {
+ public:
+  /**
+   * The constructor instantiates default member variables and its workers
+   *
+   * @param     batch_size      The most requests to read per system call
+   *                            (Default: @ref GLOB_BATCH_SIZE)
+   * @param     workers         The number of worker threads to serve the
+   *                            ports with (Default: @ref GLOB_RS_WORKERS)
+   * @param     coalesce_ms     The window to coalesce each name's updates
+   *                            over (Default: @ref GLOB_COALESCE_MS)
+   * @param     state_dir       Where to keep the registry's log and snapshot
+   *                            ("" to keep it in memory only, Default:
+   *                            @ref GLOB_RS_STATE_DIR)
+   **/
+  explicit SimpleRendezvousServer(int batch_size = GLOB_BATCH_SIZE,
+                                  int workers = GLOB_RS_WORKERS,
+                                  int coalesce_ms = GLOB_COALESCE_MS,
+                                  const string& state_dir = GLOB_RS_STATE_DIR);
+
+  /**
+   * The destructor frees the workers allocated by the constructor
+   **/
+  virtual ~SimpleRendezvousServer();
 
   virtual bool Start();
   virtual bool ShutDown(const char* format, ...);
 
+  /**
+   * While recovering, HandleRecord() applies every change read back from the
+   * snapshot and the logs that follow it
+   **/
+  virtual void HandleRecord(uint8_t type, const char* data, int length);
+
  protected:
   virtual bool UpdateAddress(LogicalAddress name, PhysicalAddress address);
-  virtual PhysicalAddress ChangeSubscription(
+  virtual PhysicalAddress Subscribe(
       pair<LogicalAddress, unsigned short> subscriber,
       LogicalAddress client);
+  virtual PhysicalAddress Unsubscribe(
+      pair<LogicalAddress, unsigned short> subscriber,
+      LogicalAddress client);
+  virtual PhysicalAddress LookupAddress(const LogicalAddress& name);
+
+  /**
+   * Workers update addresses through their own update socket (outside of a
+   * worker, i.e. through UpdateAddress(name, address), callers take turns on
+   * a socket of their own, which no worker ever touches)
+   *
+   * @param     worker          The worker whose socket sends the fan-out
+   * @param     name            The logical address to be updated
+   * @param     address         The new (binary) IP address to assign to name
+   *
+   * @returns   True unless the transport layer is unsupported
+   **/
+  bool UpdateAddress(RendezvousWorker* worker, const LogicalAddress& name,
+                     int address);
+
+  /**
+   * SetSubscription() is what Subscribe() and Unsubscribe() do, for
+   * subscribers of either protocol and without going through dotted IP
+   * strings.  Either way the subscription ends up as asked, however many
+   * times it is asked for.
+   *
+   * @param     subscriber      The logical address (un)subscribing
+   * @param     port            The port (in network byte order) it
+   *                            (un)subscribes from
+   * @param     client          The logical address being (un)subscribed to
+   * @param     binary          Whether the subscriber speaks the binary
+   *                            protocol
+   * @param     subscribe       Whether to subscribe (true) or unsubscribe
+   * @param     address         Set to the (binary) IP address of client, 0 if
+   *                            it has not registered
+   *
+   * @returns   False (and no change) if client has not registered and the
+   *            subscriber asked to subscribe
+   **/
+  bool SetSubscription(const LogicalAddress& subscriber, unsigned short port,
+                       const LogicalAddress& client, bool binary,
+                       bool subscribe, int* address);
 
   /**
    * We specifically want to respond to connections given to us on the specified
-   * port only.
+   * port only.  Every worker binds its own socket to the port (SO_REUSEPORT),
+   * and the kernel spreads incoming datagrams across them.
    *
    * @param     port            The port to listen for incoming requests on
    *                            (called for both listener and registration port)
@@ -69,52 +679,367 @@ class SimpleRendezvousServer : public RendezvousServer {
   int BeginListening(unsigned short port);
 
   /**
-   * We make a call to handle incoming requests on a given socket every server
-   * cycle.  We can specify whether this is the lookup or registration port
-   * via a simple boolean
+   * We make a call to handle incoming requests on a given socket whenever it
+   * becomes readable, draining every pending datagram a batch at a time (the
+   * listeners are edge-triggered).  We can specify whether this is the lookup or
+   * registration port via a simple boolean
    *
+   * @param     worker          The worker (and thus batch) doing the reading
    * @param     listener_socket The socket to poll data from
    * @param     lookup          Whether this is the lookup port (true) or the
    *                            registration port (false).
    **/
-  bool HandleRequests(int listener_socket, bool lookup);
+  bool HandleRequests(RendezvousWorker* worker, int listener_socket,
+                      bool lookup);
+
+  /**
+   * A datagram in the binary protocol may pack many requests, which are all
+   * answered (in order) by a single reply written over the datagram itself
+   *
+   * @param     worker          The worker (and thus batch) doing the reading
+   * @param     i               The index of the datagram in the batch
+   * @param     lookup          Whether this is the lookup port (true) or the
+   *                            registration port (false).
+   *
+   * @returns   The number of bytes of the reply
+   **/
+  int AnswerWireRequests(RendezvousWorker* worker, int i, bool lookup);
+
+  /**
+   * HoldUpdate() decides whether a name's update should wait for the end of
+   * its coalescing window, queueing it to be flushed if so (the name's shard
+   * lock must be held)
+   *
+   * @param     id              The name that has moved
+   * @param     record          The record of that name
+   *
+   * @returns   True if the update is (now or already) held back
+   **/
+  bool HoldUpdate(NameId id, NameRecord& record);
+
+  /**
+   * FlushHeld() sends out every held update whose window is up, each with
+   * the latest address of its name (on the first worker's update socket)
+   *
+   * @param     now             The current time (as given by GetTime())
+   **/
+  void FlushHeld(uint64_t now);
+
+  /**
+   * GatherSubscribers() loads a worker's fan-outs with the endpoints of
+   * everyone subscribed to a name (the name's shard lock must be held)
+   *
+   * @param     worker          The worker that will send the fan-out
+   * @param     record          The record of the name that has moved
+   **/
+  void GatherSubscribers(RendezvousWorker* worker, const NameRecord& record);
+
+  /**
+   * FanOut() sends the update of a name to everyone gathered by
+   * GatherSubscribers() (no locks may be held)
+   *
+   * @param     worker          The worker whose socket sends the fan-out
+   * @param     name            The logical address that has moved
+   * @param     address         Where it is now
+   *
+   * @returns   True unless the transport layer is unsupported
+   **/
+  bool FanOut(RendezvousWorker* worker, const LogicalAddress& name,
+              int address);
+
+  /**
+   * Recover() rebuilds the registry from the snapshot and the logs that
+   * follow it (if there is a state directory), then starts a new log
+   *
+   * @returns   False if the new log could not be started
+   **/
+  bool Recover();
+
+  /**
+   * Promote() looks up the identifier of a name, first bringing it into its
+   * shard (registered, with the rest of the table's lease) if it is only in
+   * the table of registrations we restarted from.  It must come before any
+   * change to a name (the lock must be held).
+   *
+   * @param     shard           The shard the name lives in
+   * @param     name            The logical address to look up
+   *
+   * @returns   The identifier of name, or @ref INVALID_NAME_ID if it is in
+   *            neither the shard nor the table
+   **/
+  NameId Promote(RegistryShard* shard, const LogicalAddress& name);
+
+  /**
+   * MapSnapshot() maps the table of registrations of the current generation
+   * and starts serving lookups from it (for recovery)
+   *
+   * @returns   False if there is no such table
+   **/
+  bool MapSnapshot();
+
+  /**
+   * LapseSnapshot() stops serving from the table of registrations, once a
+   * lease has passed since the restart, which drops every name in it that
+   * was never renewed (and snapshots the registry without them).  Like
+   * Snapshot(), it only ever runs on the persister.
+   **/
+  void LapseSnapshot();
+
+  /**
+   * RestoreAddress() is UpdateAddress() without the fan-out, for recovery
+   *
+   * @param     name            The logical address to be restored
+   * @param     address         The (binary) IP address it registered from
+   **/
+  void RestoreAddress(const LogicalAddress& name, int address);
+
+  /**
+   * LogChange() appends a change to a log (doing nothing if the log is not
+   * open, as it is not while recovering)
+   *
+   * @param     log             The log (or snapshot) to append to
+   * @param     change          What kind of change this is
+   * @param     name            The name that changed
+   * @param     address         Its (binary) IP address
+   * @param     target          The name subscribed to
+   * @param     port            The port (in network byte order) subscribed
+   *                            from
+   * @param     binary          Whether the subscriber speaks the binary
+   *                            protocol
+   **/
+  void LogChange(RecordLog* log, RegistryChange change,
+                 const LogicalAddress& name, int address = 0,
+                 const LogicalAddress& target = "", unsigned short port = 0,
+                 bool binary = false);
+
+  /**
+   * CommitLog() makes every change logged so far durable, taking a snapshot
+   * if the log has grown too long (or the table we restarted from has
+   * lapsed)
+   *
+   * @param     now             The current time (as given by GetTime())
+   **/
+  void CommitLog(uint64_t now);
+
+  /**
+   * Snapshot() starts a new log and writes out the whole registry as a
+   * snapshot that the new log follows (its registrations in a table of their
+   * own), then deletes the logs and tables it replaces.
+   * Changes made while the snapshot is written may or may not make it in,
+   * but are all in the new log anyway.
+   *
+   * @returns   False if the snapshot could not be written
+   **/
+  bool Snapshot();
+
+  /**
+   * @param     generation      Which log
+   * @returns   The path of that log...
+   **/
+  string LogPath(uint32_t generation) const;
+
+  /**
+   * ...of the table of registrations of that generation...
+   **/
+  string NamesPath(uint32_t generation) const;
+
+  /**
+   * ...and of the snapshot
+   **/
+  string SnapshotPath() const;
+
+  /**
+   * Find the shard of the registry a logical address lives in
+   *
+   * @param     name            The logical address being looked up
+   * @returns   The (unlocked) shard responsible for name
+   **/
+  RegistryShard* ShardFor(const LogicalAddress& name);
+
+  /**
+   * Find the shard of the registry an interned name lives in
+   *
+   * @param     id              The identifier of the name being looked up
+   * @returns   The (unlocked) shard responsible for id
+   **/
+  RegistryShard* ShardFor(NameId id) {
+    return &shards_[id & (REGISTRY_SHARDS - 1)];
+  }
+
+  /**
+   * Look up the last known (binary) IP address of a logical address
+   *
+   * @param     name            The logical address being looked up
+   * @returns   The address registered for name, 0 if none
+   **/
+  int RegisteredAddress(const LogicalAddress& name);
+
+  /**
+   * When a subscriber moves, every endpoint it has cached in the lists of the
+   * names it follows must be patched
+   *
+   * @param     name            The subscriber that has moved
+   * @param     address         The subscriber's new (binary) IP address
+   **/
+  void PatchSubscriber(NameId name, int address);
+
+  /**
+   * RenewLease() extends the lease of a name, putting it on the wheel if it
+   * is not already there (the name's shard lock must be held)
+   *
+   * @param     id              The name whose lease is renewed
+   * @param     record          The record of that name
+   **/
+  void RenewLease(NameId id, NameRecord& record);
+
+  /**
+   * ExpireLeases() turns the lease wheel up to the present and drops every
+   * name whose lease has run out
+   *
+   * @param     now             The current time (as given by GetTime())
+   **/
+  void ExpireLeases(uint64_t now);
+
+  /**
+   * LapseSubscriptions() ends every subscription that has not been renewed
+   * in time, among those of the names the wheel handed back, logging each
+   * while the followed name's shard is still locked (no shard locks may be
+   * held)
+   *
+   * @param     tick            The current tick
+   * @param     due             The @ref REGISTRY_SHARDS lists of names whose
+   *                            subscriptions are due, by shard
+   * @param     ended           The @ref REGISTRY_SHARDS lists the ended
+   *                            subscriptions are appended to, by the shard of
+   *                            the name followed
+   **/
+  void LapseSubscriptions(uint64_t tick, vector<NameId>* due,
+                          vector<LapsedSubscription>* ended);
+
+  /**
+   * Unfollow() takes subscriptions ended by LapseSubscriptions() out of
+   * their subscribers' reverse index, unless subscribed to again since (no
+   * shard locks may be held)
+   *
+   * @param     ended           The @ref REGISTRY_SHARDS lists of ended
+   *                            subscriptions, by the shard of the name
+   *                            followed
+   **/
+  void Unfollow(vector<LapsedSubscription>* ended);
+
+  /**
+   * Deregister() unregisters nodes that have left and ends every
+   * subscription they hold, locking each shard involved only once however
+   * many nodes leave at the same time (their records are forgotten once
+   * their leases come up)
+   *
+   * @param     names           The logical addresses that have left
+   * @returns   The number of those names that were registered
+   **/
+  int Deregister(const vector<LogicalAddress>& names);
+
+  /**
+   * Unregister() clears a name's registration and hands over everything it
+   * follows, by the shard of the name followed (the name's shard lock must be
+   * held)
+   *
+   * @param     id              The name being unregistered
+   * @param     record          The record of that name
+   * @param     subscriptions   The @ref REGISTRY_SHARDS lists to add the
+   *                            name's subscriptions to
+   **/
+  void Unregister(NameId id, NameRecord& record,
+                  vector<Subscription>* subscriptions);
+
+  /**
+   * DropSubscriptions() ends many subscriptions at once through the reverse
+   * index, so the cost is proportional to the subscriptions dropped rather
+   * than to the size of the registry (no shard locks may be held)
+   *
+   * @param     subscriptions   The @ref REGISTRY_SHARDS lists of subscriptions
+   *                            to end, by the shard of the name followed
+   **/
+  void DropSubscriptions(vector<Subscription>* subscriptions);
+
+  /**
+   * Take a snapshot of everyone subscribed to a logical address
+   *
+   * @param     name            The logical address being subscribed to
+   * @returns   A copy of the set of logical-address|port subscribers
+   **/
+  set< pair<LogicalAddress, unsigned short> > Subscribers(
+      const LogicalAddress& name);
 
  private:
   /**
-   * Privately, we keep a key-value store of logical addresses to physical
-   * addresses that correspond to the nodes that have already registered at
-   * this RS.
+   * Privately, we keep the registry of names and subscriptions split across
+   * independently locked shards.
    **/
-  unordered_map<LogicalAddress, PhysicalAddress> registered_names_;
+  RegistryShard shards_[REGISTRY_SHARDS];
 
   /**
-   * In addition, we keep a key-value store of logical addresses to a set
-   * of logical-address|port combinations so that when any logical address's
-   * physical address is updated, we can send subscription updates
-   * to every subscribed node
+   * Every leased name (and every name with subscribers) goes on the wheel
+   * (at most once each), which is guarded by its own lock (only ever taken
+   * innermost, under at most one shard lock)
    **/
-  unordered_map<LogicalAddress, set< pair<LogicalAddress, unsigned short> > >
-    subscriptions_;
+  pthread_mutex_t lease_lock_;
+  TimingWheel leases_;
 
   /**
-   * We maintain which port we are listening for incoming registrations on...
+   * How long to coalesce each name's updates over (0 for not at all), and
+   * the names with updates held back, in the order they were held along
+   * with when each is due (guarded by its own lock, taken innermost)
    **/
-  unsigned short registration_port_;
+  int coalesce_ms_;
+  pthread_mutex_t held_lock_;
+  deque<pair<uint64_t, NameId> > held_;
 
   /**
-   * ... and the actual socket that is open for registrations.
+   * Where we keep the registry's state ("" if nowhere), the log we append
+   * every change to, its generation, and the generation of the first log
+   * the current snapshot is followed by
    **/
-  int registration_listener_;
+  string state_dir_;
+  RecordLog log_;
+  uint32_t generation_;
+  uint32_t snapshot_generation_;
 
   /**
-   * We maintain which port we are listening for incoming lookups on...
+   * The table of registrations we restarted from, which of its entries have
+   * since been promoted into the shards (each guarded by the lock of the
+   * entry's shard), and the tick it lapses at
    **/
-  unsigned short lookup_port_;
+  MappedTable snapshot_names_;
+  vector<char> promoted_;
+  uint64_t snapshot_expires_;
 
   /**
-   * ... and the actual socket that is open for lookups.
+   * The workers that serve the lookup and registration ports...
    **/
-  int lookup_listener_;
+  vector<RendezvousWorker*> workers_;
+
+  /**
+   * ...and the (never run) worker whose update socket and fan-outs are lent
+   * to callers outside of the workers, one at a time
+   **/
+  pthread_mutex_t caller_lock_;
+  RendezvousWorker* caller_;
+
+  /**
+   * ...and the (listener-less) worker that commits the log and writes every
+   * snapshot on a thread of its own, so that no fsync stalls a request
+   **/
+  RendezvousWorker* persister_;
+
+  /**
+   * We maintain which port we are listening for incoming registrations on...
+   **/
+  unsigned short registration_port_;
+
+  /**
+   * ...and which port we are listening for incoming lookups on.
+   **/
+  unsigned short lookup_port_;
 
   /**
    * We specify how we communicate with other people via domain
@@ -133,9 +1058,28 @@ class SimpleRendezvousServer : public RendezvousServer {
   Protocol protocol_;
 
   // Declare friend tests for access to private methods
+  friend class RendezvousWorker;
   friend class SimpleRendezvousServerTest;
   FRIEND_TEST(SimpleRendezvousServerTest, UpdatesAndHandlesSubscribers);
   FRIEND_TEST(SimpleRendezvousServerTest, HandlesNetworkRequests);
+  FRIEND_TEST(SimpleRendezvousServerTest, FansOutOverOneSocket);
+  FRIEND_TEST(SimpleRendezvousServerTest, PatchesMovedSubscribers);
+  FRIEND_TEST(SimpleRendezvousServerTest, InternsEachNameOnce);
+  FRIEND_TEST(SimpleRendezvousServerTest, SpeaksBinaryProtocol);
+  FRIEND_TEST(SimpleRendezvousServerTest, ExpiresLapsedLeases);
+  FRIEND_TEST(SimpleRendezvousServerTest, ExpiresLapsedSubscriptions);
+  FRIEND_TEST(SimpleRendezvousServerTest, DropsDepartedNodesInBulk);
+  FRIEND_TEST(SimpleRendezvousServerWorkersTest, SharesRegistryAcrossWorkers);
+  FRIEND_TEST(SimpleRendezvousServerCoalescingTest, CoalescesFlappingUpdates);
+  FRIEND_TEST(SimpleRendezvousServerPersistenceTest, RecoversAfterRestart);
+  FRIEND_TEST(SimpleRendezvousServerPersistenceTest,
+              LogsLapsesAheadOfResubscriptions);
 };
 
+/** Separate non-class method required by pthread **/
+static inline void* RunRendezvousWorkerThread(void* worker) {
+  (reinterpret_cast<RendezvousWorker*>(worker))->Run();
+  return NULL;
+}
+
 #endif  // _PERMANENTIP_RENDEZVOUSSERVER_SIMPLERENDEZVOUSSERVER_H_
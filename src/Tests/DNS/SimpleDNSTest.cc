@@ -126,6 +126,638 @@ TEST_F(SimpleDNSTest, HandlesNetworkRequests) {
   ASSERT_FALSE(dns_->ShutDown("Normal termination"));
 }
 
+/**
+ * @test    DNS replies carry only their payload and terminator
+ **/
+TEST_F(SimpleDNSTest, RepliesWithExactLength) {
+  int sender = socket(domain_, transport_layer_, protocol_);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+  socklen_t server_size = sizeof(server);
+
+  char buffer[MAX_DATAGRAM_SIZE] = "python";
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  sendto(sender, buffer, strlen(buffer) + 1, 0,
+         reinterpret_cast<struct sockaddr*>(&server), server_size);
+  bytes_read = recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(bytes_read, static_cast<int>(strlen("128.36.232.37") + 1));
+  EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.37");
+
+  strncpy(buffer, "monkey.cs.yale.edu", sizeof(buffer));
+#ifdef UDP_APPLICATION
+  sendto(sender, buffer, strlen(buffer) + 1, 0,
+         reinterpret_cast<struct sockaddr*>(&server), server_size);
+  bytes_read = recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(bytes_read, 1);
+  EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "");
+
+  ASSERT_FALSE(close(sender));
+  ASSERT_FALSE(dns_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that binary lookups packed into one datagram are answered,
+ *          in order, in one reply
+ **/
+TEST_F(SimpleDNSTest, AnswersPipelinedBinaryLookups) {
+  int sender = socket(domain_, transport_layer_, protocol_);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+  socklen_t server_size = sizeof(server);
+
+  char buffer[MAX_DATAGRAM_SIZE];
+  WireWriter writer(buffer, sizeof(buffer));
+  ASSERT_TRUE(writer.Append(WIRE_RESOLVE, 0, 7, "python", "", 0));
+  ASSERT_TRUE(writer.Append(WIRE_RESOLVE, 0, 8, "monkey.cs.yale.edu", "", 0));
+  ASSERT_TRUE(writer.Append(WIRE_RESOLVE, 0, 9, "tick", "", 0));
+
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  sendto(sender, buffer, writer.Length(), 0,
+         reinterpret_cast<struct sockaddr*>(&server), server_size);
+  bytes_read = recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(bytes_read, 3 * (MIN_WIRE_MESSAGE + WIRE_TTL_SIZE));
+
+  WireReader reader(buffer, bytes_read);
+  WireMessage reply;
+  ASSERT_TRUE(reader.Next(&reply));
+  EXPECT_EQ(reply.opcode, WIRE_RESOLVED);
+  EXPECT_EQ(reply.request_id, 7u);
+  EXPECT_EQ(reply.address, Utils::IPStringToInt("128.36.232.37"));
+  EXPECT_EQ(reply.ttl, static_cast<uint32_t>(GLOB_RESOLUTION_TTL_S));
+
+  ASSERT_TRUE(reader.Next(&reply));
+  EXPECT_EQ(reply.request_id, 8u);
+  EXPECT_EQ(reply.flags, WIRE_NOT_FOUND | WIRE_TTL);
+  EXPECT_EQ(reply.address, 0);
+  EXPECT_EQ(reply.ttl, static_cast<uint32_t>(NEGATIVE_RESOLUTION_TTL_S));
+
+  ASSERT_TRUE(reader.Next(&reply));
+  EXPECT_EQ(reply.request_id, 9u);
+  EXPECT_FALSE(reader.Next(&reply));
+  EXPECT_FALSE(reader.Malformed());
+
+  ASSERT_FALSE(close(sender));
+  ASSERT_FALSE(dns_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    DNS lookups arriving faster than one batch are all answered
+ **/
+TEST_F(SimpleDNSTest, AnswersBurstsInBatches) {
+  int sender = socket(domain_, transport_layer_, protocol_);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+  socklen_t server_size = sizeof(server);
+
+  // Send more lookups than fit in a single batch before reading any back
+  char buffer[19] = "tick";
+  for (int i = 0; i < 2 * GLOB_BATCH_SIZE; i++) {
+#ifdef UDP_APPLICATION
+    sendto(sender, buffer, strlen(buffer) + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), server_size);
+#endif
+  }
+
+  struct timeval timeout = { 1, 0 };
+  setsockopt(sender, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int answers = 0;
+  for (int i = 0; i < 2 * GLOB_BATCH_SIZE; i++) {
+    memset(buffer, 0, sizeof(buffer));
+#ifdef UDP_APPLICATION
+    if (recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL) > 0 &&
+        string(buffer) == "128.36.232.37")
+      answers++;
+#endif
+  }
+  EXPECT_EQ(answers, 2 * GLOB_BATCH_SIZE);
+
+  ASSERT_FALSE(close(sender));
+  ASSERT_FALSE(dns_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that a DNS started from a snapshot answers from it, that
+ *          changed names are taken out of it, and that every name is written
+ *          back when the DNS shuts down
+ **/
+TEST(SimpleDNSSnapshotTest, ServesFromSnapshot) {
+  char directory[] = "/tmp/DNSSnapshotXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string path = string(directory) + "/names";
+
+  vector< pair<LogicalAddress, int> > entries;
+  entries.push_back(pair<LogicalAddress, int>(
+    "tick.cs.yale.edu", Utils::IPStringToInt("128.36.232.50")));
+  entries.push_back(pair<LogicalAddress, int>(
+    "python", Utils::IPStringToInt("128.36.232.37")));
+  ASSERT_TRUE(MappedTable::Write(path, &entries, 0));
+
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, path);
+  pthread_t dns_daemon;
+  pthread_create(&dns_daemon, NULL, &RunDNSThread, dns);
+  sleep(1);
+
+  // Nothing has been copied out of the snapshot to answer from it...
+  EXPECT_EQ(dns->LookupName("tick.cs.yale.edu"), "128.36.232.50");
+  EXPECT_EQ(dns->ResolveName("python", 6),
+            Utils::IPStringToInt("128.36.232.37"));
+  EXPECT_EQ(dns->LookupName("monkey.cs.yale.edu"), "");
+  EXPECT_EQ(dns->names_.Size(), 0u);
+
+  // ...until a name changes
+  ASSERT_TRUE(dns->AddName("tick.cs.yale.edu", "128.36.232.51"));
+  ASSERT_TRUE(dns->AddName("bob.cs.yale.edu", "128.36.232.60"));
+  EXPECT_EQ(dns->LookupName("tick.cs.yale.edu"), "128.36.232.51");
+  EXPECT_EQ(dns->names_.Size(), 2u);
+
+  ASSERT_FALSE(dns->ShutDown("Normal termination"));
+  pthread_join(dns_daemon, NULL);
+  delete dns;
+
+  MappedTable snapshot;
+  ASSERT_TRUE(snapshot.Open(path));
+  EXPECT_EQ(snapshot.Size(), 3);
+  ASSERT_GE(snapshot.Find("tick.cs.yale.edu"), 0);
+  EXPECT_EQ(snapshot.Address(snapshot.Find("tick.cs.yale.edu")),
+            Utils::IPStringToInt("128.36.232.51"));
+  EXPECT_GE(snapshot.Find("python"), 0);
+  EXPECT_GE(snapshot.Find("bob.cs.yale.edu"), 0);
+  EXPECT_LT(snapshot.Find("monkey.cs.yale.edu"), 0);
+  snapshot.Close();
+
+  ASSERT_FALSE(unlink(path.c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
+/**
+ * @test    Ensure that a DNS loads its names from a zone file and takes
+ *          changes to them only from properly signed admin requests
+ **/
+TEST(SimpleDNSZoneTest, LoadsZoneAndTakesAdminChanges) {
+  char directory[] = "/tmp/DNSZoneXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string path = string(directory) + "/zone";
+  FILE* zone = fopen(path.c_str(), "w");
+  ASSERT_TRUE(zone != NULL);
+  fputs("# Logical address    RS\n"
+        "\n"
+        "tick.cs.yale.edu      128.36.232.50\n"
+        "python\t128.36.232.37  # RS on Cobra\n"
+        "broken.cs.yale.edu    300.36.232.50\n"
+        "lonely.cs.yale.edu\n"
+        "last.cs.yale.edu      128.36.232.70", zone);
+  ASSERT_FALSE(fclose(zone));
+
+  string key = "000102030405060708090a0b0c0d0e0f";
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, "", path, key);
+  pthread_t dns_daemon;
+  pthread_create(&dns_daemon, NULL, &RunDNSThread, dns);
+  sleep(1);
+
+  EXPECT_EQ(dns->LookupName("tick.cs.yale.edu"), "128.36.232.50");
+  EXPECT_EQ(dns->LookupName("python"), "128.36.232.37");
+  EXPECT_EQ(dns->LookupName("last.cs.yale.edu"), "128.36.232.70");
+  EXPECT_EQ(dns->LookupName("broken.cs.yale.edu"), "");
+  EXPECT_EQ(dns->LookupName("lonely.cs.yale.edu"), "");
+
+  int admin = socket(GLOB_DOM, GLOB_TL, GLOB_PROTO);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(admin, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = GLOB_DOM;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_DNS_ADMIN_PORT);
+
+  // A signed request is taken once, but never again...
+  string requests[] = {
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.60", 1),
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.60", 1),
+    SimpleDNS::SignAdminRequest("0f0e0d0c0b0a09080706050403020100",
+                                "REMOVE|python", 2),
+    SimpleDNS::SignAdminRequest(key, "REMOVE|tick.cs.yale.edu", 2)
+  };
+  string replies[] = { ADMIN_ACCEPTED, ADMIN_REJECTED, ADMIN_REJECTED,
+                       ADMIN_ACCEPTED };
+  for (int i = 0; i < 4; i++) {
+    char buffer[MAX_DATAGRAM_SIZE];
+    int bytes_read = -1;
+#ifdef UDP_APPLICATION
+    sendto(admin, requests[i].c_str(), requests[i].length() + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), sizeof(server));
+    bytes_read = recvfrom(admin, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+    EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), replies[i]);
+  }
+
+  // ...and one signed with the wrong key is not taken at all
+  EXPECT_EQ(dns->LookupName("bob.cs.yale.edu"), "128.36.232.60");
+  EXPECT_EQ(dns->LookupName("python"), "128.36.232.37");
+  EXPECT_EQ(dns->LookupName("tick.cs.yale.edu"), "");
+
+  ASSERT_FALSE(close(admin));
+  ASSERT_FALSE(dns->ShutDown("Normal termination"));
+  pthread_join(dns_daemon, NULL);
+  delete dns;
+
+  ASSERT_FALSE(unlink(path.c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
+/**
+ * @test    Ensure that an admin request accepted before a restart cannot be
+ *          replayed after it
+ **/
+TEST(SimpleDNSSnapshotTest, RefusesAdminReplaysAfterRestart) {
+  char directory[] = "/tmp/DNSAdminXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string path = string(directory) + "/names";
+  string key = "000102030405060708090a0b0c0d0e0f";
+
+  int admin = socket(GLOB_DOM, GLOB_TL, GLOB_PROTO);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(admin, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = GLOB_DOM;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_DNS_ADMIN_PORT);
+
+  // The same request goes to a DNS and then to the same DNS restarted...
+  string requests[] = {
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.60", 5),
+    SimpleDNS::SignAdminRequest(key, "REMOVE|bob.cs.yale.edu", 6),
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.60", 5),
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.61", 7)
+  };
+  string replies[] = { ADMIN_ACCEPTED, ADMIN_ACCEPTED, ADMIN_REJECTED,
+                       ADMIN_ACCEPTED };
+  for (int run = 0; run < 2; run++) {
+    SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, path, "", key);
+    pthread_t dns_daemon;
+    pthread_create(&dns_daemon, NULL, &RunDNSThread, dns);
+    sleep(1);
+
+    for (int i = 2 * run; i < 2 * run + 2; i++) {
+      char buffer[MAX_DATAGRAM_SIZE];
+      int bytes_read = -1;
+#ifdef UDP_APPLICATION
+      sendto(admin, requests[i].c_str(), requests[i].length() + 1, 0,
+             reinterpret_cast<struct sockaddr*>(&server), sizeof(server));
+      bytes_read = recvfrom(admin, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+      EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), replies[i]);
+    }
+
+    // ...which keeps the removal the replay would have undone
+    EXPECT_EQ(dns->LookupName("bob.cs.yale.edu"),
+              (run == 0 ? "" : "128.36.232.61"));
+
+    ASSERT_FALSE(dns->ShutDown("Normal termination"));
+    pthread_join(dns_daemon, NULL);
+    delete dns;
+  }
+
+  ASSERT_FALSE(close(admin));
+  ASSERT_FALSE(unlink(path.c_str()));
+  ASSERT_FALSE(unlink((path + ADMIN_LOG_SUFFIX).c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
+/**
+ * @test    Ensure that a malformed admin request uses up no sequence number
+ *          and that a change, once accepted, outlives a crash (a DNS that
+ *          never gets to write its snapshot)
+ **/
+TEST(SimpleDNSSnapshotTest, KeepsAcceptedAdminChangesThroughCrashes) {
+  char directory[] = "/tmp/DNSCrashXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string path = string(directory) + "/names";
+  string key = "000102030405060708090a0b0c0d0e0f";
+
+  string requests[] = {
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232", 3),
+    SimpleDNS::SignAdminRequest(key, "ADD|bob.cs.yale.edu|128.36.232.60", 3),
+    SimpleDNS::SignAdminRequest(key, "REMOVE|python", 4)
+  };
+  bool accepted[] = { false, true, true };
+
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, path, "", key);
+  ASSERT_TRUE(SipHash::ParseKey(key, dns->admin_key_));
+  ASSERT_TRUE(dns->AddName("python", "128.36.232.37"));
+  ASSERT_TRUE(dns->OpenAdminLog());
+  for (int i = 0; i < 3; i++)
+    EXPECT_EQ(dns->AnswerAdminRequest(requests[i].c_str(),
+                                      requests[i].length() + 1), accepted[i]);
+  delete dns;
+
+  // The changes come back from the log, and neither request is taken again
+  dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, path, "", key);
+  ASSERT_TRUE(SipHash::ParseKey(key, dns->admin_key_));
+  ASSERT_TRUE(dns->AddName("python", "128.36.232.37"));
+  ASSERT_TRUE(dns->OpenAdminLog());
+  EXPECT_EQ(dns->LookupName("bob.cs.yale.edu"), "128.36.232.60");
+  EXPECT_EQ(dns->LookupName("python"), "");
+  EXPECT_EQ(dns->admin_sequence_, 4u);
+  for (int i = 1; i < 3; i++)
+    EXPECT_FALSE(dns->AnswerAdminRequest(requests[i].c_str(),
+                                         requests[i].length() + 1));
+  delete dns;
+
+  ASSERT_FALSE(unlink((path + ADMIN_LOG_SUFFIX).c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
+/**
+ * @test    Ensure that a compiled zone is served in place, that every name in
+ *          it (and only those) is found, and that admin changes still hide it
+ **/
+TEST(SimpleDNSZoneTest, ServesCompiledZone) {
+  char directory[] = "/tmp/DNSCompiledXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string path = string(directory) + "/zone";
+  string compiled = path + ".compiled";
+  FILE* zone = fopen(path.c_str(), "w");
+  ASSERT_TRUE(zone != NULL);
+  for (int i = 0; i < 3000; i++)
+    fprintf(zone, "node%d.cs.yale.edu 128.36.%d.%d\n", i, i / 256, i % 256);
+  fputs("python 128.36.232.36\n"
+        "python 128.36.232.37  # The later line wins\n", zone);
+  ASSERT_FALSE(fclose(zone));
+  ASSERT_TRUE(SimpleDNS::CompileZone(path, compiled));
+
+  PerfectTable table;
+  ASSERT_TRUE(table.Open(compiled));
+  EXPECT_EQ(table.Size(), 3001);
+  vector<bool> taken(table.Size(), false);
+  for (int i = 0; i < 3000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    int entry = table.Find(name, strlen(name));
+    ASSERT_GE(entry, 0);
+    EXPECT_FALSE(taken[entry]);
+    taken[entry] = true;
+    EXPECT_EQ(table.Name(entry), name);
+  }
+  EXPECT_LT(table.Find("node3000.cs.yale.edu"), 0);
+  EXPECT_LT(table.Find("", 0), 0);
+  table.Close();
+
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, "", compiled);
+  pthread_t dns_daemon;
+  pthread_create(&dns_daemon, NULL, &RunDNSThread, dns);
+  sleep(1);
+
+  // Nothing is loaded into our own table to answer from the compiled zone...
+  EXPECT_EQ(dns->LookupName("node1234.cs.yale.edu"), "128.36.4.210");
+  EXPECT_EQ(dns->LookupName("python"), "128.36.232.37");
+  EXPECT_EQ(dns->LookupName("tick"), "");
+  EXPECT_EQ(dns->names_.Size(), 0u);
+
+  // ...but it still gives way to changes
+  ASSERT_TRUE(dns->AddName("python", "128.36.232.38"));
+  ASSERT_TRUE(dns->RemoveName("node1234.cs.yale.edu"));
+  EXPECT_EQ(dns->LookupName("python"), "128.36.232.38");
+  EXPECT_EQ(dns->LookupName("node1234.cs.yale.edu"), "");
+
+  ASSERT_FALSE(dns->ShutDown("Normal termination"));
+  pthread_join(dns_daemon, NULL);
+  delete dns;
+
+  ASSERT_FALSE(unlink(compiled.c_str()));
+  ASSERT_FALSE(unlink(path.c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
+/**
+ * Each reader keeps looking up a name that never changes until told to stop,
+ * counting every time it is answered wrongly
+ **/
+class SimpleDNSReader {
+ public:
+  SimpleDNS* dns_;
+  volatile bool reading_;
+  int lookups_;
+  int wrong_;
+
+  static void* Run(void* argument) {
+    SimpleDNSReader* reader = reinterpret_cast<SimpleDNSReader*>(argument);
+    while (reader->reading_) {
+      if (reader->dns_->LookupName("python") != "128.36.232.37")
+        reader->wrong_++;
+      reader->lookups_++;
+    }
+    return NULL;
+  }
+};
+
+/**
+ * @test    Ensure that several workers answer lookups, and that lookups see
+ *          every name that is not changing while many others are added (and
+ *          the table grows under them)
+ **/
+TEST(SimpleDNSWorkersTest, AnswersWhileNamesChange) {
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 4);
+  pthread_t dns_daemon;
+  pthread_create(&dns_daemon, NULL, &RunDNSThread, dns);
+  sleep(1);
+
+  SimpleDNSReader readers[4];
+  pthread_t reader_threads[4];
+  for (int i = 0; i < 4; i++) {
+    readers[i].dns_ = dns;
+    readers[i].reading_ = true;
+    readers[i].lookups_ = readers[i].wrong_ = 0;
+    pthread_create(&reader_threads[i], NULL, &SimpleDNSReader::Run,
+                   &readers[i]);
+  }
+
+  for (int i = 0; i < 5000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    ASSERT_TRUE(dns->AddName(name, "128.36.232.60"));
+  }
+  ASSERT_TRUE(dns->RemoveName("node0.cs.yale.edu"));
+  EXPECT_FALSE(dns->RemoveName("node0.cs.yale.edu"));
+
+  for (int i = 0; i < 4; i++) {
+    readers[i].reading_ = false;
+    pthread_join(reader_threads[i], NULL);
+    EXPECT_GT(readers[i].lookups_, 0);
+    EXPECT_EQ(readers[i].wrong_, 0);
+  }
+  EXPECT_EQ(dns->LookupName("node4999.cs.yale.edu"), "128.36.232.60");
+  EXPECT_EQ(dns->LookupName("node0.cs.yale.edu"), "");
+  EXPECT_EQ(dns->LookupName("tick"), "128.36.232.37");
+
+  // Whichever worker the kernel hands a lookup to answers it
+  int sender = socket(GLOB_DOM, GLOB_TL, GLOB_PROTO);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(sender, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = GLOB_DOM;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+  for (int i = 0; i < 8; i++) {
+    char buffer[MAX_DATAGRAM_SIZE] = "node4321.cs.yale.edu";
+    int bytes_read = -1;
+#ifdef UDP_APPLICATION
+    sendto(sender, buffer, strlen(buffer) + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), sizeof(server));
+    bytes_read = recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+    EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.60");
+  }
+
+  ASSERT_FALSE(close(sender));
+  ASSERT_FALSE(dns->ShutDown("Normal termination"));
+  pthread_join(dns_daemon, NULL);
+  delete dns;
+}
+
+/**
+ * A short-lived reader looks up a single name once
+ **/
+static void* ReadOnce(void* table) {
+  int address;
+  reinterpret_cast<RcuTable*>(table)->Find("python", 6, &address);
+  return NULL;
+}
+
+/**
+ * @test    Ensure that threads give back their reader slots when they exit,
+ *          so that any number of them can read a table one after another
+ **/
+TEST(SimpleDNSWorkersTest, GivesBackReaderSlots) {
+  RcuTable table;
+  table.Set("python", 6, Utils::IPStringToInt("128.36.232.37"));
+  for (int i = 0; i < 3 * RCU_MAX_READERS; i++) {
+    pthread_t reader;
+    ASSERT_FALSE(pthread_create(&reader, NULL, &ReadOnce, &table));
+    ASSERT_FALSE(pthread_join(reader, NULL));
+  }
+  EXPECT_EQ(table.Readers(), 0);
+
+  int address;
+  ASSERT_TRUE(table.Find("python", 6, &address));
+  EXPECT_EQ(address, Utils::IPStringToInt("128.36.232.37"));
+  EXPECT_EQ(table.Readers(), 1);
+}
+
+/**
+ * @test    Ensure that the filter in front of a table never turns away a name
+ *          it holds (even a removed one), is rebuilt with every index the
+ *          table grows into, and turns away nearly every name it never held
+ **/
+TEST(SimpleDNSFilterTest, FiltersUnknownNames) {
+  RcuTable table;
+  for (int i = 0; i < 100000; i++) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    table.Set(name, length, i + 1);
+  }
+  table.Set("node0.cs.yale.edu", 17, 0);
+  EXPECT_GT(table.Capacity(), static_cast<uint32_t>(RCU_INITIAL_SLOTS));
+
+  for (int i = 0; i < 100000; i++) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    int address = -1;
+    ASSERT_TRUE(table.MayContain(name, length));
+    ASSERT_TRUE(table.Find(name, length, &address));
+    EXPECT_EQ(address, (i == 0 ? 0 : i + 1));
+  }
+
+  int false_positives = 0;
+  for (int i = 0; i < 100000; i++) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "ghost%d.cs.yale.edu", i);
+    int address;
+    if (table.MayContain(name, length))
+      false_positives++;
+    EXPECT_FALSE(table.Find(name, length, &address));
+  }
+  EXPECT_LT(false_positives, 600);
+}
+
+/**
+ * @test    Ensure that a DNS serving from a snapshot and a compiled zone turns
+ *          unknown names away at each tier's filter, before probing either
+ **/
+TEST(SimpleDNSFilterTest, FiltersEveryTier) {
+  char directory[] = "/tmp/DNSFilterXXXXXX";
+  ASSERT_TRUE(mkdtemp(directory) != NULL);
+  string snapshot = string(directory) + "/names";
+  string zone = string(directory) + "/zone", compiled = zone + ".compiled";
+
+  vector< pair<LogicalAddress, int> > entries;
+  FILE* zone_file = fopen(zone.c_str(), "w");
+  ASSERT_TRUE(zone_file != NULL);
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "snap%d.cs.yale.edu", i);
+    entries.push_back(pair<LogicalAddress, int>(name, i + 1));
+    fprintf(zone_file, "zone%d.cs.yale.edu 128.36.%d.%d\n", i, i / 256,
+            i % 256);
+  }
+  ASSERT_FALSE(fclose(zone_file));
+  ASSERT_TRUE(MappedTable::Write(snapshot, &entries, 0));
+  ASSERT_TRUE(SimpleDNS::CompileZone(zone, compiled));
+
+  SimpleDNS* dns = new SimpleDNS(GLOB_BATCH_SIZE, 1, snapshot, compiled);
+  ASSERT_TRUE(dns->OpenSnapshot());
+  ASSERT_TRUE(dns->zone_table_.Open(compiled));
+  ASSERT_TRUE(dns->AddName("python", "128.36.232.37"));
+
+  // Every name is found in its own tier...
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "snap%d.cs.yale.edu", i);
+    ASSERT_EQ(dns->ResolveName(name, length), i + 1);
+    length = snprintf(name, sizeof(name), "zone%d.cs.yale.edu", i);
+    ASSERT_TRUE(dns->zone_table_.MayContain(name, length));
+    ASSERT_NE(dns->ResolveName(name, length), 0);
+  }
+  EXPECT_EQ(dns->LookupName("python"), "128.36.232.37");
+
+  // ...and nearly every other name goes no further than the filters
+  int probed = 0;
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "ghost%d.cs.yale.edu", i);
+    if (dns->zone_table_.MayContain(name, length) ||
+        dns->snapshot_.MayContain(name, length))
+      probed++;
+    EXPECT_EQ(dns->ResolveName(name, length), 0);
+  }
+  EXPECT_LT(probed, 20);
+  delete dns;
+
+  ASSERT_FALSE(unlink(snapshot.c_str()));
+  ASSERT_FALSE(unlink(zone.c_str()));
+  ASSERT_FALSE(unlink(compiled.c_str()));
+  ASSERT_FALSE(rmdir(directory));
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
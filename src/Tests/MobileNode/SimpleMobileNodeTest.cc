@@ -10,8 +10,15 @@
 
 #include <pthread.h>
 #include <gtest/gtest.h>
+#include <set>
+#include <utility>
+#include <vector>
 #include "MobileNode/SimpleMobileNode.h"
 
+using std::set;
+using std::pair;
+using std::vector;
+
 /** @todo These tests will hang because they do not override typical
           integrated functions into dummy black boxes. **/
 
@@ -21,6 +28,61 @@ static inline void* RunMobileNodeThread(void* mobile_node) {
   return NULL;
 }
 
+/**
+ * A stand-in for the DNS or RS that drops the first datagram it is sent and
+ * then answers nothing until it has seen every request it expects (so that
+ * a client waiting on one answer at a time would never finish)
+ **/
+struct FakeServer {
+  int listener;
+  unsigned int expected;
+  WireOpcode answer;
+  int address;
+  uint8_t flags;
+  struct sockaddr_in client;
+};
+
+static inline void* RunFakeServerThread(void* fake_server) {
+  FakeServer* server = reinterpret_cast<FakeServer*>(fake_server);
+  set<uint32_t> seen;
+  vector<pair<uint32_t, struct sockaddr_in> > requests;
+  bool dropped = false;
+
+  while (seen.size() < server->expected) {
+    char buffer[MAX_DATAGRAM_SIZE];
+    struct sockaddr_in source;
+    socklen_t source_size = sizeof(source);
+    int bytes_read = recvfrom(server->listener, buffer, sizeof(buffer), 0,
+                              reinterpret_cast<struct sockaddr*>(&source),
+                              &source_size);
+    if (bytes_read <= 0)
+      return NULL;
+    if (!dropped) {
+      dropped = true;
+      continue;
+    }
+
+    WireReader reader(buffer, bytes_read);
+    WireMessage request;
+    while (reader.Next(&request))
+      if (seen.insert(request.request_id).second)
+        requests.push_back(pair<uint32_t, struct sockaddr_in>(
+          request.request_id, source));
+    server->client = source;
+  }
+
+  for (unsigned int i = 0; i < requests.size(); i++) {
+    char buffer[MIN_WIRE_MESSAGE];
+    WireWriter writer(buffer, sizeof(buffer));
+    writer.Append(server->answer, server->flags, requests[i].first, "", "",
+                  server->address);
+    sendto(server->listener, buffer, writer.Length(), 0,
+           reinterpret_cast<struct sockaddr*>(&requests[i].second),
+           sizeof(requests[i].second));
+  }
+  return NULL;
+}
+
 namespace {
   class SimpleMobileNodeTest : public ::testing::Test {
    protected:
@@ -45,6 +107,55 @@ namespace {
     virtual void SetUp() {}
     virtual void TearDown() {}
 
+    // Bind a fake server to the lookup port (giving up after a few seconds)
+    int Listen(const char* address) {
+      int listener = socket(domain_, transport_layer_, protocol_);
+      struct timeval timeout = { 5, 0 };
+      setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      struct sockaddr_in local;
+      memset(&local, 0, sizeof(local));
+      local.sin_family = domain_;
+      local.sin_addr.s_addr = inet_addr(address);
+      local.sin_port = htons(GLOB_LOOKUP_PORT);
+      EXPECT_FALSE(bind(listener, reinterpret_cast<struct sockaddr*>(&local),
+                        sizeof(local)));
+      return listener;
+    }
+
+    // Register peers (each only looked up once) through a fake DNS at
+    // 127.0.0.1 and a fake RS at 127.0.0.2 that places them at 10.1.2.3
+    vector<struct sockaddr*> RegisterPeers(
+        const vector<pair<int, LogicalAddress> >& peers, FakeServer* dns,
+        FakeServer* rs) {
+      FakeServer fake_dns = { Listen("127.0.0.1"), 1, WIRE_RESOLVED,
+                              static_cast<int>(inet_addr("127.0.0.2")) };
+      FakeServer fake_rs = { Listen("127.0.0.2"), 1, WIRE_SUBSCRIBED,
+                             static_cast<int>(inet_addr("10.1.2.3")) };
+      *dns = fake_dns;
+      *rs = fake_rs;
+
+      pthread_t dns_daemon, rs_daemon;
+      pthread_create(&dns_daemon, NULL, &RunFakeServerThread, dns);
+      pthread_create(&rs_daemon, NULL, &RunFakeServerThread, rs);
+      vector<struct sockaddr*> locations = mobile_node_->RegisterPeers(peers);
+      pthread_join(dns_daemon, NULL);
+      pthread_join(rs_daemon, NULL);
+      return locations;
+    }
+
+    // Have the fake RS push a location update to whoever subscribed
+    void PushUpdate(FakeServer* rs, const LogicalAddress& name,
+                    const char* address) {
+      char buffer[MIN_WIRE_MESSAGE + MAX_WIRE_NAME];
+      WireWriter writer(buffer, sizeof(buffer));
+      writer.Append(WIRE_UPDATE, 0, 0, name, "",
+                    static_cast<int>(inet_addr(address)));
+      EXPECT_EQ(sendto(rs->listener, buffer, writer.Length(), 0,
+                       reinterpret_cast<struct sockaddr*>(&rs->client),
+                       sizeof(rs->client)), writer.Length());
+    }
+
     // Create a member variable for the thread
     pthread_t mobile_node_daemon_;
 
@@ -65,6 +176,326 @@ TEST_F(SimpleMobileNodeTest, StartsAndStops) {
   ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
 }
 
+/**
+ * @test    Ensure that many peers are resolved and looked up with all of their
+ *          requests in flight at once, and that lost requests are resent
+ **/
+TEST_F(SimpleMobileNodeTest, ResolvesPeersConcurrently) {
+#ifdef BINARY_PROTOCOL_APPLICATION
+  FakeServer dns = { Listen("127.0.0.1"), 8, WIRE_RESOLVED,
+                     static_cast<int>(inet_addr("127.0.0.2")) };
+  FakeServer rs = { Listen("127.0.0.2"), 8, WIRE_SUBSCRIBED,
+                    static_cast<int>(inet_addr("10.1.2.3")) };
+  pthread_t dns_daemon, rs_daemon;
+  pthread_create(&dns_daemon, NULL, &RunFakeServerThread, &dns);
+  pthread_create(&rs_daemon, NULL, &RunFakeServerThread, &rs);
+
+  vector<pair<int, LogicalAddress> > peers;
+  for (int i = 0; i < 8; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "peer%d.cs.yale.edu", i);
+    peers.push_back(pair<int, LogicalAddress>(
+      socket(domain_, transport_layer_, protocol_), name));
+  }
+
+  vector<struct sockaddr*> locations = mobile_node_->RegisterPeers(peers);
+  pthread_join(dns_daemon, NULL);
+  pthread_join(rs_daemon, NULL);
+
+  ASSERT_EQ(locations.size(), 8u);
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(locations[i] != NULL);
+    EXPECT_EQ(reinterpret_cast<struct sockaddr_in*>(locations[i])->
+                sin_addr.s_addr, inet_addr("10.1.2.3"));
+    close(peers[i].first);
+  }
+
+  close(dns.listener);
+  close(rs.listener);
+#endif
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that interface address changes are noticed through netlink
+ *          (only if we are allowed to add an address to the loopback)
+ **/
+TEST_F(SimpleMobileNodeTest, NoticesAddressChanges) {
+  SimpleMobileNode watcher("watcher", "127.0.0.1", "127.0.0.1");
+  ASSERT_TRUE(watcher.WatchAddressChanges());
+  EXPECT_FALSE(watcher.AddressChanged());
+
+  if (system("ip addr add 127.0.0.9/32 dev lo 2>/dev/null") == 0) {
+    EXPECT_TRUE(watcher.AddressChanged());
+    EXPECT_FALSE(watcher.AddressChanged());
+
+    ASSERT_EQ(system("ip addr del 127.0.0.9/32 dev lo 2>/dev/null"), 0);
+    EXPECT_TRUE(watcher.AddressChanged());
+  } else {
+    Log(stderr, WARNING, "Not allowed to change addresses, skipping");
+  }
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that a location update pushed by the RS arrives on the
+ *          control socket, is applied right away (rather than on the
+ *          daemon's next wakeup) and patches every app socket of the peer
+ **/
+TEST_F(SimpleMobileNodeTest, AppliesPushedUpdatesImmediately) {
+#ifdef BINARY_PROTOCOL_APPLICATION
+  // Two app sockets talk to the same peer, which is only subscribed to once
+  vector<pair<int, LogicalAddress> > peers;
+  for (int i = 0; i < 2; i++)
+    peers.push_back(pair<int, LogicalAddress>(
+      socket(domain_, transport_layer_, protocol_), "peer.cs.yale.edu"));
+  FakeServer dns, rs;
+  vector<struct sockaddr*> locations = RegisterPeers(peers, &dns, &rs);
+
+  ASSERT_EQ(locations.size(), 2u);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(locations[i] != NULL);
+    ASSERT_EQ(reinterpret_cast<struct sockaddr_in*>(locations[i])->
+                sin_addr.s_addr, inet_addr("10.1.2.3"));
+  }
+
+  uint64_t pushed = GetTime();
+  PushUpdate(&rs, "peer.cs.yale.edu", "10.4.5.6");
+  for (int i = 0; i < 2; i++) {
+    struct sockaddr_in* peer =
+      reinterpret_cast<struct sockaddr_in*>(locations[i]);
+    while (peer->sin_addr.s_addr != inet_addr("10.4.5.6") &&
+           GetTime() < pushed + GLOB_WAKEUP_INTERVAL_MS)
+      usleep(1000);
+    EXPECT_EQ(peer->sin_addr.s_addr, inet_addr("10.4.5.6"));
+  }
+  EXPECT_LT(GetTime() - pushed, GLOB_WAKEUP_INTERVAL_MS / 4u);
+
+  // Nothing was left on the app sockets for the application to filter out
+  char buffer[MAX_DATAGRAM_SIZE];
+  for (int i = 0; i < 2; i++) {
+    EXPECT_LT(recv(peers[i].first, buffer, sizeof(buffer), MSG_DONTWAIT), 0);
+    close(peers[i].first);
+  }
+
+  close(dns.listener);
+  close(rs.listener);
+#endif
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that an app socket registered again (to another peer) only
+ *          follows the peer it was last registered to, through the same
+ *          sockaddr it was first handed
+ **/
+TEST_F(SimpleMobileNodeTest, MovesReregisteredSockets) {
+#ifdef BINARY_PROTOCOL_APPLICATION
+  int app_socket = socket(domain_, transport_layer_, protocol_);
+  FakeServer dns, rs;
+  struct sockaddr* first = RegisterPeers(vector<pair<int, LogicalAddress> >(
+    1, pair<int, LogicalAddress>(app_socket, "old.cs.yale.edu")),
+    &dns, &rs)[0];
+  ASSERT_TRUE(first != NULL);
+  reinterpret_cast<struct sockaddr_in*>(first)->sin_port = htons(7000);
+  close(dns.listener);
+  close(rs.listener);
+
+  struct sockaddr_in* peer = reinterpret_cast<struct sockaddr_in*>(
+    RegisterPeers(vector<pair<int, LogicalAddress> >(
+      1, pair<int, LogicalAddress>(app_socket, "new.cs.yale.edu")),
+      &dns, &rs)[0]);
+  ASSERT_EQ(reinterpret_cast<struct sockaddr*>(peer), first);
+  EXPECT_EQ(peer->sin_port, htons(7000));
+  EXPECT_TRUE(mobile_node_->peer_subscriptions_["old.cs.yale.edu"]
+                .app_sockets.empty());
+  EXPECT_EQ(mobile_node_->peer_subscriptions_["new.cs.yale.edu"]
+              .app_sockets, vector<int>(1, app_socket));
+
+  // The old peer moving leaves the socket alone, but the new one does not
+  PushUpdate(&rs, "old.cs.yale.edu", "10.4.5.6");
+  PushUpdate(&rs, "new.cs.yale.edu", "10.7.8.9");
+  uint64_t pushed = GetTime();
+  while (peer->sin_addr.s_addr != inet_addr("10.7.8.9") &&
+         GetTime() < pushed + GLOB_WAKEUP_INTERVAL_MS)
+    usleep(1000);
+  EXPECT_EQ(peer->sin_addr.s_addr, inet_addr("10.7.8.9"));
+
+  close(app_socket);
+  close(dns.listener);
+  close(rs.listener);
+#endif
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that a handover replays only the unacknowledged messages,
+ *          in order and paced into bursts
+ **/
+TEST_F(SimpleMobileNodeTest, ReplaysOnlyWhatIsInFlight) {
+#ifdef BINARY_PROTOCOL_APPLICATION
+  int app_socket = socket(domain_, transport_layer_, protocol_);
+  FakeServer dns, rs;
+  struct sockaddr_in* peer = reinterpret_cast<struct sockaddr_in*>(
+    RegisterPeers(vector<pair<int, LogicalAddress> >(
+      1, pair<int, LogicalAddress>(app_socket, "peer.cs.yale.edu")),
+      &dns, &rs)[0]);
+  ASSERT_TRUE(peer != NULL);
+
+  // The peer will turn up on a local socket
+  int receiver = socket(domain_, transport_layer_, protocol_);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = domain_;
+  local.sin_addr.s_addr = inet_addr("127.0.0.1");
+  socklen_t local_size = sizeof(local);
+  ASSERT_FALSE(bind(receiver, reinterpret_cast<struct sockaddr*>(&local),
+                    local_size));
+  getsockname(receiver, reinterpret_cast<struct sockaddr*>(&local),
+              &local_size);
+  peer->sin_family = domain_;
+  peer->sin_port = local.sin_port;
+
+  // Send 40KB, of which the peer acknowledges the first 10KB
+  vector<NetworkMsg> messages;
+  uint32_t sequence;
+  for (int i = 0; i < 40; i++) {
+    char header[16];
+    snprintf(header, sizeof(header), "msg%d|", i);
+    messages.push_back(NetworkMsg(header) + NetworkMsg(1000, 'x'));
+    ASSERT_TRUE(mobile_node_->MessageSent(app_socket, messages[i], &sequence));
+    if (i == 9)
+      mobile_node_->MessageAcknowledged(app_socket, sequence);
+  }
+
+  uint64_t pushed = GetTime();
+  PushUpdate(&rs, "peer.cs.yale.edu", "127.0.0.1");
+  char buffer[MAX_DATAGRAM_SIZE];
+  for (int i = 10; i < 40; i++) {
+    int bytes_read = recv(receiver, buffer, sizeof(buffer), 0);
+    ASSERT_GT(bytes_read, 0);
+    EXPECT_EQ(NetworkMsg(buffer, bytes_read), messages[i]);
+  }
+  EXPECT_GE(GetTime() - pushed, static_cast<uint64_t>(REPLAY_PACING_MS));
+
+  // Nothing else (in particular nothing acknowledged) is replayed
+  usleep(50000);
+  EXPECT_LT(recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT), 0);
+
+  close(receiver);
+  close(app_socket);
+  close(dns.listener);
+  close(rs.listener);
+#endif
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that what the DNS says (found or not) is cached, so that
+ *          retrying a registration does not go back to the DNS
+ **/
+TEST_F(SimpleMobileNodeTest, CachesResolutions) {
+#ifdef BINARY_PROTOCOL_APPLICATION
+  // The peer has an RS but has not registered there yet...
+  FakeServer dns = { Listen("127.0.0.1"), 1, WIRE_RESOLVED,
+                     static_cast<int>(inet_addr("127.0.0.2")) };
+  FakeServer rs = { Listen("127.0.0.2"), 1, WIRE_SUBSCRIBED, 0,
+                    WIRE_NOT_FOUND };
+  pthread_t dns_daemon, rs_daemon;
+  pthread_create(&dns_daemon, NULL, &RunFakeServerThread, &dns);
+  pthread_create(&rs_daemon, NULL, &RunFakeServerThread, &rs);
+  int app_socket = socket(domain_, transport_layer_, protocol_);
+  EXPECT_TRUE(mobile_node_->RegisterPeer(app_socket, "peer.cs.yale.edu") ==
+              NULL);
+  pthread_join(dns_daemon, NULL);
+  pthread_join(rs_daemon, NULL);
+  close(rs.listener);
+
+  // ...and once it has, we go straight back to the RS without the DNS
+  FakeServer registered_rs = { Listen("127.0.0.2"), 1, WIRE_SUBSCRIBED,
+                               static_cast<int>(inet_addr("10.1.2.3")) };
+  pthread_create(&rs_daemon, NULL, &RunFakeServerThread, &registered_rs);
+  struct sockaddr_in* peer = reinterpret_cast<struct sockaddr_in*>(
+    mobile_node_->RegisterPeer(app_socket, "peer.cs.yale.edu"));
+  pthread_join(rs_daemon, NULL);
+  close(registered_rs.listener);
+  ASSERT_TRUE(peer != NULL);
+  EXPECT_EQ(peer->sin_addr.s_addr, inet_addr("10.1.2.3"));
+
+  // A name the DNS does not know is not asked about again for a while
+  FakeServer unknown_dns = { dns.listener, 1, WIRE_RESOLVED, 0,
+                             WIRE_NOT_FOUND };
+  pthread_create(&dns_daemon, NULL, &RunFakeServerThread, &unknown_dns);
+  EXPECT_TRUE(mobile_node_->RegisterPeer(app_socket, "ghost.cs.yale.edu") ==
+              NULL);
+  pthread_join(dns_daemon, NULL);
+  close(dns.listener);
+
+  uint64_t retried = GetTime();
+  EXPECT_TRUE(mobile_node_->RegisterPeer(app_socket, "ghost.cs.yale.edu") ==
+              NULL);
+  EXPECT_LT(GetTime() - retried, static_cast<uint64_t>(
+              GLOB_REQUEST_TIMEOUT_MS));
+
+  close(app_socket);
+#endif
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that unacknowledged messages are bounded (pushing back on
+ *          the application), released one at a time by payload and
+ *          cumulatively by sequence number
+ **/
+TEST_F(SimpleMobileNodeTest, BoundsUnacknowledgedMessages) {
+  // Identical payloads are kept (and numbered) separately
+  uint32_t first, second, sequence;
+  ASSERT_TRUE(mobile_node_->MessageSent(7, "echo", &first));
+  ASSERT_TRUE(mobile_node_->MessageSent(7, "echo", &second));
+  EXPECT_EQ(second, first + 1);
+
+  for (int i = 2; i < MAX_UNACKED_MESSAGES; i++)
+    ASSERT_TRUE(mobile_node_->MessageSent(7, "ping", &sequence));
+  EXPECT_EQ(sequence, first + MAX_UNACKED_MESSAGES - 1);
+  EXPECT_FALSE(mobile_node_->MessageSent(7, "ping"));
+
+  // Receiving a payload releases its oldest copy...
+  mobile_node_->MessageReceived(7, "echo");
+  ASSERT_TRUE(mobile_node_->MessageSent(7, "ping"));
+  EXPECT_FALSE(mobile_node_->MessageSent(7, "ping"));
+
+  // ...as does acknowledging a sequence number
+  mobile_node_->MessageAcknowledged(7, first + 10);
+  for (int i = 0; i < 10; i++)
+    EXPECT_TRUE(mobile_node_->MessageSent(7, "ping"));
+  EXPECT_FALSE(mobile_node_->MessageSent(7, "ping"));
+
+  // Sockets are bounded separately, and by payload bytes too
+  NetworkMsg half(MAX_UNACKED_BYTES / 2, 'x');
+  EXPECT_TRUE(mobile_node_->MessageSent(8, half));
+  EXPECT_TRUE(mobile_node_->MessageSent(8, half));
+  EXPECT_FALSE(mobile_node_->MessageSent(8, "x"));
+  mobile_node_->MessageReceived(8, half);
+  EXPECT_TRUE(mobile_node_->MessageSent(8, "x"));
+
+  // Receiving a payload leaves whatever was sent before it outstanding
+  EXPECT_TRUE(mobile_node_->MessageSent(9, half));
+  EXPECT_TRUE(mobile_node_->MessageSent(9, "echo"));
+  mobile_node_->MessageReceived(9, "echo");
+  EXPECT_TRUE(mobile_node_->MessageSent(9, half));
+  EXPECT_FALSE(mobile_node_->MessageSent(9, "x"));
+
+  ASSERT_FALSE(mobile_node_->ShutDown("Normal termination"));
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -9,6 +9,7 @@
  **/
 
 #include <pthread.h>
+#include <dirent.h>
 #include <gtest/gtest.h>
 #include "RendezvousServer/SimpleRendezvousServer.h"
 
@@ -75,33 +76,45 @@ TEST_F(SimpleRendezvousServerTest, UpdatesAndHandlesSubscribers) {
   ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
                                                 "128.36.232.50"));
 
-  EXPECT_EQ(rendezvous_server_->ChangeSubscription(
+  EXPECT_EQ(rendezvous_server_->Subscribe(
               pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
                                                    GLOB_REGIST_PORT),
               "tic.cs.yale.edu"),
             "");
 
-  EXPECT_EQ(rendezvous_server_->ChangeSubscription(
+  EXPECT_EQ(rendezvous_server_->Subscribe(
               pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
                                                    GLOB_REGIST_PORT),
              "tick.cs.yale.edu"),
             "128.36.232.50");
 
-  EXPECT_NE(rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].find(
+  EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").count(
                 pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
                                                      GLOB_REGIST_PORT)),
-            rendezvous_server_->subscriptions_["tick.cs.yale.edu"].end());
-  EXPECT_EQ(rendezvous_server_->ChangeSubscription(
+            1u);
+  // Subscribing again (say, a retransmission) changes nothing...
+  EXPECT_EQ(rendezvous_server_->Subscribe(
               pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
                                                    GLOB_REGIST_PORT),
               "tick.cs.yale.edu"),
             "128.36.232.50");
-  EXPECT_EQ(rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].find(
+  EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").count(
                 pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
                                                      GLOB_REGIST_PORT)),
-            rendezvous_server_->subscriptions_["tick.cs.yale.edu"].end());
+            1u);
+
+  // ...and neither does unsubscribing twice
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(rendezvous_server_->Unsubscribe(
+                pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                     GLOB_REGIST_PORT),
+                "tick.cs.yale.edu"),
+              "128.36.232.50");
+    EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").count(
+                  pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                       GLOB_REGIST_PORT)),
+              0u);
+  }
 
   ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
 }
@@ -168,16 +181,15 @@ TEST_F(SimpleRendezvousServerTest, HandlesNetworkRequests) {
 #endif
   EXPECT_EQ(string(lookup_buffer), IntToIPString(GetCurrentIPAddress()));
 
-  EXPECT_NE(rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].find(
+  EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").count(
                 pair<LogicalAddress, unsigned short>(
                   IntToIPName(GetCurrentIPAddress()), sending_info.sin_port)),
-            rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].end());
+            1u);
 
   // Send the lookup a final time to unsubscribe
-  strncpy(lookup_buffer, 
-    (IntToIPName(GetCurrentIPAddress()) + "|tick.cs.yale.edu").c_str(),
+  strncpy(lookup_buffer,
+    (IntToIPName(GetCurrentIPAddress()) + "|tick.cs.yale.edu|" +
+     TEXT_UNSUBSCRIBE).c_str(),
     sizeof(lookup_buffer));
 #ifdef UDP_APPLICATION
   sendto(sender, lookup_buffer, sizeof(lookup_buffer), 0,
@@ -192,12 +204,10 @@ TEST_F(SimpleRendezvousServerTest, HandlesNetworkRequests) {
 #endif
 
   EXPECT_EQ(string(lookup_buffer), IntToIPString(GetCurrentIPAddress()));
-  EXPECT_EQ(rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].find(
+  EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").count(
                 pair<LogicalAddress, unsigned short>(
                   IntToIPName(GetCurrentIPAddress()), sending_info.sin_port)),
-            rendezvous_server_->subscriptions_[
-              "tick.cs.yale.edu"].end());
+            0u);
 
   /** @todo  Need to check that updating peers works when the location moves **/
   Log(stderr, ERROR, "We still don't support updating peers...");
@@ -205,6 +215,927 @@ TEST_F(SimpleRendezvousServerTest, HandlesNetworkRequests) {
   ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
 }
 
+/**
+ * @test    Ensure that a burst of registrations is drained in one wakeup
+ **/
+TEST_F(SimpleRendezvousServerTest, DrainsBurstsOfRequests) {
+  int sender = socket(domain_, transport_layer_, protocol_);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  server.sin_port = htons(GLOB_REGIST_PORT);
+  socklen_t server_size = sizeof(server);
+
+  // Queue up the whole burst before reading any of the replies
+  char buffer[4096] = "tick.cs.yale.edu";
+  for (int i = 0; i < 32; i++) {
+#ifdef UDP_APPLICATION
+    sendto(sender, buffer, strlen(buffer) + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), server_size);
+#endif
+  }
+
+  struct timeval timeout = { 1, 0 };
+  setsockopt(sender, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int replies = 0;
+  for (int i = 0; i < 32; i++) {
+#ifdef UDP_APPLICATION
+    if (recvfrom(sender, buffer, sizeof(buffer), 0, NULL, NULL) > 0)
+      replies++;
+#endif
+  }
+  EXPECT_EQ(replies, 32);
+
+  ASSERT_FALSE(close(sender));
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that location updates reach every subscriber without opening
+ *          a new socket for each update
+ **/
+TEST_F(SimpleRendezvousServerTest, FansOutOverOneSocket) {
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.50"));
+
+  // Subscribe a handful of local sockets to tick
+  int subscribers[8];
+  struct timeval timeout = { 1, 0 };
+  for (int i = 0; i < 8; i++) {
+    subscribers[i] = socket(domain_, transport_layer_, protocol_);
+    setsockopt(subscribers[i], SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = domain_;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t local_size = sizeof(local);
+    ASSERT_FALSE(bind(subscribers[i], reinterpret_cast<struct sockaddr*>(&local),
+                      local_size));
+    getsockname(subscribers[i], reinterpret_cast<struct sockaddr*>(&local),
+                &local_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "sub%d.cs.yale.edu", i);
+    ASSERT_TRUE(rendezvous_server_->UpdateAddress(name, "127.0.0.1"));
+    EXPECT_EQ(rendezvous_server_->Subscribe(
+                pair<LogicalAddress, unsigned short>(name, local.sin_port),
+                "tick.cs.yale.edu"),
+              "128.36.232.50");
+  }
+
+  // Count our open descriptors across a storm of updates
+  int descriptors_before = 0, descriptors_after = 0;
+  DIR* fds = opendir("/proc/self/fd");
+  while (fds != NULL && readdir(fds) != NULL)
+    descriptors_before++;
+  if (fds != NULL)
+    closedir(fds);
+
+  for (int i = 0; i < 100; i++)
+    ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                  "128.36.232.51"));
+
+  fds = opendir("/proc/self/fd");
+  while (fds != NULL && readdir(fds) != NULL)
+    descriptors_after++;
+  if (fds != NULL)
+    closedir(fds);
+  EXPECT_EQ(descriptors_before, descriptors_after);
+
+  char buffer[MAX_DATAGRAM_SIZE];
+  for (int i = 0; i < 8; i++) {
+    int bytes_read = -1;
+#ifdef UDP_APPLICATION
+    bytes_read = recvfrom(subscribers[i], buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+    EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.51");
+    close(subscribers[i]);
+  }
+
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that a subscriber's cached endpoint follows it when it moves
+ **/
+TEST_F(SimpleRendezvousServerTest, PatchesMovedSubscribers) {
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("thad.cs.yale.edu",
+                                                "10.1.2.3"));
+
+  int subscriber = socket(domain_, transport_layer_, protocol_);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(subscriber, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = domain_;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t local_size = sizeof(local);
+  ASSERT_FALSE(bind(subscriber, reinterpret_cast<struct sockaddr*>(&local),
+                    local_size));
+  getsockname(subscriber, reinterpret_cast<struct sockaddr*>(&local),
+              &local_size);
+
+  // The endpoint is resolved once, when thad subscribes...
+  EXPECT_EQ(rendezvous_server_->Subscribe(
+              pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                   local.sin_port),
+              "tick.cs.yale.edu"),
+            "128.36.232.50");
+  RegistryShard* shard = rendezvous_server_->ShardFor("tick.cs.yale.edu");
+  SubscriberList& subscribers =
+    shard->Record(shard->Find("tick.cs.yale.edu")).subscribers;
+  ASSERT_EQ(subscribers.Size(), 1);
+  EXPECT_EQ(subscribers.Endpoints()[0].sin_addr.s_addr,
+            static_cast<unsigned int>(IPStringToInt("10.1.2.3")));
+  EXPECT_EQ(subscribers.Endpoints()[0].sin_port, local.sin_port);
+
+  // ...and patched when thad re-registers from somewhere else
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("thad.cs.yale.edu",
+                                                "127.0.0.1"));
+  EXPECT_EQ(subscribers.Endpoints()[0].sin_addr.s_addr,
+            htonl(INADDR_LOOPBACK));
+
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.51"));
+  char buffer[MAX_DATAGRAM_SIZE];
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.51");
+
+  // The update also names who moved (past the location's terminator)
+  ASSERT_EQ(bytes_read, static_cast<int>(sizeof("128.36.232.51") +
+                                         strlen("tick.cs.yale.edu")));
+  EXPECT_EQ(NetworkMsg(&buffer[sizeof("128.36.232.51")],
+                       strlen("tick.cs.yale.edu")), "tick.cs.yale.edu");
+
+  ASSERT_FALSE(close(subscriber));
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that names are interned once, keep their identifier when
+ *          they re-register, are not interned by failed lookups and that an
+ *          identifier handed to another name no longer stands for the first
+ **/
+TEST_F(SimpleRendezvousServerTest, InternsEachNameOnce) {
+  RegistryShard* shard = rendezvous_server_->ShardFor("tick.cs.yale.edu");
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.50"));
+  NameId id = shard->Find("tick.cs.yale.edu");
+  ASSERT_NE(id, static_cast<NameId>(INVALID_NAME_ID));
+  EXPECT_EQ(rendezvous_server_->ShardFor(id), shard);
+
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.51"));
+  EXPECT_EQ(shard->Find("tick.cs.yale.edu"), id);
+  EXPECT_EQ(shard->Name(id), "tick.cs.yale.edu");
+  EXPECT_EQ(rendezvous_server_->LookupAddress("tick.cs.yale.edu"),
+            "128.36.232.51");
+
+  // Looking up a name that never registered leaves no trace of either name
+  EXPECT_EQ(rendezvous_server_->Subscribe(
+              pair<LogicalAddress, unsigned short>("ghost.cs.yale.edu", 1),
+              "nobody.cs.yale.edu"),
+            "");
+  EXPECT_EQ(rendezvous_server_->ShardFor("ghost.cs.yale.edu")->Find(
+              "ghost.cs.yale.edu"), static_cast<NameId>(INVALID_NAME_ID));
+  EXPECT_EQ(rendezvous_server_->ShardFor("nobody.cs.yale.edu")->Find(
+              "nobody.cs.yale.edu"), static_cast<NameId>(INVALID_NAME_ID));
+
+  NameId unused = shard->Intern("tock.cs.yale.edu");
+  EXPECT_TRUE(shard->Holds(unused, "tock.cs.yale.edu"));
+  ASSERT_TRUE(shard->ForgetIfUnused(unused));
+  NameId reused = shard->Intern("tack.cs.yale.edu");
+  EXPECT_FALSE(shard->Holds(unused, "tock.cs.yale.edu"));
+  EXPECT_TRUE(shard->Holds(reused, "tack.cs.yale.edu"));
+  EXPECT_TRUE(shard->Holds(id, "tick.cs.yale.edu"));
+
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that binary registrations and (pipelined) lookups are
+ *          answered in binary, and that binary subscribers get binary updates
+ **/
+TEST_F(SimpleRendezvousServerTest, SpeaksBinaryProtocol) {
+  int subscriber = socket(domain_, transport_layer_, protocol_);
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = domain_;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_FALSE(bind(subscriber, reinterpret_cast<struct sockaddr*>(&local),
+                    sizeof(local)));
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("thad.cs.yale.edu",
+                                                "127.0.0.1"));
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(GLOB_REGIST_PORT);
+  socklen_t server_size = sizeof(server);
+
+  // Register tick, which should be told where it registered from
+  char buffer[MAX_DATAGRAM_SIZE];
+  WireWriter registration(buffer, sizeof(buffer));
+  ASSERT_TRUE(registration.Append(WIRE_REGISTER, 0, 1, "tick.cs.yale.edu", "",
+                                  0));
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  sendto(subscriber, buffer, registration.Length(), 0,
+         reinterpret_cast<struct sockaddr*>(&server), server_size);
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  WireReader registered(buffer, bytes_read);
+  WireMessage reply;
+  ASSERT_TRUE(registered.Next(&reply));
+  EXPECT_EQ(reply.opcode, WIRE_REGISTERED);
+  EXPECT_EQ(reply.request_id, 1u);
+  EXPECT_EQ(reply.address, static_cast<int>(htonl(INADDR_LOOPBACK)));
+  EXPECT_EQ(rendezvous_server_->LookupAddress("tick.cs.yale.edu"),
+            "127.0.0.1");
+
+  // Two subscriptions in one datagram get two answers in one reply (and a
+  // plain lookup subscribes to nothing)
+  WireWriter lookups(buffer, sizeof(buffer));
+  ASSERT_TRUE(lookups.Append(WIRE_SUBSCRIBE, 0, 2, "thad.cs.yale.edu",
+                             "tick.cs.yale.edu", 0));
+  ASSERT_TRUE(lookups.Append(WIRE_SUBSCRIBE, 0, 3, "thad.cs.yale.edu",
+                             "nobody.cs.yale.edu", 0));
+  ASSERT_TRUE(lookups.Append(WIRE_LOOKUP, 0, 4, "bob.cs.yale.edu",
+                             "tick.cs.yale.edu", 0));
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+#ifdef UDP_APPLICATION
+  sendto(subscriber, buffer, lookups.Length(), 0,
+         reinterpret_cast<struct sockaddr*>(&server), server_size);
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  WireReader looked_up(buffer, bytes_read);
+  ASSERT_TRUE(looked_up.Next(&reply));
+  EXPECT_EQ(reply.opcode, WIRE_SUBSCRIBED);
+  EXPECT_EQ(reply.request_id, 2u);
+  EXPECT_EQ(reply.address, static_cast<int>(htonl(INADDR_LOOPBACK)));
+  ASSERT_TRUE(looked_up.Next(&reply));
+  EXPECT_EQ(reply.request_id, 3u);
+  EXPECT_EQ(reply.flags, WIRE_NOT_FOUND);
+  ASSERT_TRUE(looked_up.Next(&reply));
+  EXPECT_EQ(reply.opcode, WIRE_LOOKED_UP);
+  EXPECT_EQ(reply.request_id, 4u);
+  EXPECT_EQ(reply.address, static_cast<int>(htonl(INADDR_LOOPBACK)));
+  EXPECT_FALSE(looked_up.Next(&reply));
+  EXPECT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").size(), 1u);
+
+  // The subscription was made in binary, so its updates are too
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.51"));
+#ifdef UDP_APPLICATION
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  WireReader updated(buffer, bytes_read);
+  ASSERT_TRUE(updated.Next(&reply));
+  EXPECT_EQ(reply.opcode, WIRE_UPDATE);
+  EXPECT_EQ(string(reply.name, reply.name_length), "tick.cs.yale.edu");
+  EXPECT_EQ(reply.address, IPStringToInt("128.36.232.51"));
+
+  ASSERT_FALSE(close(subscriber));
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that a name whose lease runs out is unregistered, stops
+ *          being sent updates and, once nothing refers to it, is forgotten
+ *          (while a name renewed in the meantime lasts until its new lease)
+ **/
+TEST_F(SimpleRendezvousServerTest, ExpiresLapsedLeases) {
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("thad.cs.yale.edu",
+                                                "128.36.232.51"));
+  EXPECT_EQ(rendezvous_server_->Subscribe(
+              pair<LogicalAddress, unsigned short>("thad.cs.yale.edu", 1),
+              "tick.cs.yale.edu"),
+            "128.36.232.50");
+  ASSERT_EQ(rendezvous_server_->Subscribers("tick.cs.yale.edu").size(), 1u);
+
+  // Renew tick's lease as though it had re-registered ten ticks later
+  RegistryShard* tick_shard = rendezvous_server_->ShardFor("tick.cs.yale.edu");
+  RegistryShard* thad_shard = rendezvous_server_->ShardFor("thad.cs.yale.edu");
+  pthread_mutex_lock(&tick_shard->lock_);
+  tick_shard->Record(tick_shard->Find("tick.cs.yale.edu")).expires += 10;
+  pthread_mutex_unlock(&tick_shard->lock_);
+
+  // Halfway through the lease nothing lapses
+  uint64_t now = GetTime();
+  rendezvous_server_->ExpireLeases(now + GLOB_LEASE_S * 500);
+  EXPECT_EQ(rendezvous_server_->LookupAddress("thad.cs.yale.edu"),
+            "128.36.232.51");
+
+  // Once thad's lease is up it is gone along with its subscription
+  uint64_t lapsed = now + (GLOB_LEASE_S + 2) * 1000;
+  rendezvous_server_->ExpireLeases(lapsed);
+  EXPECT_EQ(rendezvous_server_->LookupAddress("thad.cs.yale.edu"), "");
+  EXPECT_TRUE(rendezvous_server_->Subscribers("tick.cs.yale.edu").empty());
+  EXPECT_EQ(thad_shard->Find("thad.cs.yale.edu"),
+            static_cast<NameId>(INVALID_NAME_ID));
+  EXPECT_EQ(rendezvous_server_->LookupAddress("tick.cs.yale.edu"),
+            "128.36.232.50");
+
+  // ...and tick's renewed lease runs out in its own time
+  rendezvous_server_->ExpireLeases(lapsed + 10 * LEASE_TICK_MS);
+  EXPECT_EQ(rendezvous_server_->LookupAddress("tick.cs.yale.edu"), "");
+  EXPECT_EQ(tick_shard->Find("tick.cs.yale.edu"),
+            static_cast<NameId>(INVALID_NAME_ID));
+
+  // A lapsed name need only register again
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.52"));
+  EXPECT_EQ(rendezvous_server_->LookupAddress("tick.cs.yale.edu"),
+            "128.36.232.52");
+
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that each subscription lapses on its own unless subscribed
+ *          to again, even while its subscriber keeps renewing its name
+ **/
+TEST_F(SimpleRendezvousServerTest, ExpiresLapsedSubscriptions) {
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("tick.cs.yale.edu",
+                                                "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server_->UpdateAddress("thad.cs.yale.edu",
+                                                "128.36.232.51"));
+  for (unsigned short port = 1; port <= 2; port++)
+    EXPECT_EQ(rendezvous_server_->Subscribe(
+                pair<LogicalAddress, unsigned short>("thad.cs.yale.edu", port),
+                "tick.cs.yale.edu"),
+              "128.36.232.50");
+
+  // Both names renew for twenty ticks more, but only port 2 subscribes again
+  RegistryShard* tick_shard = rendezvous_server_->ShardFor("tick.cs.yale.edu");
+  RegistryShard* thad_shard = rendezvous_server_->ShardFor("thad.cs.yale.edu");
+  NameId thad = thad_shard->Find("thad.cs.yale.edu");
+  uint64_t now = GetTime();
+  pthread_mutex_lock(&tick_shard->lock_);
+  NameRecord& tick_record =
+    tick_shard->Record(tick_shard->Find("tick.cs.yale.edu"));
+  tick_record.expires += 20;
+  tick_record.subscribers.Renew(SubscriberId(thad, 2),
+    (now + GLOB_LEASE_S * 1000) / LEASE_TICK_MS + 10);
+  pthread_mutex_unlock(&tick_shard->lock_);
+  pthread_mutex_lock(&thad_shard->lock_);
+  thad_shard->Record(thad).expires += 20;
+  pthread_mutex_unlock(&thad_shard->lock_);
+
+  // The subscription from the old port lapses by itself...
+  rendezvous_server_->ExpireLeases(now + (GLOB_LEASE_S + 2) * 1000);
+  set< pair<LogicalAddress, unsigned short> > subscribers =
+    rendezvous_server_->Subscribers("tick.cs.yale.edu");
+  ASSERT_EQ(subscribers.size(), 1u);
+  EXPECT_EQ(subscribers.begin()->second, 2);
+  pthread_mutex_lock(&thad_shard->lock_);
+  EXPECT_EQ(thad_shard->Record(thad).following.size(), 1u);
+  pthread_mutex_unlock(&thad_shard->lock_);
+
+  // ...and the renewed one when its own lease is up
+  rendezvous_server_->ExpireLeases(now + (GLOB_LEASE_S + 12) * 1000);
+  EXPECT_TRUE(rendezvous_server_->Subscribers("tick.cs.yale.edu").empty());
+  EXPECT_EQ(rendezvous_server_->LookupAddress("thad.cs.yale.edu"),
+            "128.36.232.51");
+
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that nodes leaving together (in one binary datagram) are
+ *          unregistered and dropped from everything they follow
+ **/
+TEST_F(SimpleRendezvousServerTest, DropsDepartedNodesInBulk) {
+  const char* names[] = { "tick.cs.yale.edu", "thad.cs.yale.edu",
+                          "bob.cs.yale.edu" };
+  for (int i = 0; i < 3; i++)
+    ASSERT_TRUE(rendezvous_server_->UpdateAddress(names[i], "127.0.0.1"));
+
+  // Thad follows tick from two ports, and bob follows both of them
+  for (unsigned short port = 1; port <= 2; port++)
+    rendezvous_server_->Subscribe(
+      pair<LogicalAddress, unsigned short>(names[1], port), names[0]);
+  rendezvous_server_->Subscribe(
+    pair<LogicalAddress, unsigned short>(names[2], 1), names[0]);
+  rendezvous_server_->Subscribe(
+    pair<LogicalAddress, unsigned short>(names[2], 1), names[1]);
+  ASSERT_EQ(rendezvous_server_->Subscribers(names[0]).size(), 3u);
+
+  int departing = socket(domain_, transport_layer_, protocol_);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = domain_;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(GLOB_REGIST_PORT);
+
+  char buffer[MAX_DATAGRAM_SIZE];
+  WireWriter departures(buffer, sizeof(buffer));
+  ASSERT_TRUE(departures.Append(WIRE_DEREGISTER, 0, 1, names[1], "", 0));
+  ASSERT_TRUE(departures.Append(WIRE_DEREGISTER, 0, 2, names[2], "", 0));
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  sendto(departing, buffer, departures.Length(), 0,
+         reinterpret_cast<struct sockaddr*>(&server), sizeof(server));
+  bytes_read = recvfrom(departing, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  WireReader deregistered(buffer, bytes_read);
+  WireMessage reply;
+  for (uint32_t request_id = 1; request_id <= 2; request_id++) {
+    ASSERT_TRUE(deregistered.Next(&reply));
+    EXPECT_EQ(reply.opcode, WIRE_DEREGISTERED);
+    EXPECT_EQ(reply.request_id, request_id);
+  }
+  EXPECT_FALSE(deregistered.Next(&reply));
+
+  // Both are gone and nobody is left following tick
+  EXPECT_EQ(rendezvous_server_->LookupAddress(names[1]), "");
+  EXPECT_EQ(rendezvous_server_->LookupAddress(names[2]), "");
+  EXPECT_TRUE(rendezvous_server_->Subscribers(names[0]).empty());
+  EXPECT_TRUE(rendezvous_server_->Subscribers(names[1]).empty());
+  EXPECT_EQ(rendezvous_server_->LookupAddress(names[0]), "127.0.0.1");
+
+  ASSERT_FALSE(close(departing));
+  ASSERT_FALSE(rendezvous_server_->ShutDown("Normal termination"));
+}
+
+/**
+ * @test    Ensure that subscribers are found and removed by identity while
+ *          the endpoints stay contiguous and in step with the identities
+ **/
+TEST(SimpleRendezvousServerSubscriberListTest, IndexesSubscribers) {
+  SubscriberList subscribers;
+  for (NameId name = 0; name < 100; name++)
+    for (unsigned short port = 1; port <= 2; port++)
+      subscribers.Add(SubscriberId(name, port), name, 0);
+  ASSERT_EQ(subscribers.Size(), 200);
+
+  // Take out every port 1 and everyone from name 50 on
+  for (NameId name = 0; name < 100; name++)
+    subscribers.Remove(SubscriberId(name, 1));
+  for (NameId name = 50; name < 100; name++)
+    subscribers.RemoveAll(name);
+  subscribers.Remove(SubscriberId(7, 3));
+  ASSERT_EQ(subscribers.Size(), 50);
+
+  for (NameId name = 0; name < 100; name++) {
+    EXPECT_FALSE(subscribers.Contains(SubscriberId(name, 1)));
+    EXPECT_EQ(subscribers.Contains(SubscriberId(name, 2)), name < 50);
+  }
+  for (int i = 0; i < subscribers.Size(); i++) {
+    const SubscriberId& identity = subscribers.Identities()[i];
+    EXPECT_EQ(subscribers.Endpoints()[i].sin_addr.s_addr,
+              static_cast<in_addr_t>(identity.first));
+    EXPECT_EQ(subscribers.Endpoints()[i].sin_port, identity.second);
+  }
+
+  // A subscriber taken out can come back
+  subscribers.Add(SubscriberId(3, 1), 3, 0);
+  EXPECT_TRUE(subscribers.Contains(SubscriberId(3, 1)));
+  subscribers.Remove(SubscriberId(3, 2));
+  EXPECT_TRUE(subscribers.Contains(SubscriberId(3, 1)));
+  EXPECT_FALSE(subscribers.Contains(SubscriberId(3, 2)));
+}
+
+/**
+ * @test    Ensure that registrations made through one worker are visible to
+ *          lookups served by any other worker
+ **/
+TEST(SimpleRendezvousServerWorkersTest, SharesRegistryAcrossWorkers) {
+  SimpleRendezvousServer* rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 4);
+  pthread_t rendezvous_server_daemon;
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = GLOB_DOM;
+  server.sin_addr.s_addr = GetCurrentIPAddress();
+  socklen_t server_size = sizeof(server);
+
+  // Many source ports so that the kernel spreads us over the workers
+  int senders[16];
+  struct timeval timeout = { 1, 0 };
+  char buffer[MAX_DATAGRAM_SIZE];
+  for (int i = 0; i < 16; i++) {
+    senders[i] = socket(GLOB_DOM, GLOB_TL, GLOB_PROTO);
+    setsockopt(senders[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    server.sin_port = htons(GLOB_REGIST_PORT);
+    snprintf(buffer, sizeof(buffer), "node%d.cs.yale.edu", i);
+#ifdef UDP_APPLICATION
+    sendto(senders[i], buffer, strlen(buffer) + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), server_size);
+    EXPECT_GT(recvfrom(senders[i], buffer, sizeof(buffer), 0, NULL, NULL), 0);
+#endif
+  }
+
+  // Now every node looks up its neighbor through its own socket
+  server.sin_port = htons(GLOB_LOOKUP_PORT);
+  for (int i = 0; i < 16; i++) {
+    snprintf(buffer, sizeof(buffer), "node%d.cs.yale.edu|node%d.cs.yale.edu",
+             i, (i + 1) % 16);
+    int bytes_read = -1;
+#ifdef UDP_APPLICATION
+    sendto(senders[i], buffer, strlen(buffer) + 1, 0,
+           reinterpret_cast<struct sockaddr*>(&server), server_size);
+    bytes_read = recvfrom(senders[i], buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+    EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read),
+              IntToIPString(GetCurrentIPAddress()));
+  }
+
+  for (int i = 0; i < 16; i++) {
+    char subscribee[64];
+    snprintf(subscribee, sizeof(subscribee), "node%d.cs.yale.edu",
+             (i + 1) % 16);
+    EXPECT_EQ(rendezvous_server->Subscribers(subscribee).size(), 1u);
+    close(senders[i]);
+  }
+
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+}
+
+/**
+ * @test    Ensure that a name moving again and again within the coalescing
+ *          window sends its subscribers only its latest address, once the
+ *          window is up
+ **/
+TEST(SimpleRendezvousServerCoalescingTest, CoalescesFlappingUpdates) {
+  SimpleRendezvousServer* rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 1, 200);
+  pthread_t rendezvous_server_daemon;
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  int subscriber = socket(GLOB_DOM, GLOB_TL, GLOB_PROTO);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(subscriber, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = GLOB_DOM;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t local_size = sizeof(local);
+  ASSERT_FALSE(bind(subscriber, reinterpret_cast<struct sockaddr*>(&local),
+                    local_size));
+  getsockname(subscriber, reinterpret_cast<struct sockaddr*>(&local),
+              &local_size);
+
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("tick.cs.yale.edu",
+                                               "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("thad.cs.yale.edu",
+                                               "127.0.0.1"));
+  EXPECT_EQ(rendezvous_server->Subscribe(
+              pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                   local.sin_port),
+              "tick.cs.yale.edu"),
+            "128.36.232.50");
+  usleep(300 * 1000);
+
+  // The first move goes straight out, the flapping after it is held back...
+  uint64_t start = GetTime();
+  const char* flaps[] = { "128.36.232.51", "128.36.232.52", "128.36.232.53",
+                          "128.36.232.54" };
+  for (int i = 0; i < 4; i++)
+    ASSERT_TRUE(rendezvous_server->UpdateAddress("tick.cs.yale.edu",
+                                                 flaps[i]));
+
+  char buffer[MAX_DATAGRAM_SIZE];
+  int bytes_read = -1;
+#ifdef UDP_APPLICATION
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.51");
+
+  // ...until the window is up, when only the latest address is sent
+#ifdef UDP_APPLICATION
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_EQ(Utils::MsgFromDatagram(buffer, bytes_read), "128.36.232.54");
+  EXPECT_GE(GetTime() - start, 150u);
+  EXPECT_LT(GetTime() - start, 600u);
+
+#ifdef UDP_APPLICATION
+  bytes_read = recvfrom(subscriber, buffer, sizeof(buffer), 0, NULL, NULL);
+#endif
+  EXPECT_LT(bytes_read, 0);
+
+  ASSERT_FALSE(close(subscriber));
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+}
+
+/**
+ * @test    Ensure that a restarted RS recovers every registration and
+ *          subscription from its last snapshot and the log written since
+ **/
+TEST(SimpleRendezvousServerPersistenceTest, RecoversAfterRestart) {
+  char state_dir[] = "/tmp/RendezvousServerStateXXXXXX";
+  ASSERT_TRUE(mkdtemp(state_dir) != NULL);
+
+  SimpleRendezvousServer* rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 1, GLOB_COALESCE_MS,
+                               state_dir);
+  pthread_t rendezvous_server_daemon;
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  // Some changes make it into a snapshot...
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("tick.cs.yale.edu",
+                                               "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("thad.cs.yale.edu",
+                                               "127.0.0.1"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("bob.cs.yale.edu",
+                                               "128.36.232.60"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("carol.cs.yale.edu",
+                                               "128.36.232.80"));
+  EXPECT_EQ(rendezvous_server->Subscribe(
+              pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                   GLOB_REGIST_PORT),
+              "tick.cs.yale.edu"),
+            "128.36.232.50");
+  EXPECT_EQ(rendezvous_server->Deregister(
+              vector<LogicalAddress>(1, "bob.cs.yale.edu")), 1);
+  ASSERT_TRUE(rendezvous_server->Snapshot());
+
+  // ...and the rest only into the log
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("tick.cs.yale.edu",
+                                               "128.36.232.51"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("alice.cs.yale.edu",
+                                               "128.36.232.70"));
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+
+  // As would a crash in the middle of a snapshot, leave stale files behind
+  string stale_log = string(state_dir) + "/registry.log.0";
+  string stale_names = string(state_dir) + "/registry.names.7";
+  ASSERT_FALSE(close(open(stale_log.c_str(), O_CREAT | O_WRONLY, 0644)));
+  ASSERT_FALSE(close(open(stale_names.c_str(), O_CREAT | O_WRONLY, 0644)));
+
+  rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 1, GLOB_COALESCE_MS,
+                               state_dir);
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  EXPECT_EQ(rendezvous_server->LookupAddress("tick.cs.yale.edu"),
+            "128.36.232.51");
+  EXPECT_EQ(rendezvous_server->LookupAddress("thad.cs.yale.edu"),
+            "127.0.0.1");
+  EXPECT_EQ(rendezvous_server->LookupAddress("alice.cs.yale.edu"),
+            "128.36.232.70");
+  EXPECT_EQ(rendezvous_server->LookupAddress("bob.cs.yale.edu"), "");
+  EXPECT_NE(access(stale_log.c_str(), F_OK), 0);
+  EXPECT_NE(access(stale_names.c_str(), F_OK), 0);
+  EXPECT_EQ(rendezvous_server->Subscribers("tick.cs.yale.edu").count(
+                pair<LogicalAddress, unsigned short>("thad.cs.yale.edu",
+                                                     GLOB_REGIST_PORT)),
+            1u);
+
+  // Names untouched since the snapshot are served from it in place...
+  EXPECT_EQ(rendezvous_server->LookupAddress("carol.cs.yale.edu"),
+            "128.36.232.80");
+  EXPECT_EQ(rendezvous_server->ShardFor("carol.cs.yale.edu")->Find(
+              "carol.cs.yale.edu"), INVALID_NAME_ID);
+
+  // ...and lapse with it unless they are renewed
+  rendezvous_server->CommitLog(GetTime() + (GLOB_LEASE_S + 2) * 1000);
+  EXPECT_EQ(rendezvous_server->LookupAddress("carol.cs.yale.edu"), "");
+
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+
+  // Clean up whatever the two servers left behind
+  DIR* directory = opendir(state_dir);
+  ASSERT_TRUE(directory != NULL);
+  for (struct dirent* entry; (entry = readdir(directory)) != NULL; ) {
+    if (entry->d_name[0] != '.')
+      unlink((string(state_dir) + "/" + entry->d_name).c_str());
+  }
+  closedir(directory);
+  ASSERT_FALSE(rmdir(state_dir));
+}
+
+/**
+ * @test    Ensure that a subscription which lapses and is subscribed to again
+ *          before its subscriber's reverse index catches up is still there
+ *          once the RS restarts from its log
+ **/
+TEST(SimpleRendezvousServerPersistenceTest, LogsLapsesAheadOfResubscriptions) {
+  char state_dir[] = "/tmp/RendezvousServerStateXXXXXX";
+  ASSERT_TRUE(mkdtemp(state_dir) != NULL);
+
+  SimpleRendezvousServer* rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 1, GLOB_COALESCE_MS,
+                               state_dir);
+  pthread_t rendezvous_server_daemon;
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  pair<LogicalAddress, unsigned short> subscriber("thad.cs.yale.edu",
+                                                  GLOB_REGIST_PORT);
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("tick.cs.yale.edu",
+                                               "128.36.232.50"));
+  ASSERT_TRUE(rendezvous_server->UpdateAddress("thad.cs.yale.edu",
+                                               "127.0.0.1"));
+  EXPECT_EQ(rendezvous_server->Subscribe(subscriber, "tick.cs.yale.edu"),
+            "128.36.232.50");
+
+  // The subscription lapses...
+  RegistryShard* tick_shard = rendezvous_server->ShardFor("tick.cs.yale.edu");
+  RegistryShard* thad_shard = rendezvous_server->ShardFor("thad.cs.yale.edu");
+  vector<NameId> due[REGISTRY_SHARDS];
+  pthread_mutex_lock(&tick_shard->lock_);
+  NameId tick = tick_shard->Find("tick.cs.yale.edu");
+  uint64_t lapsed = tick_shard->Record(tick).subscriptions_due;
+  pthread_mutex_unlock(&tick_shard->lock_);
+  due[tick & (REGISTRY_SHARDS - 1)].push_back(tick);
+  vector<LapsedSubscription> ended[REGISTRY_SHARDS];
+  rendezvous_server->LapseSubscriptions(lapsed, due, ended);
+  EXPECT_TRUE(rendezvous_server->Subscribers("tick.cs.yale.edu").empty());
+
+  // ...is subscribed to again, and only then leaves the reverse index
+  EXPECT_EQ(rendezvous_server->Subscribe(subscriber, "tick.cs.yale.edu"),
+            "128.36.232.50");
+  rendezvous_server->Unfollow(ended);
+  pthread_mutex_lock(&thad_shard->lock_);
+  vector<NameId>& following =
+    thad_shard->Record(thad_shard->Find("thad.cs.yale.edu")).following;
+  EXPECT_TRUE(std::find(following.begin(), following.end(), tick) !=
+              following.end());
+  pthread_mutex_unlock(&thad_shard->lock_);
+
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+
+  rendezvous_server =
+    new SimpleRendezvousServer(GLOB_BATCH_SIZE, 1, GLOB_COALESCE_MS,
+                               state_dir);
+  pthread_create(&rendezvous_server_daemon, NULL, &RunRendezvousServerThread,
+                 rendezvous_server);
+  sleep(1);
+
+  EXPECT_EQ(rendezvous_server->Subscribers("tick.cs.yale.edu").count(
+              subscriber), 1u);
+
+  ASSERT_FALSE(rendezvous_server->ShutDown("Normal termination"));
+  pthread_join(rendezvous_server_daemon, NULL);
+  delete rendezvous_server;
+
+  // Clean up whatever the two servers left behind
+  DIR* directory = opendir(state_dir);
+  ASSERT_TRUE(directory != NULL);
+  for (struct dirent* entry; (entry = readdir(directory)) != NULL; ) {
+    if (entry->d_name[0] != '.')
+      unlink((string(state_dir) + "/" + entry->d_name).c_str());
+  }
+  closedir(directory);
+  ASSERT_FALSE(rmdir(state_dir));
+}
+
+/**
+ * Counts the records read back from a RecordLog
+ **/
+class RecordCounter : public RecordHandler {
+ public:
+  RecordCounter() : records_(0) {}
+  virtual void HandleRecord(uint8_t type, const char* data, int length) {
+    records_++;
+  }
+  int records_;
+};
+
+/**
+ * @test    Ensure that a log is only rotated once every record appended to it
+ *          is durable, and that records it could not write are not counted
+ **/
+TEST(SimpleRendezvousServerPersistenceTest, RotatesOnlyWholeLogs) {
+  char state_dir[] = "/tmp/RendezvousServerStateXXXXXX";
+  ASSERT_TRUE(mkdtemp(state_dir) != NULL);
+  string first = string(state_dir) + "/first", next = first + ".next";
+
+  // A file that takes nothing keeps the log (and its records) where it is...
+  RecordLog log;
+  ASSERT_TRUE(log.Open("/dev/full"));
+  log.Append(CHANGE_REGISTER, "tick", 4);
+  EXPECT_FALSE(log.Rotate(next));
+  EXPECT_FALSE(log.Commit());
+  EXPECT_EQ(log.Bytes(), 0u);
+
+  // ...while one that does is finished before the next one is started
+  ASSERT_TRUE(log.Open(first));
+  log.Append(CHANGE_REGISTER, "tick", 4);
+  log.Append(CHANGE_REGISTER, "thad", 4);
+  EXPECT_TRUE(log.Rotate(next));
+  log.Close();
+  RecordCounter counter;
+  EXPECT_EQ(RecordLog::Replay(first, &counter), 2);
+  EXPECT_EQ(RecordLog::Replay(next, &counter), 0);
+
+  ASSERT_FALSE(unlink(first.c_str()));
+  ASSERT_FALSE(unlink(next.c_str()));
+  ASSERT_FALSE(rmdir(state_dir));
+}
+
+/**
+ * @test    Ensure that the filter in front of every shard's names never turns
+ *          away a name it holds, forgets names along with the table, and
+ *          turns away nearly every name it has never held
+ **/
+TEST(SimpleRendezvousServerFilterTest, FiltersUnknownNames) {
+  NameTable names;
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    ASSERT_EQ(names.Intern(name), static_cast<NameId>(i));
+  }
+  for (int i = 0; i < 20000; i += 2) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    names.Forget(names.Find(name));
+  }
+
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    EXPECT_EQ(names.Find(name) == INVALID_NAME_ID, i % 2 == 0);
+  }
+
+  // A filter big enough for every name takes them all...
+  CuckooFilter filter(4096);
+  for (int i = 1; i < 20000; i += 2) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    ASSERT_TRUE(filter.Add(hash<LogicalAddress>()(name)));
+  }
+
+  // ...and turns away nearly everything else
+  int false_positives = 0;
+  for (int i = 0; i < 20000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "ghost%d.cs.yale.edu", i);
+    if (filter.MayContain(hash<LogicalAddress>()(name)))
+      false_positives++;
+  }
+  EXPECT_EQ(filter.Size(), 10000u);
+  EXPECT_LT(false_positives, 20);
+
+  for (int i = 1; i < 20000; i += 2) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    filter.Remove(hash<LogicalAddress>()(name));
+  }
+  EXPECT_EQ(filter.Size(), 0u);
+}
+
+/**
+ * @test    Ensure that the names of a single shard (whose hashes all end in
+ *          the same bits) spread over their filter rather than blowing it up
+ **/
+TEST(SimpleRendezvousServerFilterTest, SpreadsOneShardsNames) {
+  NameTable names;
+  int interned = 0;
+  for (int i = 0; interned < 20000; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "node%d.cs.yale.edu", i);
+    if (hash<LogicalAddress>()(name) % REGISTRY_SHARDS == 0) {
+      names.Intern(name);
+      interned++;
+    }
+  }
+
+  // The filter is never let past 7/8 full, so this is the least it can be
+  const CuckooFilter& filter = names.Filter();
+  EXPECT_EQ(filter.Size(), 20000u);
+  EXPECT_EQ(filter.Capacity(), 32768u);
+  EXPECT_GT(2 * filter.Size(), filter.Capacity());
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();